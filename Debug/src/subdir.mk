@@ -5,36 +5,69 @@
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
 ../src/agw_tnc.c \
+../src/alog_v2.c \
 ../src/ax25_tools.c \
+../src/cmd_dispatch.c \
+../src/cmd_journal.c \
 ../src/crc.c \
+../src/frame_trace.c \
 ../src/hmac_sha256.c \
 ../src/iors_command.c \
 ../src/iors_log.c \
+../src/iors_log_reader.c \
+../src/iors_log_recover.c \
+../src/iors_metrics.c \
+../src/iors_time.c \
+../src/latency_hist.c \
 ../src/keyfile.c \
 ../src/sha256.c \
-../src/str_util.c 
+../src/span_trace.c \
+../src/str_util.c \
+../src/tree_hash.c 
 
 C_DEPS += \
 ./src/agw_tnc.d \
+./src/alog_v2.d \
 ./src/ax25_tools.d \
+./src/cmd_dispatch.d \
+./src/cmd_journal.d \
 ./src/crc.d \
+./src/frame_trace.d \
 ./src/hmac_sha256.d \
 ./src/iors_command.d \
 ./src/iors_log.d \
+./src/iors_log_reader.d \
+./src/iors_log_recover.d \
+./src/iors_metrics.d \
+./src/iors_time.d \
+./src/latency_hist.d \
 ./src/keyfile.d \
 ./src/sha256.d \
-./src/str_util.d 
+./src/span_trace.d \
+./src/str_util.d \
+./src/tree_hash.d 
 
 OBJS += \
 ./src/agw_tnc.o \
+./src/alog_v2.o \
 ./src/ax25_tools.o \
+./src/cmd_dispatch.o \
+./src/cmd_journal.o \
 ./src/crc.o \
+./src/frame_trace.o \
 ./src/hmac_sha256.o \
 ./src/iors_command.o \
 ./src/iors_log.o \
+./src/iors_log_reader.o \
+./src/iors_log_recover.o \
+./src/iors_metrics.o \
+./src/iors_time.o \
+./src/latency_hist.o \
 ./src/keyfile.o \
 ./src/sha256.o \
-./src/str_util.o 
+./src/span_trace.o \
+./src/str_util.o \
+./src/tree_hash.o 
 
 
 # Each subdirectory must supply rules for building sources it contributes
@@ -49,7 +82,7 @@ src/%.o: ../src/%.c src/subdir.mk
 clean: clean-src
 
 clean-src:
-	-$(RM) ./src/agw_tnc.d ./src/agw_tnc.o ./src/ax25_tools.d ./src/ax25_tools.o ./src/crc.d ./src/crc.o ./src/hmac_sha256.d ./src/hmac_sha256.o ./src/iors_command.d ./src/iors_command.o ./src/iors_log.d ./src/iors_log.o ./src/keyfile.d ./src/keyfile.o ./src/sha256.d ./src/sha256.o ./src/str_util.d ./src/str_util.o
+	-$(RM) ./src/agw_tnc.d ./src/agw_tnc.o ./src/alog_v2.d ./src/alog_v2.o ./src/ax25_tools.d ./src/ax25_tools.o ./src/cmd_dispatch.d ./src/cmd_dispatch.o ./src/cmd_journal.d ./src/cmd_journal.o ./src/crc.d ./src/crc.o ./src/frame_trace.d ./src/frame_trace.o ./src/hmac_sha256.d ./src/hmac_sha256.o ./src/iors_command.d ./src/iors_command.o ./src/iors_log.d ./src/iors_log.o ./src/iors_log_reader.d ./src/iors_log_reader.o ./src/iors_log_recover.d ./src/iors_log_recover.o ./src/iors_metrics.d ./src/iors_metrics.o ./src/iors_time.d ./src/iors_time.o ./src/latency_hist.d ./src/latency_hist.o ./src/keyfile.d ./src/keyfile.o ./src/sha256.d ./src/sha256.o ./src/span_trace.d ./src/span_trace.o ./src/str_util.d ./src/str_util.o ./src/tree_hash.d ./src/tree_hash.o
 
 .PHONY: clean-src
 
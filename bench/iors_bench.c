@@ -0,0 +1,457 @@
+/*
+ * iors_bench.c
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Microbenchmarks of the functions on the packet, command and log paths.  Build and run them
+ * with "make bench" in the Debug folder.  The library sources are compiled again with -O2 for
+ * the benchmark, so the results do not depend on the -O0 debug build.
+ *
+ * Each benchmark is run in batches of calls, with the batch made large enough to take at least
+ * BENCH_MIN_BATCH_NS so the clock does not dominate short calls.  The latency percentiles are
+ * of the mean time per call in each batch.  The data is fixed, so runs can be compared.  The
+ * results are written as JSON with the details of the CPU and the build.
+ *
+ * Usage: iors_bench [-s samples] [-o results.json] [-f filter]
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+
+#include "common_config.h"
+#include "crc.h"
+#include "sha256.h"
+#include "hmac_sha256.h"
+#include "keyfile.h"
+#include "iors_command.h"
+#include "ax25_tools.h"
+#include "agw_tnc.h"
+#include "iors_log.h"
+#include "str_util.h"
+
+#define BENCH_SAMPLES 2000
+#define BENCH_MIN_BATCH_NS 2000
+#define BENCH_MAX_BATCH (1 << 20)
+#define BENCH_DATA_LEN 1024
+#define BENCH_FRAME_LEN 64
+
+typedef struct {
+	char *name;
+	int bytes; /* Bytes processed by each call, 0 if there is no useful throughput */
+	int (*setup)();
+	void (*run)(uint32_t i);
+	void (*teardown)();
+} BENCH;
+
+/* Defined in iors_command.c */
+extern char last_command_time_path[MAX_FILE_PATH_LEN];
+
+static uint8_t bench_data[BENCH_DATA_LEN];
+static uint8_t bench_key[AUTH_KEY_SIZE];
+static uint8_t bench_hash[SHA256_HASH_SIZE];
+static uint8_t bench_vector[SHA256_HASH_SIZE];
+static uint8_t bench_bad_vector[SHA256_HASH_SIZE];
+static uint32_t bench_date_time;
+static char bench_dir[MAX_FILE_PATH_LEN];
+static char bench_log[MAX_FILE_PATH_LEN];
+static LOG_HANDLE *bench_log_handle;
+static int bench_listen_fd = -1;
+static int bench_tnc_fd = -1;
+static pthread_t bench_tnc_thread;
+static volatile int bench_tnc_running = false;
+static volatile uint32_t bench_sink; /* Results are stored here so the calls are not optimised away */
+
+/* Forward declarations */
+static uint64_t bench_now_ns();
+static int bench_cmp(const void *a, const void *b);
+static void bench_json_str(FILE *out, const char *str);
+static void bench_cpu_info(FILE *out);
+static int bench_tnc_open();
+static void bench_tnc_close();
+
+/*
+ * The benchmarks.  Each run function makes one call.
+ */
+static void bench_gen_crc_64(uint32_t i) {
+	bench_sink += gen_crc(bench_data, 64);
+}
+
+static void bench_gen_crc_1k(uint32_t i) {
+	bench_sink += gen_crc(bench_data, BENCH_DATA_LEN);
+}
+
+static void bench_sha256_64(uint32_t i) {
+	Sha256Calculate(bench_data, 64, (SHA256_HASH *)bench_hash);
+}
+
+static void bench_sha256_1k(uint32_t i) {
+	Sha256Calculate(bench_data, BENCH_DATA_LEN, (SHA256_HASH *)bench_hash);
+}
+
+static void bench_hmac_sha256_sw_command(uint32_t i) {
+	hmac_sha256(bench_key, AUTH_KEY_SIZE, bench_data, SW_COMMAND_SIZE, bench_hash, sizeof(bench_hash));
+}
+
+static int bench_auth_setup() {
+	static int accepted = false;
+	if (accepted) return EXIT_SUCCESS;
+	strlcpy(last_command_time_path, bench_dir, sizeof(last_command_time_path));
+	strlcat(last_command_time_path, "/last_command_time.dat", sizeof(last_command_time_path));
+	if (keyring_add(1, bench_key, 0, 0) != EXIT_SUCCESS) return EXIT_FAILURE;
+	bench_date_time = MIN_COMMAND_TIME + 1000;
+	memcpy(bench_data, &bench_date_time, sizeof(bench_date_time));
+	hmac_sha256(bench_key, AUTH_KEY_SIZE, bench_data, SW_COMMAND_SIZE, bench_vector, sizeof(bench_vector));
+	memcpy(bench_bad_vector, bench_vector, sizeof(bench_bad_vector));
+	bench_bad_vector[0] ^= 0xff;
+	/* Accept the command once so that every later call is a duplicate and nothing is saved */
+	if (AuthenticatePacket(bench_date_time, bench_data, SW_COMMAND_SIZE, bench_vector) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	accepted = true;
+	return EXIT_SUCCESS;
+}
+
+static void bench_auth_duplicate(uint32_t i) {
+	bench_sink += AuthenticatePacket(bench_date_time, bench_data, SW_COMMAND_SIZE, bench_vector);
+}
+
+static void bench_auth_bad_hmac(uint32_t i) {
+	bench_sink += AuthenticatePacket(bench_date_time, bench_data, SW_COMMAND_SIZE, bench_bad_vector);
+}
+
+static void bench_encode_call(uint32_t i) {
+	unsigned char buf[7];
+	bench_sink += encode_call("PFS3-12", buf, i & 1, 0);
+}
+
+static void bench_encode_decode_call(uint32_t i) {
+	unsigned char buf[7];
+	char call[10]; /* 6 characters, '-', a 2 digit SSID and the terminator */
+	bench_sink += encode_call("PFS3-12", buf, i & 1, 0);
+	bench_sink += decode_call(buf, call) + call[0];
+}
+
+static int bench_log_setup() {
+	strlcpy(bench_log, bench_dir, sizeof(bench_log));
+	strlcat(bench_log, "/bench_log", sizeof(bench_log));
+	log_set_level(INFO_LOG);
+	bench_log_handle = log_open(bench_log);
+	return bench_log_handle == NULL ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void bench_log_teardown() {
+	log_close_all();
+	char tmp_filename[MAX_FILE_PATH_LEN];
+	log_make_tmp_filename(bench_log, tmp_filename);
+	unlink(tmp_filename);
+}
+
+static void bench_log_append(uint32_t i) {
+	log_handle_append(bench_log_handle, bench_data, 16);
+}
+
+static void bench_log_alog1(uint32_t i) {
+	log_handle_alog1(bench_log_handle, INFO_LOG, ALOG_FS_STARTUP, i);
+}
+
+static void bench_log_alog2(uint32_t i) {
+	log_handle_alog2(bench_log_handle, INFO_LOG, ALOG_FS_STARTUP, "G0KLA", 1, i);
+}
+
+static void bench_log_alog2f(uint32_t i) {
+	log_handle_alog2f(bench_log_handle, INFO_LOG, ALOG_FS_STARTUP, "G0KLA", 1, i, i, i, i, i, i);
+}
+
+static void bench_agw_build(uint32_t i) {
+	send_raw_packet("PFS3-12", "G0KLA", 0xbb, bench_data, BENCH_FRAME_LEN);
+}
+
+static void bench_agw_parse(uint32_t i) {
+	struct t_agw_frame_ptr frame;
+	tnc_receive_packet();
+	if (get_next_frame(i % MAX_RX_QUEUE_LEN, &frame) == EXIT_SUCCESS)
+		bench_sink += frame.header->data_len;
+}
+
+/* Read and throw away what the TNC is sent */
+static void *bench_tnc_drain(void *arg) {
+	uint8_t buf[4096];
+	while (read(bench_tnc_fd, buf, sizeof(buf)) > 0)
+		;
+	return NULL;
+}
+
+/* Act as the TNC and send K frames as fast as they are read */
+static void *bench_tnc_feed(void *arg) {
+	uint8_t buf[sizeof(struct t_agw_header) + BENCH_FRAME_LEN];
+	struct t_agw_header header;
+	memset(&header, 0, sizeof(header));
+	header.data_kind = 'K';
+	header.pid = 0xf0;
+	strlcpy(header.call_from, "G0KLA", sizeof(header.call_from));
+	strlcpy(header.call_to, "PFS3-12", sizeof(header.call_to));
+	header.data_len = BENCH_FRAME_LEN;
+	memcpy(buf, &header, sizeof(header));
+	memcpy(buf + sizeof(header), bench_data, BENCH_FRAME_LEN);
+	while (bench_tnc_running)
+		if (send(bench_tnc_fd, buf, sizeof(buf), MSG_NOSIGNAL) != sizeof(buf))
+			break;
+	return NULL;
+}
+
+static int bench_agw_build_setup() {
+	if (bench_tnc_open() != EXIT_SUCCESS) return EXIT_FAILURE;
+	return pthread_create(&bench_tnc_thread, NULL, bench_tnc_drain, NULL) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int bench_agw_parse_setup() {
+	if (bench_tnc_open() != EXIT_SUCCESS) return EXIT_FAILURE;
+	bench_tnc_running = true;
+	return pthread_create(&bench_tnc_thread, NULL, bench_tnc_feed, NULL) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static BENCH benches[] = {
+	{"gen_crc_64", 64, NULL, bench_gen_crc_64, NULL}
+	,{"gen_crc_1k", BENCH_DATA_LEN, NULL, bench_gen_crc_1k, NULL}
+	,{"Sha256Calculate_64", 64, NULL, bench_sha256_64, NULL}
+	,{"Sha256Calculate_1k", BENCH_DATA_LEN, NULL, bench_sha256_1k, NULL}
+	,{"hmac_sha256_sw_command", SW_COMMAND_SIZE, NULL, bench_hmac_sha256_sw_command, NULL}
+	,{"AuthenticatePacket_duplicate", SW_COMMAND_SIZE, bench_auth_setup, bench_auth_duplicate, NULL}
+	,{"AuthenticatePacket_bad_hmac", SW_COMMAND_SIZE, bench_auth_setup, bench_auth_bad_hmac, NULL}
+	,{"encode_call", 0, NULL, bench_encode_call, NULL}
+	,{"encode_decode_call", 0, NULL, bench_encode_decode_call, NULL}
+	,{"log_append_16", 16, bench_log_setup, bench_log_append, bench_log_teardown}
+	,{"log_alog1", sizeof(struct ALOG_1), bench_log_setup, bench_log_alog1, bench_log_teardown}
+	,{"log_alog2", sizeof(struct ALOG_2), bench_log_setup, bench_log_alog2, bench_log_teardown}
+	,{"log_alog2f", sizeof(struct ALOG_2F), bench_log_setup, bench_log_alog2f, bench_log_teardown}
+	,{"agw_build_send_raw_packet", BENCH_FRAME_LEN, bench_agw_build_setup, bench_agw_build, bench_tnc_close}
+	,{"agw_parse_tnc_receive_packet", BENCH_FRAME_LEN, bench_agw_parse_setup, bench_agw_parse, bench_tnc_close}
+};
+
+/**
+ * bench_run()
+ * Run one benchmark and write its result as a JSON object
+ */
+static void bench_run(BENCH *bench, int num_samples, FILE *out) {
+	fprintf(out, "    {\"name\": ");
+	bench_json_str(out, bench->name);
+	if (bench->setup != NULL && bench->setup() != EXIT_SUCCESS) {
+		fprintf(out, ", \"skipped\": true}");
+		if (bench->teardown != NULL) bench->teardown();
+		return;
+	}
+
+	/* Warm up and find the batch size */
+	uint32_t i = 0;
+	int batch = 1;
+	while (batch < BENCH_MAX_BATCH) {
+		uint64_t start = bench_now_ns();
+		for (int j = 0; j < batch; j++)
+			bench->run(i++);
+		if (bench_now_ns() - start >= BENCH_MIN_BATCH_NS) break;
+		batch *= 2;
+	}
+
+	double *samples = malloc(num_samples * sizeof(double));
+	uint64_t total_ns = 0;
+	for (int s = 0; s < num_samples; s++) {
+		uint64_t start = bench_now_ns();
+		for (int j = 0; j < batch; j++)
+			bench->run(i++);
+		uint64_t ns = bench_now_ns() - start;
+		total_ns += ns;
+		samples[s] = (double)ns / batch;
+	}
+	if (bench->teardown != NULL) bench->teardown();
+
+	qsort(samples, num_samples, sizeof(double), bench_cmp);
+	double calls = (double)num_samples * batch;
+	double mean = total_ns / calls;
+	fprintf(out, ", \"bytes_per_call\": %d, \"batch\": %d, \"calls\": %.0f, \"calls_per_sec\": %.1f",
+			bench->bytes, batch, calls, 1e9 / mean);
+	if (bench->bytes > 0)
+		fprintf(out, ", \"mb_per_sec\": %.3f", bench->bytes * 1e3 / mean);
+	fprintf(out, ", \"ns_per_call\": {\"mean\": %.1f, \"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}",
+			mean, samples[0], samples[num_samples / 2], samples[num_samples * 90 / 100],
+			samples[num_samples * 99 / 100], samples[num_samples - 1]);
+	free(samples);
+}
+
+int main(int argc, char *argv[]) {
+	int num_samples = BENCH_SAMPLES;
+	char *out_path = NULL;
+	char *filter = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:o:f:h")) != -1) {
+		switch (opt) {
+		case 's':
+			num_samples = atoi(optarg);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s samples] [-o results.json] [-f filter]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (num_samples < 100) num_samples = 100;
+
+	/* The library prints debug messages to stdout.  Keep them out of the timings and the results. */
+	FILE *out = out_path == NULL ? fdopen(dup(STDOUT_FILENO), "w") : fopen(out_path, "w");
+	if (out == NULL) {
+		error_print("Could not open %s\n", out_path == NULL ? "stdout" : out_path);
+		return EXIT_FAILURE;
+	}
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		error_print("Could not redirect stdout\n");
+		return EXIT_FAILURE;
+	}
+	strlcpy(bench_dir, "/tmp/iors_bench.XXXXXX", sizeof(bench_dir));
+	if (mkdtemp(bench_dir) == NULL) {
+		error_print("Could not make a folder for the benchmark files\n");
+		return EXIT_FAILURE;
+	}
+	if (check_command_names() != EXIT_SUCCESS) {
+		error_print("Command name tables are broken\n");
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < BENCH_DATA_LEN; i++)
+		bench_data[i] = (i * 131 + 7) & 0xff;
+	for (int i = 0; i < AUTH_KEY_SIZE; i++)
+		bench_key[i] = i + 1;
+
+	fprintf(out, "{\n  \"version\": ");
+	bench_json_str(out, COMMON_VERSION);
+	fprintf(out, ",\n");
+	bench_cpu_info(out);
+	fprintf(out, "  \"samples\": %d,\n  \"results\": [\n", num_samples);
+	int first = true;
+	for (int b = 0; b < (int)(sizeof(benches) / sizeof(benches[0])); b++) {
+		if (filter != NULL && strstr(benches[b].name, filter) == NULL) continue;
+		if (!first) fprintf(out, ",\n");
+		bench_run(&benches[b], num_samples, out);
+		fflush(out);
+		first = false;
+	}
+	fprintf(out, "\n  ]\n}\n");
+	fclose(out);
+
+	unlink(last_command_time_path);
+	rmdir(bench_dir);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * bench_cpu_info()
+ * Write the machine, CPU and build details that the results depend on
+ */
+static void bench_cpu_info(FILE *out) {
+	struct utsname uts;
+	uname(&uts);
+	time_t now = time(NULL);
+	char date[32];
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	fprintf(out, "  \"date\": \"%s\",\n  \"machine\": ", date);
+	bench_json_str(out, uts.machine);
+	fprintf(out, ",\n  \"kernel\": ");
+	bench_json_str(out, uts.release);
+	fprintf(out, ",\n  \"cpus\": %ld,\n  \"compiler\": ", sysconf(_SC_NPROCESSORS_ONLN));
+	bench_json_str(out, __VERSION__);
+#ifdef __OPTIMIZE__
+	fprintf(out, ",\n  \"optimize\": true,\n");
+#else
+	fprintf(out, ",\n  \"optimize\": false,\n");
+#endif
+
+	/* x86 has model name and flags.  ARM has Features and, on the Pi, Model */
+	char *keys[] = {"model name", "Model", "Hardware", "CPU part", "flags", "Features"};
+	char *names[] = {"cpu_model", "board", "hardware", "cpu_part", "cpu_features", "cpu_features"};
+	int found[6] = {false};
+	FILE *fd = fopen("/proc/cpuinfo", "r");
+	char line[4096];
+	while (fd != NULL && fgets(line, sizeof(line), fd) != NULL) {
+		char *colon = strchr(line, ':');
+		if (colon == NULL) continue;
+		for (int k = 0; k < 6; k++) {
+			int len = strlen(keys[k]);
+			if (found[k] || strncmp(line, keys[k], len) != 0 || (line[len] != ' ' && line[len] != '\t'))
+				continue;
+			if (k == 5 && found[4]) continue;
+			char *value = colon + 1;
+			while (*value == ' ') value++;
+			value[strcspn(value, "\n")] = '\0';
+			fprintf(out, "  \"%s\": ", names[k]);
+			bench_json_str(out, value);
+			fprintf(out, ",\n");
+			found[k] = true;
+		}
+	}
+	if (fd != NULL) fclose(fd);
+}
+
+/* Listen on a local port and connect to it as if it were Direwolf */
+static int bench_tnc_open() {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bench_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (bench_listen_fd == -1) return EXIT_FAILURE;
+	if (bind(bench_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| listen(bench_listen_fd, 1) == -1
+			|| getsockname(bench_listen_fd, (struct sockaddr *)&addr, &len) == -1) {
+		close(bench_listen_fd);
+		return EXIT_FAILURE;
+	}
+	if (tnc_connect("127.0.0.1", ntohs(addr.sin_port), 1200, 5) != EXIT_SUCCESS) {
+		close(bench_listen_fd);
+		return EXIT_FAILURE;
+	}
+	bench_tnc_fd = accept(bench_listen_fd, NULL, NULL);
+	close(bench_listen_fd);
+	return bench_tnc_fd == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void bench_tnc_close() {
+	bench_tnc_running = false;
+	shutdown(bench_tnc_fd, SHUT_RDWR);
+	tnc_close();
+	pthread_join(bench_tnc_thread, NULL);
+	close(bench_tnc_fd);
+}
+
+static uint64_t bench_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_json_str(FILE *out, const char *str) {
+	fputc('"', out);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', out);
+		if ((unsigned char)*str >= ' ')
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
@@ -0,0 +1,69 @@
+/*
+ * alog_v2.h
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Compact encoding of the ALOG events for downlink.  A v2 log decodes back to exactly the
+ * same events as the plain log it came from.
+ *
+ * The file starts with ALOG_V2_MAGIC, a version byte and the timestamp of the first event as a
+ * uint32 in the same byte order as the events.  Each event is then:
+ *    uint8 event code
+ *    uint8 flags, see ALOG_V2_*
+ *    varint timestamp delta from the previous event, or from the header timestamp for the first
+ *       event, zigzag encoded so it can go backwards
+ *    varint serial_no                       if ALOG_V2_SERIAL
+ *    uint8 rxchan                           if ALOG_V2_RXCHAN
+ *    callsign for ALOG_2 and ALOG_2F:
+ *       6 bytes call + uint8 ssid           if ALOG_V2_NEW_CALL, added to the dictionary
+ *       varint dictionary index             otherwise
+ *    vars for ALOG_1F and ALOG_2F:
+ *       uint8 bitmap of the vars that are not zero, var1 is bit 0
+ *       varint for each var in the bitmap
+ * An event with a length that is not one of the four ALOG types is kept as:
+ *    uint8 event code, uint8 ALOG_V2_RAW, varint length, the event bytes
+ *
+ * The dictionary belongs to the file.  It starts empty and a callsign is added the first time
+ * it is seen, until ALOG_V2_MAX_CALLS are held.  After that new callsigns are always sent in
+ * full.  Varints are 7 bits per byte, least significant first, top bit set if more follow.
+ */
+
+#ifndef ALOG_V2_H_
+#define ALOG_V2_H_
+
+#include <stdint.h>
+
+#define ALOG_V2_MAGIC "ALG2"
+#define ALOG_V2_VERSION 2
+#define ALOG_V2_HEADER_SIZE 9
+#define ALOG_V2_MAX_GROWTH 9 /* Most an event can grow by, an ALOG_1F or ALOG_2F with large values */
+#define ALOG_V2_MAX_CALLS 256
+#define ALOG_V2_MAX_ENCODED 300 /* Longest encoding of one event */
+
+/* Flags.  The low 2 bits give the event type */
+#define ALOG_V2_TYPE_1 0
+#define ALOG_V2_TYPE_1F 1
+#define ALOG_V2_TYPE_2 2
+#define ALOG_V2_TYPE_2F 3
+#define ALOG_V2_TYPE_MASK 0x03
+#define ALOG_V2_SERIAL 0x04
+#define ALOG_V2_RXCHAN 0x08
+#define ALOG_V2_NEW_CALL 0x10
+#define ALOG_V2_RAW 0x80
+
+/* State that the encoder and decoder each keep while working through one file */
+typedef struct {
+	uint32_t last_tstamp;
+	int num_calls;
+	uint8_t calls[ALOG_V2_MAX_CALLS][7]; /* 6 byte callsign then ssid */
+} ALOG_V2_STATE;
+
+void alog_v2_init(ALOG_V2_STATE *state);
+int alog_v2_encode_event(ALOG_V2_STATE *state, uint8_t *event, int len, uint8_t *out);
+int alog_v2_decode_event(ALOG_V2_STATE *state, uint8_t *in, uint32_t len, uint8_t *event);
+int64_t alog_v2_encode(uint8_t *data, uint32_t len, uint8_t *out, uint32_t max);
+int alog_v2_decode(uint8_t *data, uint32_t len, void (*callback)(uint8_t *event, int len, void *arg), void *arg);
+int alog_v2_convert_file(char *in_path, char *out_path);
+int alog_v2_expand_file(char *in_path, char *out_path);
+
+#endif /* ALOG_V2_H_ */
@@ -17,6 +17,7 @@ struct t_ax25_header {
 } __attribute__ ((__packed__));
 typedef struct t_ax25_header AX25_HEADER;
 
+int decode_call(unsigned char *c, char *call);
 int encode_call(char *name, unsigned char *buf, int final_call, char command);
 
 #endif /* AX25_TOOLS_H_ */
@@ -0,0 +1,50 @@
+/*
+ * cmd_dispatch.h
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Table driven dispatch of authenticated software commands.  Each program registers a handler
+ * for the commands it supports, with the schema of its arguments.  The arguments are checked
+ * against the schema before the handler is called.
+ */
+
+#ifndef CMD_DISPATCH_H_
+#define CMD_DISPATCH_H_
+
+#include <stdint.h>
+
+#include "iors_command.h"
+
+#define CMD_MAX_ARGS 4
+#define CMD_DISPATCH_MAX_COMMANDS 32 /* Largest number of commands in a name space */
+
+/* Returned by cmd_dispatch() as well as EXIT_SUCCESS, EXIT_FAILURE and EXIT_DUPLICATE */
+#define EXIT_UNKNOWN_COMMAND 3
+#define EXIT_BAD_ARGUMENTS 4
+
+typedef struct {
+	uint16_t min;
+	uint16_t max;
+	char *units; /* For display only, e.g. "secs" */
+} CMD_ARG_SCHEMA;
+
+/* A handler is passed the command and a copy of its arguments, which are within the schema.
+ * It returns EXIT_SUCCESS or EXIT_FAILURE */
+typedef int (*CMD_HANDLER)(SWCmdUplink *uplink, uint16_t *args);
+
+typedef struct {
+	CMD_HANDLER handler;
+	int num_args;
+	CMD_ARG_SCHEMA args[CMD_MAX_ARGS];
+	int idempotent; /* If true then running the command again is harmless, so a duplicate is run */
+} CMD_DISPATCH_ENTRY;
+
+int cmd_register(SWCommandNameSpace name_space, int command, CMD_HANDLER handler,
+		int num_args, const CMD_ARG_SCHEMA *args, int idempotent);
+void cmd_unregister(SWCommandNameSpace name_space, int command);
+CMD_DISPATCH_ENTRY *cmd_get_entry(SWCommandNameSpace name_space, int command);
+int cmd_check_args(SWCmdUplink *uplink);
+int cmd_dispatch(SWCmdUplink *uplink, int auth_rc);
+int cmd_authenticate_and_dispatch(SWCmdUplink *uplink);
+
+#endif /* CMD_DISPATCH_H_ */
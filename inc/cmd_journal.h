@@ -0,0 +1,44 @@
+/*
+ * cmd_journal.h
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Crash safe journal of accepted commands.  The journal is a fixed size file that is
+ * memory mapped and used as a ring of checksummed records.  Each record is written in
+ * place and the page that holds it is synced to disk.  A record that was only partly
+ * written when the power failed has a bad CRC and is ignored at startup.
+ *
+ * Power loss can tear the whole page being written, which would damage the older records
+ * that share it.  So the file holds two copies of the ring.  A record is written and synced
+ * in the first copy and only then in the second, so a page of one copy is never being written
+ * while the same records in the other copy are.  Each copy is on pages of its own, however
+ * large the kernel's pages are.  Every record that has been synced survives
+ * in at least one copy and replay uses the newest valid copy of each slot.
+ */
+
+#ifndef CMD_JOURNAL_H_
+#define CMD_JOURNAL_H_
+
+#include <stdint.h>
+
+#define CMD_JOURNAL_MAGIC 0x434d444a /* CMDJ */
+#define CMD_JOURNAL_RECORDS 128 /* Records in each copy */
+#define CMD_JOURNAL_EXT ".jnl"
+
+typedef struct {
+	uint32_t magic;
+	uint32_t seq; /* Increases by one for every record.  Zero is never used */
+	uint32_t dateTime;
+	uint8_t digest[32]; /* The authentication vector of the command */
+	uint8_t reserved[18];
+	uint16_t crc;
+} __attribute__ ((__packed__)) CMD_JOURNAL_RECORD;
+
+int cmd_journal_open(char *path);
+void cmd_journal_close();
+int cmd_journal_is_open();
+int cmd_journal_append(uint32_t dateTime, uint8_t *digest, int sync);
+int cmd_journal_sync();
+int cmd_journal_replay(void (*callback)(CMD_JOURNAL_RECORD *record, void *arg), void *arg);
+
+#endif /* CMD_JOURNAL_H_ */
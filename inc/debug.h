@@ -45,11 +45,11 @@
 
 /* These are only printed if verbose is on */
 #define verbose_print(fmt, ...) \
-            if (g_verbose) fprintf(stdout, fmt, ##__VA_ARGS__);
+            do { if (g_verbose) fprintf(stdout, fmt, ##__VA_ARGS__); } while (0)
 
 /* These are always printed.  Use sparingly. */
 #define error_print(fmt, ...) \
-            fprintf(stderr, "ERROR: %s:%d:%s(): " fmt, __FILE__, \
-                                __LINE__, __func__, ##__VA_ARGS__);
+            do { fprintf(stderr, "ERROR: %s:%d:%s(): " fmt, __FILE__, \
+                                __LINE__, __func__, ##__VA_ARGS__); } while (0)
 
 #endif /* DEBUG_H_ */
@@ -0,0 +1,61 @@
+/*
+ * frame_trace.h
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Binary trace of the AGW frames sent to and received from the TNC.  Each frame is recorded
+ * as its header fields, a timestamp and the first FRAME_TRACE_SNIPPET_LEN bytes of its data in
+ * a fixed ring of FRAME_TRACE_LEN entries.  Nothing is formatted when a frame is recorded.  The
+ * ring is formatted on demand with frame_trace_dump(), or copied out with frame_trace_snapshot()
+ * by a tool that formats it later.
+ *
+ * Tracing is off until it is enabled for a direction with frame_trace_enable().
+ */
+
+#ifndef FRAME_TRACE_H_
+#define FRAME_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define FRAME_TRACE_LEN 256 /* Must be a power of 2 */
+#define FRAME_TRACE_SNIPPET_LEN 32
+#define FRAME_TRACE_CALL_LEN 10 /* As in the AGW header */
+
+/* Room for the text and the hex of len bytes, as written by frame_trace_format_data() */
+#define FRAME_TRACE_DATA_STR_LEN(len) (4 * (len) + 4)
+
+enum FRAME_TRACE_DIR {
+	FRAME_TRACE_TX
+	,FRAME_TRACE_RX
+	,FRAME_TRACE_NUM_DIRS
+};
+
+typedef struct {
+	uint32_t seq; /* 0 while the entry is being written, otherwise its sequence number + 1 */
+	uint8_t dir;
+	uint8_t kind; /* AGW data kind, e.g. 'K' or 'M' */
+	uint8_t port;
+	uint8_t pid;
+	uint64_t time_ns; /* CLOCK_REALTIME */
+	char call_from[FRAME_TRACE_CALL_LEN];
+	char call_to[FRAME_TRACE_CALL_LEN];
+	int32_t data_len;
+	uint8_t snippet_len;
+	uint8_t snippet[FRAME_TRACE_SNIPPET_LEN];
+} FRAME_TRACE_ENTRY;
+
+void frame_trace_enable(enum FRAME_TRACE_DIR dir, int on);
+int frame_trace_enabled(enum FRAME_TRACE_DIR dir);
+void frame_trace_record(enum FRAME_TRACE_DIR dir, char kind, int port, int pid,
+		const char *call_from, const char *call_to, const unsigned char *data, int len);
+void frame_trace_clear();
+int frame_trace_snapshot(FRAME_TRACE_ENTRY *entries, int max_entries);
+int frame_trace_dump(FILE *out);
+
+int frame_trace_format_hex(const unsigned char *data, int len, char *out);
+int frame_trace_format_data(const unsigned char *data, int len, char *out, int size);
+int frame_trace_format_call(const char *call, char *out);
+int frame_trace_format_entry(FRAME_TRACE_ENTRY *entry, char *out, int size);
+
+#endif /* FRAME_TRACE_H_ */
@@ -11,6 +11,22 @@ extern "C" {
 #endif  // __cplusplus
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/* Size of the buffer used when streaming a file through the HMAC */
+#define HMAC_FILE_BUFFER_SIZE 8192
+
+/*
+ * Incremental HMAC state.  The inner and outer hashes have already absorbed the
+ * key XOR ipad and key XOR opad blocks, so a context can be copied to start a new
+ * HMAC with the same key without touching the key again.
+ */
+typedef struct {
+    Sha256Context inner;
+    Sha256Context outer;
+} HmacSha256Context;
 
 size_t  // Returns the number of bytes written to `out`
 hmac_sha256(
@@ -29,6 +45,58 @@ hmac_sha256(
     void* out,
     const size_t outlen);
 
+void
+hmac_sha256_init(
+    // [out]: The context to initialise
+    HmacSha256Context* ctx,
+
+    // [in]: The key and its length.
+    const void* key,
+    const size_t keylen);
+
+void
+hmac_sha256_update(
+    // [in out]: A context set up with hmac_sha256_init()
+    HmacSha256Context* ctx,
+
+    // [in]: The next block of data.  Can be called any number of times.
+    const void* data,
+    const uint64_t datalen);
+
+size_t  // Returns the number of bytes written to `out`
+hmac_sha256_final(
+    // [in out]: The context.  It must be initialised again before reuse.
+    HmacSha256Context* ctx,
+
+    // [out]: The output hash, truncated to outlen if less than 32 bytes.
+    void* out,
+    const size_t outlen);
+
+int64_t  // Returns the number of bytes hashed or -1 on a read error
+hmac_sha256_update_fd(
+    // [in out]: A context set up with hmac_sha256_init()
+    HmacSha256Context* ctx,
+
+    // [in]: An open file and the range to add to the hash.  The range is read in
+    //      HMAC_FILE_BUFFER_SIZE pieces, so a file that is still being written can be
+    //      hashed as each new section arrives.  A short file stops the read early.
+    int fd,
+    const uint64_t offset,
+    const uint64_t len);
+
+size_t  // Returns the number of bytes written to `out` or 0 if the file could not be read
+hmac_sha256_file(
+    // [in]: The key and its length.
+    const void* key,
+    const size_t keylen,
+
+    // [in]: Path of the file to authenticate.  Memory use is constant whatever its size.
+    const char* path,
+
+    // [out]: The output hash.
+    void* out,
+    const size_t outlen);
+
 #ifdef __cplusplus
 }
 #endif  // __cplusplus
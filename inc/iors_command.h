@@ -16,9 +16,16 @@
 #define COMMAND_TIME_TOLLERANCE 30 // An identical command received within this many seconds is ACK but ignored
 #define MAX_COMMAND_TIME 2082690000 //Dec 31 2035
 #define MIN_COMMAND_TIME 1672462800 //Dec 31 2022
+#define REPLAY_WINDOW_SIZE 64 // Seconds before the newest command that are tracked in the replay window bitmap
+#define REPLAY_DIGESTS 32 // Number of recently accepted authentication vectors kept to spot duplicates
+#define AUTH_BATCH_MAX 32 // Commands authenticated per journal sync by AuthenticateSoftwareCommandBatch()
 
 #define EXIT_DUPLICATE 2
 
+#define AUTH_RATE_LIMIT_STATIONS 16 // Number of callsigns that the HMAC rate limit tracks
+#define AUTH_RATE_LIMIT_BURST 10 // HMAC attempts a station can make in one burst
+#define AUTH_RATE_LIMIT_PER_MIN 60 // Sustained HMAC attempts per minute for a station
+
 /*
  * Following is the data structure representing software uplink commands
  */
@@ -37,6 +44,17 @@ typedef struct  __attribute__((__packed__)){
     uint8_t AuthenticationVector[32];
 } SWCmdUplink;
 
+/*
+ * A received packet to be authenticated as part of a batch.  The data is everything that
+ * was included in the authentication vector.
+ */
+typedef struct {
+	uint32_t dateTime;
+	uint8_t *data;
+	int len;
+	uint8_t *AuthenticationVector;
+} AuthPacket;
+
 /*
  * Here are the definitions of the name spaces and commands
  */
@@ -114,6 +132,18 @@ typedef enum {
 	,SwCmdPacsatNumberOfCommands
 }SWPacsatCommands;
 
+/* Reasons a command is rejected by PrefilterSoftwareCommand() before the HMAC is checked */
+typedef enum {
+	 AuthPrefilterOK = 0
+	,AuthRejectAddress
+	,AuthRejectNamespace
+	,AuthRejectCommand
+	,AuthRejectTimeRange
+	,AuthRejectTooOld
+	,AuthRejectRateLimit
+	,AuthNumberOfRejectReasons
+} AuthPrefilterReasons;
+
 /* These are the default writable folders on the USB Stick.  The strings are defined in
  * iors_command.c in a static array FolderIdStrings */
 typedef enum {
@@ -178,8 +208,18 @@ char * get_folder_str(FolderIds i);
 int get_symbol_rates(SymbolRateIds i);
 int get_namespace_from_str(char *name_space);
 int get_command_from_str(SWCommandNameSpace name_space, char * cmd);
+char * get_namespace_str(SWCommandNameSpace name_space);
+char * get_command_str(SWCommandNameSpace name_space, int cmd);
+int check_command_names();
 SWCmdUplink *get_last_command();
 int AuthenticatePacket(uint32_t date_time_in_packet, uint8_t * uplink, int pkt_len, uint8_t *auth_vector);
 int AuthenticateSoftwareCommand(SWCmdUplink *uplink);
+int PrefilterSoftwareCommand(SWCmdUplink *uplink, char *from_callsign);
+int AuthenticateSoftwareCommandFiltered(SWCmdUplink *uplink, char *from_callsign);
+void SetAuthRateLimit(int per_min, int burst);
+uint32_t GetAuthRejectCount(AuthPrefilterReasons reason);
+int AuthenticatePacketBatch(AuthPacket *packets, int count, int *results);
+int AuthenticateSoftwareCommandBatch(SWCmdUplink *uplinks, int count, int *results);
+int AuthenticateFile(uint32_t date_time, char *path, uint8_t *auth_vector);
 
 #endif /* IORS_COMMAND_H_ */
@@ -11,8 +11,43 @@
 #define IORS_LOG_H_
 
 #include <stdint.h>
+#include <time.h>
 
 #define FILE_TMP ".tmp"
+#define LOG_WRITER_BUFFER_SIZE 512 /* Events are staged here and written together */
+#define LOG_FLUSH_PERIOD 60 /* Seconds before buffered events are written */
+#define LOG_MAX_WRITERS 8 /* Number of different log files that can be written */
+#define LOG_PREALLOCATE_SIZE 65536 /* Space reserved for a new log that has no roll size */
+#define LOG_MAX_ROLL_SEQ 99 /* Logs that can be rolled in the same second */
+#define LOG_RECOVER_MAX_FOLDERS 8 /* Folders that log_recover() can check in parallel */
+#define LOG_QUEUE_LEN 1024 /* Events waiting for the logging thread.  Must be a power of 2 */
+#define LOG_MAX_EVENT_LEN 48 /* Largest event that can be queued.  Bigger ones are written directly */
+#define LOG_ASYNC_WAIT_MS 100 /* Longest time the logging thread sleeps */
+
+/*
+ * Framed log format.  Each event is written as:
+ *    LOG_FRAME_SYNC0 LOG_FRAME_SYNC1 | event bytes | CRC-16 of the event bytes, big endian
+ * The length is the len byte of the event itself.  A reader that finds a bad CRC moves on one
+ * byte and looks for the next sync marker, so damage only loses the events it touches.  A
+ * framed log always starts with the sync marker, which is not a valid event code.
+ */
+#define LOG_FRAME_SYNC0 0xA5
+#define LOG_FRAME_SYNC1 0x5A
+#define LOG_FRAME_OVERHEAD 4
+#define LOG_MIN_EVENT_LEN 9 /* sizeof(struct ALOG_1) */
+
+/*
+ * Repeated errors.  The first time an error is seen it is logged.  Repeats of the same event,
+ * error code and callsign in the next LOG_ERROR_WINDOW seconds are only counted and one
+ * ALOG_IORS_ERR_SUMMARY event is logged when the window closes.
+ */
+#define LOG_ERROR_SLOTS 64 /* Different errors that can be counted.  Must be a power of 2 */
+#define LOG_ERROR_WINDOW 600 /* Seconds */
+
+enum LOG_FORMAT {
+	LOG_FORMAT_PLAIN
+	,LOG_FORMAT_FRAMED
+};
 
 enum LOG_LEVEL {
 	NO_LOG,
@@ -21,6 +56,15 @@ enum LOG_LEVEL {
 	INFO_LOG
 };
 
+#define LOG_LEVEL_GLOBAL -1 /* A log handle follows log_set_level() */
+
+/* Calls to the LOG_ALOG macros above this level are removed when the program is compiled.  A
+ * flight build can set e.g. -DLOG_COMPILE_LEVEL=WARN_LOG */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL INFO_LOG
+#endif
+#define LOG_MAX_EVENTS 256 /* The event code is one byte */
+
 enum LOG_NAME {
 	LOG_NAME
 	,WOD_NAME
@@ -39,6 +83,8 @@ enum LOG_EVENT {
 	,ALOG_FS_STARTUP
 	,ALOG_FS_SHUTDOWN
 	,ALOG_IORS_LOG_LEVEL  // 1 serial no is the level
+	,ALOG_IORS_ERR_SUMMARY  /* 2F - repeats of an error.  serial_no is the error code, var1 the event, var2 the
+	                           repeats not logged, var3/var4 the first/last time of those and var5 the total */
 //    ,ALOG_FTL0_LOGIN 		/* 2 - user logon */
 //    ,ALOG_FTL0_LOGOUT 		/* 1F - user logout */
 //    ,ALOG_DISCONNECT = 5		/* 1F - FTL0 user timedout */
@@ -140,6 +186,9 @@ struct ALOG_2F {
 	uint32_t var6;
 } __attribute__ ((__packed__));
 
+/* A log that is open for writing.  Get one with log_open() */
+typedef struct log_writer LOG_HANDLE;
+
 int log_init(char *prefix, char *folder, char *filename);
 char * get_log_name_str(enum LOG_NAME name);
 void log_set_level(enum LOG_LEVEL level);
@@ -153,6 +202,85 @@ void log_alog2f(int level, char *filename, enum LOG_EVENT event_code, char * cal
 		uint32_t var1,uint32_t var2,uint32_t var3,uint32_t var4,uint32_t var5,uint32_t var6);
 int log_append(char *filename, uint8_t * data, int len);
 int log_add_to_directory(char *filename);
+int log_move_to_dir(int dir_fd, char *tmp_name, char *filename, time_t now, char *dir_filename);
+int log_recover(char **folders, int num_folders, int budget_ms);
+int log_flush(char *filename);
+
+LOG_HANDLE *log_open(char *filename);
+void log_handle_set_level(LOG_HANDLE *handle, int level);
+void log_handle_set_roll_size(LOG_HANDLE *handle, uint32_t bytes);
+void log_handle_set_roll_age(LOG_HANDLE *handle, uint32_t seconds);
+void log_handle_set_roll_records(LOG_HANDLE *handle, uint32_t records);
+void log_handle_err(LOG_HANDLE *handle, uint8_t error_code);
+void log_handle_alog1(LOG_HANDLE *handle, int level, enum LOG_EVENT event_code, uint16_t var);
+void log_handle_alog1f(LOG_HANDLE *handle, int level, enum LOG_EVENT event_code,
+		uint32_t var1,uint32_t var2,uint32_t var3,uint32_t var4,uint32_t var5,uint32_t var6);
+void log_handle_alog2(LOG_HANDLE *handle, int level, enum LOG_EVENT event_code, char * callsign, uint8_t ssid, uint16_t var);
+void log_handle_alog2f(LOG_HANDLE *handle, int level, enum LOG_EVENT event_code, char * callsign, uint8_t ssid,
+		uint32_t var1,uint32_t var2,uint32_t var3,uint32_t var4,uint32_t var5,uint32_t var6);
+int log_handle_append(LOG_HANDLE *handle, uint8_t * data, int len);
+int log_handle_flush(LOG_HANDLE *handle);
+int log_handle_roll(LOG_HANDLE *handle);
+
+void log_flush_all();
+void log_close_all();
+int log_async_start();
+void log_async_stop();
+void log_async_drain();
+uint32_t log_get_dropped_events();
+void log_set_format(enum LOG_FORMAT format);
+int log_frame_event(uint8_t *data, int len, uint8_t *frame);
+int log_is_framed(uint8_t *data, uint32_t len);
+uint8_t *log_next_event(uint8_t *data, uint32_t len, uint32_t *pos, int framed);
+int log_scan_events(uint8_t *data, uint32_t len, void (*callback)(uint8_t *event, int len, void *arg),
+		void *arg, uint32_t *skipped);
+
+/* Counts for one error, for the telemetry */
+typedef struct {
+	uint8_t event;
+	uint8_t error_code;
+	uint8_t call[6];
+	uint8_t ssid;
+	uint32_t count; /* Total since startup */
+	uint32_t suppressed; /* Repeats in the current window, not yet in a summary */
+	uint32_t last_tstamp;
+} LOG_ERROR_COUNTER;
+
+int log_error_event(char *filename, enum LOG_EVENT event_code, uint8_t error_code, char *callsign, uint8_t ssid);
+int log_handle_error(LOG_HANDLE *handle, enum LOG_EVENT event_code, uint8_t error_code, char *callsign, uint8_t ssid);
+void log_error_tick(time_t now);
+void log_set_error_window(int seconds);
+uint32_t log_get_error_count(uint8_t error_code);
+int log_get_error_counters(LOG_ERROR_COUNTER *counters, int max);
+
+/*
+ * Filtering before the call.  log_event_levels[] holds the highest level that any log will
+ * accept for each event, so an event that nobody wants costs one load and one compare, and
+ * the arguments are not even worked out.  log_event_sample[] is 0 or 1 for events that are
+ * not sampled, otherwise only one in that many of the events are logged.  The functions still
+ * check the level of the log they write to.
+ */
+extern uint8_t log_event_levels[LOG_MAX_EVENTS];
+extern uint16_t log_event_sample[LOG_MAX_EVENTS];
+int log_sample_hit(uint8_t event_code);
+
+#define LOG_EVENT_WANTED(level, event_code) \
+	((level) <= LOG_COMPILE_LEVEL && __builtin_expect((level) <= log_event_levels[(uint8_t)(event_code)], 0) \
+			&& (log_event_sample[(uint8_t)(event_code)] <= 1 || log_sample_hit(event_code)))
+
+#define LOG_ALOG1(level, handle, event_code, var) \
+	do { if (LOG_EVENT_WANTED(level, event_code)) log_handle_alog1(handle, level, event_code, var); } while (0)
+#define LOG_ALOG1F(level, handle, event_code, var1, var2, var3, var4, var5, var6) \
+	do { if (LOG_EVENT_WANTED(level, event_code)) \
+		log_handle_alog1f(handle, level, event_code, var1, var2, var3, var4, var5, var6); } while (0)
+#define LOG_ALOG2(level, handle, event_code, callsign, ssid, var) \
+	do { if (LOG_EVENT_WANTED(level, event_code)) log_handle_alog2(handle, level, event_code, callsign, ssid, var); } while (0)
+#define LOG_ALOG2F(level, handle, event_code, callsign, ssid, var1, var2, var3, var4, var5, var6) \
+	do { if (LOG_EVENT_WANTED(level, event_code)) \
+		log_handle_alog2f(handle, level, event_code, callsign, ssid, var1, var2, var3, var4, var5, var6); } while (0)
+
+void log_set_event_level(enum LOG_EVENT event_code, int level);
+void log_set_event_sample(enum LOG_EVENT event_code, uint16_t one_in);
 
 void log_debug_print(char * filename);
 
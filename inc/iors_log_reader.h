@@ -0,0 +1,59 @@
+/*
+ * iors_log_reader.h
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Reader for plain and framed activity logs.  The file is memory mapped and checked once
+ * when it is opened.  A sparse index holds one entry for each LOG_READER_BLOCK_SIZE bytes with
+ * the range of timestamps in that block, so a query for a time range only walks the blocks
+ * that could hold a match.  Events are returned as pointers into the mapped file and are valid
+ * until the reader is closed.
+ */
+
+#ifndef IORS_LOG_READER_H_
+#define IORS_LOG_READER_H_
+
+#include <stdint.h>
+
+#define LOG_READER_BLOCK_SIZE 4096
+#define LOG_READER_NUM_EVENTS 256 /* The event code is one byte */
+#define LOG_READER_NO_EVENT 0xffffffff
+
+typedef struct {
+	uint32_t first; /* Offset of the first event that starts in this block, or LOG_READER_NO_EVENT */
+	uint32_t min_tstamp;
+	uint32_t max_tstamp;
+} LOG_READER_BLOCK;
+
+typedef struct {
+	uint8_t *data;
+	uint32_t len;
+	int framed;
+	uint32_t num_events;
+	uint32_t skipped; /* Bytes that were not part of a valid event */
+	uint32_t min_tstamp;
+	uint32_t max_tstamp;
+	uint32_t event_counts[LOG_READER_NUM_EVENTS];
+	uint32_t num_blocks;
+	LOG_READER_BLOCK *blocks;
+} LOG_READER;
+
+typedef struct {
+	LOG_READER *reader;
+	uint32_t start; /* Timestamps from start to end inclusive */
+	uint32_t end;
+	uint32_t events[LOG_READER_NUM_EVENTS / 32]; /* Bit set for each event wanted.  All clear means all */
+	int filtered;
+	uint32_t pos;
+} LOG_READER_ITERATOR;
+
+int log_reader_open(LOG_READER *reader, char *path);
+void log_reader_close(LOG_READER *reader);
+uint32_t log_reader_event_count(LOG_READER *reader, uint8_t event);
+void log_reader_iterator_init(LOG_READER_ITERATOR *iterator, LOG_READER *reader, uint32_t start, uint32_t end);
+void log_reader_iterator_add_event(LOG_READER_ITERATOR *iterator, uint8_t event);
+uint8_t *log_reader_next(LOG_READER_ITERATOR *iterator);
+int log_reader_histogram(LOG_READER *reader, int event, uint32_t start, uint32_t bin_seconds,
+		uint32_t *bins, int num_bins);
+
+#endif /* IORS_LOG_READER_H_ */
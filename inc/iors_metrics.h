@@ -0,0 +1,88 @@
+/*
+ * iors_metrics.h
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Counters for the TNC interface, command authentication and the logs, kept in one block that
+ * can be placed in POSIX shared memory.  Another process on the same machine, such as the WOD
+ * generator or an operator console, maps the block read only with iors_metrics_attach() and
+ * reads the counters directly.
+ *
+ * The counters are updated with relaxed atomic adds through the IORS_METRICS_INC and
+ * IORS_METRICS_ADD macros, so no thread takes a lock.  Until iors_metrics_open() is called the
+ * block is in private memory and the counts are kept there.  The latency percentiles are copied
+ * from the histograms in latency_hist.h by iors_metrics_tick().  A reader checks latency_seq,
+ * which is odd while they are being copied.
+ *
+ * The block starts with a magic number, the version and its size.  Fields are only ever added
+ * to the end.  IORS_METRICS_VERSION changes if a field moves.
+ */
+
+#ifndef IORS_METRICS_H_
+#define IORS_METRICS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "latency_hist.h"
+
+#define IORS_METRICS_MAGIC 0x4d524f49 /* "IORM" */
+#define IORS_METRICS_VERSION 1
+#define IORS_METRICS_SHM_NAME "/iors_metrics"
+#define IORS_METRICS_KINDS 128 /* AGW data kinds are ASCII letters */
+#define IORS_METRICS_PERIOD 1 /* Seconds between copies of the latency percentiles */
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t size; /* sizeof(IORS_METRICS) for the writer */
+	uint32_t pid;
+	int64_t start_time;
+	int64_t update_time; /* When the latency percentiles were last copied */
+
+	/* TNC interface, indexed by the AGW data kind */
+	uint32_t rx_frames[IORS_METRICS_KINDS];
+	uint64_t rx_bytes[IORS_METRICS_KINDS];
+	uint32_t tx_frames[IORS_METRICS_KINDS];
+	uint64_t tx_bytes[IORS_METRICS_KINDS];
+	uint32_t rx_ring_overruns; /* Frames overwritten in the receive ring before they were picked up */
+	uint32_t tnc_queue_depth; /* Frames waiting to be sent, from the last 'y' frame */
+	uint32_t tnc_queue_depth_max;
+	uint32_t socket_errors;
+
+	/* Command authentication */
+	uint32_t auth_accepted;
+	uint32_t auth_bad_hmac;
+	uint32_t auth_bad_time;
+	uint32_t auth_duplicate;
+	uint32_t auth_prefiltered; /* Rejected before the HMAC was checked, see GetAuthRejectCount() */
+
+	/* Logs */
+	uint32_t log_events;
+	uint64_t log_bytes;
+	uint32_t log_write_errors;
+	uint32_t log_dropped_events;
+
+	/* Latency in microseconds, see latency_hist.h */
+	uint32_t latency_seq;
+	LATENCY_SUMMARY latency[LATENCY_NUM_STAGES];
+} IORS_METRICS;
+
+extern IORS_METRICS *iors_metrics;
+
+#define IORS_METRICS_ADD(field, n) __atomic_fetch_add(&iors_metrics->field, (n), __ATOMIC_RELAXED)
+#define IORS_METRICS_INC(field) IORS_METRICS_ADD(field, 1)
+
+int iors_metrics_open(char *name);
+void iors_metrics_close(char *name);
+void iors_metrics_rx_frame(char kind, int len);
+void iors_metrics_tx_frame(char kind, int len);
+void iors_metrics_set_tnc_queue_depth(uint32_t depth);
+void iors_metrics_tick(time_t now);
+
+const IORS_METRICS *iors_metrics_attach(char *name);
+void iors_metrics_detach(const IORS_METRICS *metrics);
+int iors_metrics_read_latency(const IORS_METRICS *metrics, LATENCY_SUMMARY *latency);
+
+#endif /* IORS_METRICS_H_ */
@@ -0,0 +1,45 @@
+/*
+ * iors_time.h
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Time service for log and command timestamps.  Reading the time is an atomic load of a
+ * cached value instead of a clock read per event.
+ *
+ * A program with an event loop calls iors_time_tick() once per pass and every timestamp in
+ * that pass is the same.  Until the first tick each call reads CLOCK_REALTIME_COARSE, which is
+ * read from the vDSO without a system call.  The cached time expires IORS_TIME_MAX_AGE seconds
+ * after the tick.  The logging thread calls iors_time_expire() each time it wakes, and if the
+ * loop has stalled or stopped ticking that reads the clock again, so other threads never see a
+ * frozen time.  A program that ticks but does not start the logging thread should call
+ * iors_time_expire() from any other thread that needs the time while the loop is blocked.
+ *
+ * In IORS_TIME_MONOTONIC mode the time is the monotonic clock plus an offset.  When the ground
+ * sets the time with SWCmdOpsTime, iors_time_set() changes the offset, which takes effect at
+ * the next tick, so timestamps do not jump part way through a batch.
+ */
+
+#ifndef IORS_TIME_H_
+#define IORS_TIME_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define IORS_TIME_STAMP_LEN 13 /* yymmddHHMMSS and the terminator */
+#define IORS_TIME_MAX_AGE 1 /* Seconds before the time cached by a tick is read again */
+
+enum IORS_TIME_MODE {
+	IORS_TIME_REALTIME
+	,IORS_TIME_MONOTONIC
+};
+
+void iors_time_set_mode(enum IORS_TIME_MODE mode);
+void iors_time_tick();
+void iors_time_expire();
+time_t iors_time_now();
+uint32_t iors_time_epoch32();
+time_t iors_time_from_epoch32(uint32_t epoch32);
+void iors_time_set(time_t now);
+const char *iors_time_stamp_str(time_t now);
+
+#endif /* IORS_TIME_H_ */
@@ -15,8 +15,32 @@
 
 #include <stdint.h>
 
+#include "hmac_sha256.h"
+
 #define ENCRYPTION_KEY_MAGIC_VALUE 0x71539172 /* Random value unlikely to be there by default */
 #define AUTH_KEY_SIZE 32
+#define KEYRING_MAX_KEYS 4
+#define KEY_ID_DEFAULT 0 /* The id of the key loaded by key_load() */
+
+/*
+ * A key in the keyring.  The key has already been absorbed into ctx, so an HMAC starts from a
+ * copy of ctx.  A command is only checked against a key if the command time is between valid_from
+ * and valid_until.  Zero means no limit.
+ */
+typedef struct {
+	uint32_t key_id;
+	uint32_t valid_from;
+	uint32_t valid_until;
+	uint8_t key[AUTH_KEY_SIZE];
+	HmacSha256Context ctx;
+} KEYRING_KEY;
+
+typedef struct {
+	uint32_t generation; /* Zero while the snapshot is being rewritten, see keyfile.c */
+	int num_keys;
+	int active; /* index of the key that is tried first */
+	KEYRING_KEY keys[KEYRING_MAX_KEYS];
+} KEYRING;
 
 extern uint8_t hmac_sha_key[AUTH_KEY_SIZE];
 
@@ -25,4 +49,12 @@ uint32_t key_checksum(uint8_t *key);
 int key_load(char * key_path);
 int test_key_save(char * key_path);
 
+const KEYRING *keyring_get();
+int keyring_add(uint32_t key_id, uint8_t *key, uint32_t valid_from, uint32_t valid_until);
+int keyring_remove(uint32_t key_id);
+int keyring_set_active(uint32_t key_id);
+int keyring_rotate(uint32_t key_id, uint8_t *key, uint32_t now, uint32_t overlap);
+int keyring_verify(uint32_t date_time, uint8_t *data, int len, uint8_t *auth_vector, uint32_t *key_id);
+int keyring_verify_file(uint32_t date_time, char *path, uint8_t *auth_vector, uint32_t *key_id);
+
 #endif /* KEYFILE_H_ */
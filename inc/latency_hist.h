@@ -0,0 +1,64 @@
+/*
+ * latency_hist.h
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Latency histograms for the stages of the frame and log pipelines.  A stage is timed with
+ * latency_stamp() at its start and latency_record_since() at its end.  Times are from
+ * CLOCK_MONOTONIC and are recorded in microseconds.
+ *
+ * Each histogram has LATENCY_SUB_BUCKETS buckets for each power of 2, so a percentile is
+ * within about 6% of the true value, from 1us to over an hour.  Buckets are updated with
+ * atomic adds, so any thread can record and read without a lock.
+ *
+ * Timing is off until latency_enable() is called.  While it is off latency_stamp() returns 0
+ * and nothing is recorded.
+ */
+
+#ifndef LATENCY_HIST_H_
+#define LATENCY_HIST_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 32 /* Longer times are counted in the last bucket */
+#define LATENCY_BUCKETS (LATENCY_SUB_BUCKETS * (LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1))
+
+enum LATENCY_STAGE {
+	LATENCY_RX_READ /* The frame header is read from the socket until the frame is in the ring */
+	,LATENCY_RX_QUEUE /* The frame is in the ring until get_next_frame() returns it */
+	,LATENCY_TX_SEND /* A send function is called until the frame is written to the socket */
+	,LATENCY_TX_CONFIRM /* The frame is written to the socket until the TNC returns it in a 'T' frame */
+	,LATENCY_LOG_QUEUE /* An event is queued until the logging thread takes it */
+	,LATENCY_LOG_WRITE /* One write of a log buffer */
+	,LATENCY_NUM_STAGES
+};
+
+typedef struct {
+	uint32_t count;
+	uint32_t mean; /* All times in microseconds */
+	uint32_t p50;
+	uint32_t p90;
+	uint32_t p99;
+	uint32_t p999;
+	uint32_t max;
+} LATENCY_SUMMARY;
+
+void latency_enable(int on);
+int latency_enabled();
+uint64_t latency_stamp();
+void latency_record(enum LATENCY_STAGE stage, uint32_t us);
+void latency_record_since(enum LATENCY_STAGE stage, uint64_t start_ns);
+void latency_reset();
+uint32_t latency_count(enum LATENCY_STAGE stage);
+uint32_t latency_percentile(enum LATENCY_STAGE stage, double percent);
+void latency_get_summary(enum LATENCY_STAGE stage, LATENCY_SUMMARY *summary);
+char *latency_stage_str(enum LATENCY_STAGE stage);
+void latency_dump(FILE *out);
+void latency_set_dump_period(int seconds, FILE *out);
+void latency_tick(time_t now);
+
+#endif /* LATENCY_HIST_H_ */
@@ -0,0 +1,56 @@
+/*
+ * span_trace.h
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Timeline tracing of the packet pipeline.  A span is a named piece of work on one thread with
+ * a start time and a duration.  Each thread writes its spans to a ring of its own, so threads
+ * do not contend with each other, and span_trace_export() writes all of the rings as Chrome
+ * Trace Event JSON, which chrome://tracing and the Perfetto UI can open.
+ *
+ * Tracing is off until span_trace_enable() is called.  While it is off a span costs one load
+ * and a branch.  The export can run while tracing is on.  A span that a thread overwrites
+ * while it is being exported is left out, so stop tracing first to get a complete trace.
+ *
+ * Span names must be string literals or other strings that live as long as the program,
+ * because only the pointer is stored.
+ */
+
+#ifndef SPAN_TRACE_H_
+#define SPAN_TRACE_H_
+
+#include <stdint.h>
+
+#define SPAN_TRACE_MAX_THREADS 16
+#define SPAN_TRACE_EVENTS 4096 /* Spans kept for each thread.  Must be a power of 2 */
+#define SPAN_TRACE_NAME_LEN 16
+
+typedef struct {
+	const char *name;
+	uint64_t start_ns;
+} SPAN_TRACE_SCOPE;
+
+extern int span_trace_on;
+
+void span_trace_enable(int on);
+void span_trace_name_thread(const char *name);
+uint64_t span_trace_begin();
+void span_trace_end(const char *name, uint64_t start_ns);
+void span_trace_instant(const char *name);
+void span_trace_scope_end(SPAN_TRACE_SCOPE *scope);
+void span_trace_clear();
+int span_trace_export(char *path);
+
+#define SPAN_TRACE_CONCAT2(a, b) a##b
+#define SPAN_TRACE_CONCAT(a, b) SPAN_TRACE_CONCAT2(a, b)
+
+/* Trace from here to the end of the enclosing block, including an early return */
+#define SPAN_TRACE_SCOPE(span_name) \
+	SPAN_TRACE_SCOPE SPAN_TRACE_CONCAT(span_scope_, __LINE__) __attribute__((cleanup(span_trace_scope_end))) = \
+		{ (span_name), __atomic_load_n(&span_trace_on, __ATOMIC_RELAXED) ? span_trace_begin() : 0 }
+
+/* Mark a moment, such as a consumer picking up a frame */
+#define SPAN_TRACE_INSTANT(span_name) \
+	do { if (__atomic_load_n(&span_trace_on, __ATOMIC_RELAXED)) span_trace_instant(span_name); } while (0)
+
+#endif /* SPAN_TRACE_H_ */
@@ -0,0 +1,62 @@
+/*
+ * tree_hash.h
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Merkle tree hash of a file so that large files can be hashed on several cores and
+ * checked one chunk at a time.
+ *
+ * The tree is defined as follows, so that the ground station can reproduce it:
+ *  - The file is split into leaves of leaf_size bytes.  The last leaf may be short.  An
+ *    empty file has one empty leaf.
+ *  - Leaf hash = SHA256(0x00 | leaf bytes)
+ *  - Node hash = SHA256(0x01 | left hash | right hash)
+ *  - For n leaves, the left subtree holds the largest power of two leaves that is less
+ *    than n and the right subtree holds the rest.  This is the same shape as RFC 6962.
+ *
+ * The manifest file holds the tree so it can be sent with a file or kept beside it.
+ * All integers are big endian:
+ *    uint32 magic TREE_HASH_MAGIC
+ *    uint16 version
+ *    uint16 reserved (0)
+ *    uint32 leaf_size
+ *    uint64 file_len
+ *    uint32 num_leaves
+ *    32 bytes root hash
+ *    num_leaves x 32 byte leaf hashes
+ */
+
+#ifndef TREE_HASH_H_
+#define TREE_HASH_H_
+
+#include <stdint.h>
+
+#include "sha256.h"
+
+#define TREE_HASH_MAGIC 0x54485348 /* THSH */
+#define TREE_HASH_VERSION 1
+#define TREE_HASH_HEADER_SIZE 56
+#define TREE_HASH_MIN_LEAF_SIZE 4096
+#define TREE_HASH_DEFAULT_LEAF_SIZE (1024*1024)
+#define TREE_HASH_MAX_THREADS 16
+
+typedef struct {
+	uint32_t leaf_size;
+	uint64_t file_len;
+	uint32_t num_leaves;
+	uint8_t root[SHA256_HASH_SIZE];
+	uint8_t (*leaves)[SHA256_HASH_SIZE];
+} TREE_HASH;
+
+uint32_t tree_hash_num_leaves(uint64_t file_len, uint32_t leaf_size);
+void tree_hash_leaf(uint8_t *data, uint32_t len, uint8_t *out);
+void tree_hash_root(uint8_t (*leaves)[SHA256_HASH_SIZE], uint32_t num_leaves, uint8_t *root);
+int tree_hash_file(char *path, uint32_t leaf_size, int threads, TREE_HASH *tree);
+void tree_hash_free(TREE_HASH *tree);
+int tree_hash_verify_chunk(TREE_HASH *tree, uint32_t index, uint8_t *data, uint32_t len);
+int tree_hash_verify_file(char *path, TREE_HASH *tree, int threads, uint32_t *bad_leaves, uint32_t max_bad);
+int tree_hash_repair_chunk(char *path, TREE_HASH *tree, uint32_t index, uint8_t *data, uint32_t len);
+int tree_hash_save(char *path, TREE_HASH *tree);
+int tree_hash_load(char *path, TREE_HASH *tree);
+
+#endif /* TREE_HASH_H_ */
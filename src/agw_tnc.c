@@ -43,6 +43,12 @@
 #include "../inc/common_config.h"
 #include "ax25_tools.h"
 #include "str_util.h"
+#include "frame_trace.h"
+#include "latency_hist.h"
+#include "iors_metrics.h"
+#include "span_trace.h"
+
+#define TNC_TX_LATENCY_LEN 64 /* Frames that can be waiting for their 'T' frame */
 
 /* Global vars defined in common_config.h and declared here */
 int g_common_frames_queued = 0;
@@ -59,7 +65,28 @@ struct t_agw_frame receive_circular_buffer[MAX_RX_QUEUE_LEN]; // buffer received
 int debug_tx_raw_frames = false;
 int debug_rx_raw_frames = false;
 
+/* Latency stamps for each frame in receive_circular_buffer.  They are kept apart from the frames
+ * so that the layout of t_agw_frame does not change */
+static uint64_t rx_read_ns[MAX_RX_QUEUE_LEN];
+static uint64_t rx_publish_ns[MAX_RX_QUEUE_LEN];
+static uint8_t rx_unread[MAX_RX_QUEUE_LEN]; /* Set when a frame is put in the ring and cleared when it is picked up */
+/* Each sent frame, in order, until its 'T' frame is received.  write_ns is when it was written to
+ * the socket and is 0 once the entry has been confirmed */
+struct tnc_tx_pending {
+	uint64_t write_ns;
+	char data_kind;
+	unsigned char portx;
+	char call_from[10];
+	char call_to[10];
+};
+static struct tnc_tx_pending tx_pending[TNC_TX_LATENCY_LEN];
+static uint32_t tx_write_head = 0;
+static uint32_t tx_confirm_tail = 0; /* Only changed by the listen thread */
+
 /* Forward declarations*/
+static void tnc_tx_written(struct t_agw_header *header, uint64_t start_ns);
+static void tnc_tx_confirmed(struct t_agw_header *header, unsigned char *data, int len);
+static int tnc_read_all(void *buf, int len);
 
 
 /**
@@ -117,6 +144,7 @@ int tnc_start_monitoring(char type) {
 	int err = 0;
 	err = send(sockfd, (char*)(&header), sizeof(header), MSG_NOSIGNAL);
 	if (err == -1) {
+		IORS_METRICS_INC(socket_errors);
 		printf ("Socket Send error\n");
 		return EXIT_FAILURE;
 	}
@@ -135,6 +163,7 @@ int tnc_register_callsign(char *callsign) {
 	int err = 0;
 	err = send(sockfd, (char*)(&header), sizeof(header), MSG_NOSIGNAL);
 	if (err == -1) {
+		IORS_METRICS_INC(socket_errors);
 		printf ("Socket Send error\n");
 		return EXIT_FAILURE;
 	}
@@ -153,6 +182,7 @@ int tnc_unregister_callsign(char *callsign) {
 	int err = 0;
 	err = send(sockfd, (char*)(&header), sizeof(header), MSG_NOSIGNAL);
 	if (err == -1) {
+		IORS_METRICS_INC(socket_errors);
 		printf ("Socket Send error\n");
 		return EXIT_FAILURE;
 	}
@@ -165,6 +195,8 @@ int tnc_unregister_callsign(char *callsign) {
  * Returns EXIT_SUCCESS if successful otherwise EXIT_FAILURE
  */
 int tnc_send_connected_data(char *from_callsign, char *to_callsign, int channel, unsigned char *bytes, int len) {
+	SPAN_TRACE_SCOPE("tnc send D");
+	uint64_t start_ns = latency_stamp();
 	struct t_agw_header header;
 	memset (&header, 0, sizeof(header));
 	header.data_kind = 'D'; // disconnect
@@ -174,12 +206,11 @@ int tnc_send_connected_data(char *from_callsign, char *to_callsign, int channel,
 	header.data_len = len;
 	header.pid = 0xf0;
 
+	frame_trace_record(FRAME_TRACE_TX, header.data_kind, header.portx, header.pid, header.call_from, header.call_to, bytes, len);
 	if (debug_tx_raw_frames) {
-		debug_print("SENDING: %s>%s: ", from_callsign, to_callsign);
-		for (int i=0; i < header.data_len; i++) {
-			debug_print("%02x ",bytes[i]);
-		}
-		debug_print(" .. %d bytes\n", header.data_len);
+		char hex[3 * FRAME_TRACE_SNIPPET_LEN + 1];
+		frame_trace_format_hex(bytes, len < FRAME_TRACE_SNIPPET_LEN ? len : FRAME_TRACE_SNIPPET_LEN, hex);
+		debug_print("SENDING: %s>%s: %s .. %d bytes\n", from_callsign, to_callsign, hex, header.data_len);
 	}
 
 	// TODO - Move to calling test function
@@ -187,14 +218,17 @@ int tnc_send_connected_data(char *from_callsign, char *to_callsign, int channel,
 
 	int err = send(sockfd, (unsigned char*)(&header), sizeof(header), MSG_NOSIGNAL);
 	if (err == -1) {
+		IORS_METRICS_INC(socket_errors);
 		printf ("Socket Send error with header, Terminating.\n");
 		return EXIT_FAILURE;
 	}
 	err = send(sockfd, bytes, len, MSG_NOSIGNAL);
 	if (err == -1) {
+		IORS_METRICS_INC(socket_errors);
 		printf ("Socket Send error with data, Terminating.\n");
 		return EXIT_FAILURE;
 	}
+	tnc_tx_written(&header, start_ns);
 	/* We don't need to count outstanding frames here because we do not get ahead of the ground station.  We only
 	 * reply to I frames they send.  If a future mode allows us to send a large number of I-data frames then we
 	 * would need to use the Y query to see if we have too many in the queue. */
@@ -220,6 +254,7 @@ int tnc_diconnect(char *from_callsign, char *to_callsign, int channel) {
 	int err = 0;
 	err = send(sockfd, (char*)(&header), sizeof(header), MSG_NOSIGNAL);
 	if (err == -1) {
+		IORS_METRICS_INC(socket_errors);
 		printf ("Socket Send error\n");
 		return EXIT_FAILURE;
 	}
@@ -237,6 +272,7 @@ int tnc_frames_queued() {
 	int err = 0;
 	err = send(sockfd, (char*)(&header), sizeof(header), MSG_NOSIGNAL);
 	if (err == -1) {
+		IORS_METRICS_INC(socket_errors);
 		printf ("Socket Send error\n");
 		return EXIT_FAILURE;
 	}
@@ -270,11 +306,10 @@ int tnc_frames_queued() {
  *
  */
 int send_ui_packet(char *from_callsign, char *to_callsign, char pid, unsigned char *bytes, int len) {
+	SPAN_TRACE_SCOPE("tnc send M");
+	uint64_t start_ns = latency_stamp();
 	struct t_agw_header header;
 
-	if (debug_tx_raw_frames)
-		debug_print("SENDING: ");
-
 	memset (&header, 0, sizeof(header));
 	header.pid = pid;
 	strlcpy( header.call_from, from_callsign, sizeof(header.call_from) );
@@ -282,33 +317,28 @@ int send_ui_packet(char *from_callsign, char *to_callsign, char pid, unsigned ch
 
 	header.data_kind = 'M';
 	header.data_len = len;
-	for (int i=0; i < header.data_len; i++) {
-		if (isprint(bytes[i]))
-			printf("%c",bytes[i]);
-		else
-			printf(" ");
-	}
+	frame_trace_record(FRAME_TRACE_TX, header.data_kind, header.portx, header.pid, header.call_from, header.call_to, bytes, len);
 	if (debug_tx_raw_frames) {
-		debug_print("|");
-		for (int i=0; i < header.data_len; i++) {
-			debug_print("%02x ",bytes[i]);
-		}
+		char str[FRAME_TRACE_DATA_STR_LEN(FRAME_TRACE_SNIPPET_LEN)];
+		frame_trace_format_data(bytes, len, str, sizeof(str));
+		debug_print("SENDING: %s .. %d bytes\n", str, header.data_len);
 	}
-	if (debug_tx_raw_frames)
-	debug_print(" .. %d bytes\n", header.data_len);
 
 //if (g_run_self_test) return EXIT_SUCCESS; /* Dont transmit the bytes in test mode */
 
 	int err = send(sockfd, (unsigned char*)(&header), sizeof(header), MSG_NOSIGNAL);
 	if (err == -1) {
+		IORS_METRICS_INC(socket_errors);
 		printf ("Socket Send error with header, Terminating.\n");
 		return EXIT_FAILURE;
 	}
 	err = send(sockfd, bytes, len, MSG_NOSIGNAL);
 	if (err == -1) {
+		IORS_METRICS_INC(socket_errors);
 		printf ("Socket Send error with data, Terminating.\n");
 		return EXIT_FAILURE;
 	}
+	tnc_tx_written(&header, start_ns);
 
 	g_common_frames_queued++;
 //	debug_print("~~~~M Sent :%d\n", g_frames_queued);
@@ -320,11 +350,10 @@ int send_ui_packet(char *from_callsign, char *to_callsign, char pid, unsigned ch
 }
 
 int send_raw_packet(char *from_callsign, char *to_callsign, char pid, unsigned char *bytes, int len) {
+	SPAN_TRACE_SCOPE("tnc send K");
+	uint64_t start_ns = latency_stamp();
 	struct t_agw_header header;
 
-	if (debug_tx_raw_frames)
-		debug_print("SENDING: ");
-
 	memset (&header, 0, sizeof(header));
 	header.pid = pid;
 	strlcpy( header.call_from, from_callsign, sizeof(header.call_from) );
@@ -355,35 +384,30 @@ int send_raw_packet(char *from_callsign, char *to_callsign, char pid, unsigned c
 	}
 	header.data_len = len+sizeof(raw_hdr);
 
+	frame_trace_record(FRAME_TRACE_TX, header.data_kind, header.portx, header.pid, header.call_from, header.call_to,
+			raw_bytes, header.data_len);
 	if (debug_tx_raw_frames) {
-		for (int i=0; i< (len+sizeof(raw_hdr)); i++) {
-			if (isprint(raw_bytes[i]))
-				printf("%c",raw_bytes[i]);
-			else
-				printf(" ");
-		}
-		for (int i=0; i< (len+sizeof(raw_hdr)); i++) {
-			printf("%02x ",raw_bytes[i]);
-			if (i%40 == 0 && i!=0) printf("\n");
-		}
+		char str[FRAME_TRACE_DATA_STR_LEN(FRAME_TRACE_SNIPPET_LEN)];
+		frame_trace_format_data(raw_bytes, header.data_len, str, sizeof(str));
+		debug_print("SENDING: %s .. %d bytes\n", str, header.data_len);
 	}
 
-	if (debug_tx_raw_frames)
-		debug_print(" .. %d bytes\n", header.data_len);
-
 //if (g_run_self_test) return EXIT_SUCCESS; /* Dont transmit the bytes in test mode */
 
 	int err = send(sockfd, (unsigned char*)(&header), sizeof(header), MSG_NOSIGNAL);
 	if (err == -1) {
+		IORS_METRICS_INC(socket_errors);
 		/* Ignore this error because we get it whenever the TNC closes */
 		//error_print ("Socket Send error with header, Not sent.\n");
 		return EXIT_FAILURE;
 	}
 	err = send(sockfd, raw_bytes, len+sizeof(raw_hdr), MSG_NOSIGNAL);
 	if (err == -1) {
+		IORS_METRICS_INC(socket_errors);
 		error_print ("Socket Send error with data, Not sent.\n");
 		return EXIT_FAILURE;
 	}
+	tnc_tx_written(&header, start_ns);
 
 	/* this gets overridden when we read the y frame from the TNC, but we increment it because the
 	 * y frame data lags.  This prevents us from sending too many frames before we know the status */
@@ -405,6 +429,7 @@ void *tnc_listen_process(void * arg) {
 		error_print("Thread already started.  Exiting: %s\n", name);
 	}
 	listen_thread_called = true;
+	span_trace_name_thread("tnc listen");
 	//debug_print("Starting Thread: %s\n", name);
 
 	while (listen_thread_called) {
@@ -430,47 +455,49 @@ void tnc_exit_listen_process() {
 }
 
 void print_header(struct t_agw_header *header) {
-	// print something
-	debug_print ("Port [%d] Kind %c Pid %02X From:", header->portx, header->data_kind, header->pid & 0xff);
-	for (int i=0; i < 10; i++) {
-		if (isprint(header->call_from[i]))
-			debug_print("%c",header->call_from[i]);
-	}
-	debug_print(" To:");
-	for (int i=0; i < 10; i++) {
-		if (isprint(header->call_to[i]))
-			debug_print("%c",header->call_to[i]);
-	}
-	debug_print(" Len:%d ||",header->data_len);
+	char from[FRAME_TRACE_CALL_LEN + 1];
+	char to[FRAME_TRACE_CALL_LEN + 1];
+	frame_trace_format_call(header->call_from, from);
+	frame_trace_format_call(header->call_to, to);
+	debug_print ("Port [%d] Kind %c Pid %02X From:%s To:%s Len:%d ||", header->portx, header->data_kind,
+			header->pid & 0xff, from, to, header->data_len);
 }
 
+/**
+ * print_data()
+ * Print the first FRAME_TRACE_SNIPPET_LEN bytes of the data as text and hex
+ */
 void print_data(unsigned char *data, int len) {
-	for (int i=0; i < len; i++) {
-		if (isprint(data[i]))
-			debug_print("%c",(char)data[i]);
-		else
-			debug_print(" ");
-	}
-	debug_print(" : ");
-	for (int i=0; i < len; i++) {
-		debug_print("%02x ",data[i] & 0xff);
-	}
+	char str[FRAME_TRACE_DATA_STR_LEN(FRAME_TRACE_SNIPPET_LEN)];
+	frame_trace_format_data(data, len, str, sizeof(str));
+	debug_print("%s", str);
 }
 
 int tnc_receive_packet() {
 	struct t_agw_header header;
-	int n = read(sockfd, (char*)(&receive_circular_buffer[next_frame_ptr].header), sizeof(header));
-	if (n == -1) return EXIT_FAILURE;
+	int n = tnc_read_all(&receive_circular_buffer[next_frame_ptr].header, sizeof(header));
+	if (n == -1) {
+		IORS_METRICS_INC(socket_errors);
+		return EXIT_FAILURE;
+	}
+	rx_read_ns[next_frame_ptr] = latency_stamp();
+	/* The span starts once the header has arrived, so it does not include the wait for a frame */
+	SPAN_TRACE_SCOPE("tnc read");
 
 	header = receive_circular_buffer[next_frame_ptr].header;
 
 	if (n != sizeof(header)) {
+		IORS_METRICS_INC(socket_errors);
 		//debug_print ("TNC Read failed, received %d command bytes.\n", n);
 		return (EXIT_FAILURE);
 	}
 
-	/* If this asset fails then we are likely receiving frames that are longer than AX25_MAX_DATA_LEN */
-	//assert (header.data_len >= 0 && header.data_len < (int)(sizeof(receive_circular_buffer[next_frame_ptr].data)));
+	/* If this fails then we are likely receiving frames that are longer than AX25_MAX_DATA_LEN */
+	if (header.data_len < 0 || header.data_len > (int)(sizeof(receive_circular_buffer[next_frame_ptr].data))) {
+		IORS_METRICS_INC(socket_errors);
+		error_print ("Frame of %d data bytes is too long.  Terminating.\n", header.data_len);
+		return EXIT_FAILURE;
+	}
 
 	if (header.data_kind == 'T') {
 		//g_frames_queued--;
@@ -485,22 +512,41 @@ int tnc_receive_packet() {
 	}
 
 	if (header.data_len > 0) {
-		n = read (sockfd, receive_circular_buffer[next_frame_ptr].data, header.data_len);
+		n = tnc_read_all(receive_circular_buffer[next_frame_ptr].data, header.data_len);
 
 		if (n != header.data_len) {
+			IORS_METRICS_INC(socket_errors);
 			error_print ("Read error, client received %d data bytes when %d expected.  Terminating.\n", n, header.data_len);
 			return EXIT_FAILURE;
 		}
+		frame_trace_record(FRAME_TRACE_RX, header.data_kind, header.portx, header.pid, header.call_from, header.call_to,
+				receive_circular_buffer[next_frame_ptr].data, header.data_len);
+		iors_metrics_rx_frame(header.data_kind, header.data_len);
+		if (header.data_kind == 'T')
+			tnc_tx_confirmed(&header, receive_circular_buffer[next_frame_ptr].data, header.data_len);
+		if (header.data_kind == 'y' && header.data_len >= (int)sizeof(int)) {
+			int depth;
+			memcpy(&depth, receive_circular_buffer[next_frame_ptr].data, sizeof(depth));
+			iors_metrics_set_tnc_queue_depth(depth);
+		}
 		if (debug_rx_raw_frames && header.data_kind != 'T')
 			print_data(receive_circular_buffer[next_frame_ptr].data, header.data_len);
 		if (debug_rx_raw_frames && header.data_kind != 'T')
 			debug_print("\n");
 
+		latency_record_since(LATENCY_RX_READ, rx_read_ns[next_frame_ptr]);
+		__atomic_store_n(&rx_publish_ns[next_frame_ptr], latency_stamp(), __ATOMIC_RELAXED);
+		if (__atomic_exchange_n(&rx_unread[next_frame_ptr], true, __ATOMIC_RELAXED))
+			IORS_METRICS_INC(rx_ring_overruns);
 		next_frame_ptr++;
 		if (next_frame_ptr == MAX_RX_QUEUE_LEN)
 			next_frame_ptr=0;
 		return EXIT_SUCCESS;
 	}
+	frame_trace_record(FRAME_TRACE_RX, header.data_kind, header.portx, header.pid, header.call_from, header.call_to, NULL, 0);
+	iors_metrics_rx_frame(header.data_kind, 0);
+	if (header.data_kind == 'T')
+		tnc_tx_confirmed(&header, NULL, 0);
 	return EXIT_SUCCESS;
 }
 
@@ -517,9 +563,115 @@ int get_next_frame(int frame_num, struct t_agw_frame_ptr *frame) {
 	if (next_frame_ptr != frame_num) {
 		frame->header = &receive_circular_buffer[frame_num].header;
 		frame->data = (unsigned char *)&receive_circular_buffer[frame_num].data;
+		__atomic_store_n(&rx_unread[frame_num], false, __ATOMIC_RELAXED);
+		SPAN_TRACE_INSTANT("frame pickup");
+		/* Clear the stamp so the wait is only recorded the first time the frame is picked up */
+		latency_record_since(LATENCY_RX_QUEUE, __atomic_exchange_n(&rx_publish_ns[frame_num], 0, __ATOMIC_RELAXED));
 		return EXIT_SUCCESS;
 	} else {
 		return EXIT_FAILURE;
 	}
 }
 
+/**
+ * tnc_read_all()
+ * Read len bytes from the TNC.  A frame can arrive in more than one piece when the socket
+ * buffer fills, so keep reading until it is complete.
+ *
+ * Returns the number of bytes read, which is less than len at the end of the stream, or -1
+ */
+static int tnc_read_all(void *buf, int len) {
+	int done = 0;
+	while (done < len) {
+		ssize_t n = read(sockfd, (char *)buf + done, len - done);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			return done > 0 ? done : -1;
+		}
+		if (n == 0) break;
+		done += n;
+	}
+	return done;
+}
+
+/**
+ * tnc_tx_written()
+ * Count the frame, record how long the send took and remember when the frame went to the TNC,
+ * so the wait for its 'T' frame can be timed.
+ */
+static void tnc_tx_written(struct t_agw_header *header, uint64_t start_ns) {
+	iors_metrics_tx_frame(header->data_kind, header->data_len);
+	if (start_ns == 0) return;
+	latency_record_since(LATENCY_TX_SEND, start_ns);
+	uint32_t pos = __atomic_fetch_add(&tx_write_head, 1, __ATOMIC_RELAXED);
+	struct tnc_tx_pending *entry = &tx_pending[pos % TNC_TX_LATENCY_LEN];
+	__atomic_store_n(&entry->write_ns, 0, __ATOMIC_RELAXED);
+	entry->data_kind = header->data_kind;
+	entry->portx = header->portx;
+	memcpy(entry->call_from, header->call_from, sizeof(entry->call_from));
+	memcpy(entry->call_to, header->call_to, sizeof(entry->call_to));
+	__atomic_store_n(&entry->write_ns, latency_stamp(), __ATOMIC_RELEASE);
+}
+
+/**
+ * tnc_tx_frame_type()
+ * Copy the frame type from the monitor text of a 'T' frame, which Direwolf writes between '<'
+ * and the first space or '>', e.g. "1:Fm G0KLA To AMSAT <UI pid=F0 Len=20 >".  type is empty
+ * if the text has no frame type.
+ */
+static void tnc_tx_frame_type(unsigned char *data, int len, char *type, int type_len) {
+	int i = 0, n = 0;
+	while (i < len && data[i] != '<') i++;
+	for (i++; i < len && n < type_len - 1; i++) {
+		if (data[i] == ' ' || data[i] == '>') break;
+		type[n++] = data[i];
+	}
+	type[n] = 0;
+}
+
+/**
+ * tnc_tx_type_matches()
+ * True if a frame of type could have been sent by a request of data_kind.  Connected data 'D'
+ * goes out as I frames, 'M' as UI frames and 'K' is a raw frame that we build as a UI frame.
+ */
+static int tnc_tx_type_matches(char data_kind, char *type) {
+	if (type[0] == 0) return true; /* No monitor text, so match on the header alone */
+	switch (data_kind) {
+	case 'D':
+		return strcmp(type, "I") == 0;
+	case 'M':
+	case 'K':
+		return strcmp(type, "UI") == 0;
+	default:
+		return true;
+	}
+}
+
+/**
+ * tnc_tx_confirmed()
+ * The TNC returns each frame it sends in a 'T' frame, in the order they were sent.  It also
+ * returns frames that it makes itself, such as RR acks, so the 'T' frame is matched to the
+ * oldest pending frame with the same port, callsigns and frame type.  A 'T' frame that matches
+ * nothing is not timed.  Pending frames older than the match were not confirmed and are dropped,
+ * as are frames that fell out of the table before they were confirmed.
+ */
+static void tnc_tx_confirmed(struct t_agw_header *header, unsigned char *data, int len) {
+	uint32_t head = __atomic_load_n(&tx_write_head, __ATOMIC_ACQUIRE);
+	if (head - tx_confirm_tail > TNC_TX_LATENCY_LEN)
+		tx_confirm_tail = head - TNC_TX_LATENCY_LEN;
+	char type[8];
+	tnc_tx_frame_type(data, len, type, sizeof(type));
+	for (uint32_t pos = tx_confirm_tail; pos != head; pos++) {
+		struct tnc_tx_pending *entry = &tx_pending[pos % TNC_TX_LATENCY_LEN];
+		if (__atomic_load_n(&entry->write_ns, __ATOMIC_ACQUIRE) == 0) continue;
+		if (entry->portx != header->portx) continue;
+		if (strncasecmp(entry->call_from, header->call_from, sizeof(entry->call_from)) != 0) continue;
+		if (strncasecmp(entry->call_to, header->call_to, sizeof(entry->call_to)) != 0) continue;
+		if (!tnc_tx_type_matches(entry->data_kind, type)) continue;
+		uint64_t written = __atomic_exchange_n(&entry->write_ns, 0, __ATOMIC_ACQUIRE);
+		tx_confirm_tail = pos + 1;
+		latency_record_since(LATENCY_TX_CONFIRM, written);
+		return;
+	}
+}
+
@@ -0,0 +1,415 @@
+/*
+ * alog_v2.c
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Compact ALOG encoding, see alog_v2.h
+ *
+ * All four ALOG types start with the same 9 bytes (event, len, tstamp, serial_no, rxchan), so
+ * those are encoded the same way for every event.  The fields are copied with memcpy because
+ * the structures are packed.
+ *
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common_config.h"
+#include "iors_log.h"
+#include "alog_v2.h"
+
+#define ALOG_V2_CALL_OFFSET 9
+#define ALOG_V2_CALL_LEN 7
+#define ALOG_V2_NUM_VARS 6
+
+struct alog_v2_encoder {
+	ALOG_V2_STATE state;
+	uint8_t *out;
+	uint32_t max;
+	uint32_t pos;
+	int overflow;
+};
+
+/* Forward declarations */
+static int alog_v2_put_varint(uint8_t *out, uint32_t value);
+static int alog_v2_get_varint(uint8_t *in, uint32_t len, uint32_t *pos, uint32_t *value);
+static int alog_v2_find_call(ALOG_V2_STATE *state, uint8_t *call);
+static void alog_v2_encode_callback(uint8_t *event, int len, void *arg);
+static uint8_t *alog_v2_read_file(char *path, uint32_t *len);
+static int alog_v2_write_file(char *path, uint8_t *data, uint32_t len);
+
+void alog_v2_init(ALOG_V2_STATE *state) {
+	state->last_tstamp = 0;
+	state->num_calls = 0;
+}
+
+/**
+ * alog_v2_encode_event()
+ * Encode one plain event.  out must have room for ALOG_V2_MAX_ENCODED bytes.
+ *
+ * Returns the number of bytes written
+ */
+int alog_v2_encode_event(ALOG_V2_STATE *state, uint8_t *event, int len, uint8_t *out) {
+	int type;
+	switch (len) {
+		case sizeof(struct ALOG_1): type = ALOG_V2_TYPE_1; break;
+		case sizeof(struct ALOG_1F): type = ALOG_V2_TYPE_1F; break;
+		case sizeof(struct ALOG_2): type = ALOG_V2_TYPE_2; break;
+		case sizeof(struct ALOG_2F): type = ALOG_V2_TYPE_2F; break;
+		default:
+			out[0] = event[0];
+			out[1] = ALOG_V2_RAW;
+			int p = 2 + alog_v2_put_varint(out + 2, len);
+			memcpy(out + p, event, len);
+			return p + len;
+	}
+
+	struct ALOG_1 head;
+	memcpy(&head, event, sizeof(head));
+	int p = 2;
+	int32_t delta = (int32_t)(head.tstamp - state->last_tstamp);
+	p += alog_v2_put_varint(out + p, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+	state->last_tstamp = head.tstamp;
+
+	uint8_t flags = type;
+	if (head.serial_no != 0) {
+		flags |= ALOG_V2_SERIAL;
+		p += alog_v2_put_varint(out + p, head.serial_no);
+	}
+	if (head.rxchan != 0) {
+		flags |= ALOG_V2_RXCHAN;
+		out[p++] = head.rxchan;
+	}
+
+	int vars_offset = sizeof(struct ALOG_1);
+	if (type == ALOG_V2_TYPE_2 || type == ALOG_V2_TYPE_2F) {
+		uint8_t *call = event + ALOG_V2_CALL_OFFSET;
+		int index = alog_v2_find_call(state, call);
+		if (index == -1) {
+			flags |= ALOG_V2_NEW_CALL;
+			memcpy(out + p, call, ALOG_V2_CALL_LEN);
+			p += ALOG_V2_CALL_LEN;
+			if (state->num_calls < ALOG_V2_MAX_CALLS)
+				memcpy(state->calls[state->num_calls++], call, ALOG_V2_CALL_LEN);
+		} else {
+			p += alog_v2_put_varint(out + p, index);
+		}
+		vars_offset += ALOG_V2_CALL_LEN;
+	}
+
+	if (type == ALOG_V2_TYPE_1F || type == ALOG_V2_TYPE_2F) {
+		int bitmap_pos = p++;
+		uint8_t bitmap = 0;
+		for (int i = 0; i < ALOG_V2_NUM_VARS; i++) {
+			uint32_t var;
+			memcpy(&var, event + vars_offset + i * sizeof(uint32_t), sizeof(var));
+			if (var != 0) {
+				bitmap |= 1 << i;
+				p += alog_v2_put_varint(out + p, var);
+			}
+		}
+		out[bitmap_pos] = bitmap;
+	}
+
+	out[0] = head.event;
+	out[1] = flags;
+	return p;
+}
+
+/**
+ * alog_v2_decode_event()
+ * Decode the next event from in, which holds len bytes.  event must have room for 255 bytes
+ * and receives the plain event, with its length in event[1].
+ *
+ * Returns the number of bytes used from in, or -1 if the data is damaged or cut short
+ */
+int alog_v2_decode_event(ALOG_V2_STATE *state, uint8_t *in, uint32_t len, uint8_t *event) {
+	if (len < 3) return -1;
+	uint8_t flags = in[1];
+	uint32_t p = 2;
+	uint32_t value;
+
+	if (flags & ALOG_V2_RAW) {
+		if (!alog_v2_get_varint(in, len, &p, &value) || value < 2 || value > 255 || p + value > len)
+			return -1;
+		memcpy(event, in + p, value);
+		return p + value;
+	}
+
+	int type = flags & ALOG_V2_TYPE_MASK;
+	struct ALOG_1 head;
+	head.event = in[0];
+	switch (type) {
+		case ALOG_V2_TYPE_1: head.len = sizeof(struct ALOG_1); break;
+		case ALOG_V2_TYPE_1F: head.len = sizeof(struct ALOG_1F); break;
+		case ALOG_V2_TYPE_2: head.len = sizeof(struct ALOG_2); break;
+		default: head.len = sizeof(struct ALOG_2F); break;
+	}
+	if (!alog_v2_get_varint(in, len, &p, &value)) return -1;
+	int32_t delta = (int32_t)((value >> 1) ^ (~(value & 1) + 1));
+	head.tstamp = state->last_tstamp + (uint32_t)delta;
+	state->last_tstamp = head.tstamp;
+
+	head.serial_no = 0;
+	if (flags & ALOG_V2_SERIAL) {
+		if (!alog_v2_get_varint(in, len, &p, &value)) return -1;
+		head.serial_no = value;
+	}
+	head.rxchan = 0;
+	if (flags & ALOG_V2_RXCHAN) {
+		if (p >= len) return -1;
+		head.rxchan = in[p++];
+	}
+	memcpy(event, &head, sizeof(head));
+
+	int vars_offset = sizeof(struct ALOG_1);
+	if (type == ALOG_V2_TYPE_2 || type == ALOG_V2_TYPE_2F) {
+		uint8_t *call = event + ALOG_V2_CALL_OFFSET;
+		if (flags & ALOG_V2_NEW_CALL) {
+			if (p + ALOG_V2_CALL_LEN > len) return -1;
+			memcpy(call, in + p, ALOG_V2_CALL_LEN);
+			p += ALOG_V2_CALL_LEN;
+			if (state->num_calls < ALOG_V2_MAX_CALLS)
+				memcpy(state->calls[state->num_calls++], call, ALOG_V2_CALL_LEN);
+		} else {
+			if (!alog_v2_get_varint(in, len, &p, &value) || value >= (uint32_t)state->num_calls) return -1;
+			memcpy(call, state->calls[value], ALOG_V2_CALL_LEN);
+		}
+		vars_offset += ALOG_V2_CALL_LEN;
+	}
+
+	if (type == ALOG_V2_TYPE_1F || type == ALOG_V2_TYPE_2F) {
+		if (p >= len) return -1;
+		uint8_t bitmap = in[p++];
+		for (int i = 0; i < ALOG_V2_NUM_VARS; i++) {
+			uint32_t var = 0;
+			if ((bitmap & (1 << i)) && !alog_v2_get_varint(in, len, &p, &var)) return -1;
+			memcpy(event + vars_offset + i * sizeof(uint32_t), &var, sizeof(var));
+		}
+	}
+	return p;
+}
+
+/**
+ * alog_v2_encode()
+ * Encode a plain or framed log that has been read into memory.  Damaged framed events are
+ * skipped.
+ *
+ * Returns the length of the v2 log or -1 if it does not fit in max bytes
+ */
+int64_t alog_v2_encode(uint8_t *data, uint32_t len, uint8_t *out, uint32_t max) {
+	if (max < ALOG_V2_HEADER_SIZE) return -1;
+	struct alog_v2_encoder encoder;
+	alog_v2_init(&encoder.state);
+	encoder.out = out;
+	encoder.max = max;
+	encoder.overflow = false;
+	/* Start the deltas from the first timestamp so the first event does not need a full varint */
+	uint32_t pos = 0;
+	uint8_t *first = log_next_event(data, len, &pos, log_is_framed(data, len));
+	if (first != NULL)
+		memcpy(&encoder.state.last_tstamp, first + offsetof(struct ALOG_1, tstamp), sizeof(uint32_t));
+	memcpy(out, ALOG_V2_MAGIC, 4);
+	out[4] = ALOG_V2_VERSION;
+	memcpy(out + 5, &encoder.state.last_tstamp, sizeof(uint32_t));
+	encoder.pos = ALOG_V2_HEADER_SIZE;
+
+	log_scan_events(data, len, alog_v2_encode_callback, &encoder, NULL);
+	if (encoder.overflow) return -1;
+	return encoder.pos;
+}
+
+static void alog_v2_encode_callback(uint8_t *event, int len, void *arg) {
+	struct alog_v2_encoder *encoder = (struct alog_v2_encoder *)arg;
+	uint8_t buffer[ALOG_V2_MAX_ENCODED];
+	if (encoder->overflow) return;
+	int n = alog_v2_encode_event(&encoder->state, event, len, buffer);
+	if (encoder->pos + n > encoder->max) {
+		encoder->overflow = true;
+		return;
+	}
+	memcpy(encoder->out + encoder->pos, buffer, n);
+	encoder->pos += n;
+}
+
+/**
+ * alog_v2_decode()
+ * Call the callback with each plain event in a v2 log.  Decoding stops at the first damaged
+ * event because the following timestamps and dictionary entries depend on it.
+ *
+ * Returns the number of events or -1 if this is not a v2 log
+ */
+int alog_v2_decode(uint8_t *data, uint32_t len, void (*callback)(uint8_t *event, int len, void *arg), void *arg) {
+	if (len < ALOG_V2_HEADER_SIZE || memcmp(data, ALOG_V2_MAGIC, 4) != 0 || data[4] != ALOG_V2_VERSION)
+		return -1;
+	ALOG_V2_STATE state;
+	alog_v2_init(&state);
+	memcpy(&state.last_tstamp, data + 5, sizeof(uint32_t));
+	uint8_t event[256];
+	uint32_t p = ALOG_V2_HEADER_SIZE;
+	int count = 0;
+	while (p < len) {
+		int n = alog_v2_decode_event(&state, data + p, len - p, event);
+		if (n == -1) {
+			debug_print("ALOG v2 log is damaged at byte %d\n", p);
+			break;
+		}
+		if (callback != NULL) callback(event, event[1], arg);
+		count++;
+		p += n;
+	}
+	return count;
+}
+
+/**
+ * alog_v2_convert_file()
+ * Write a v2 copy of a plain or framed log
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int alog_v2_convert_file(char *in_path, char *out_path) {
+	uint32_t len;
+	uint8_t *data = alog_v2_read_file(in_path, &len);
+	if (data == NULL) return EXIT_FAILURE;
+	/* Most events get smaller, but large deltas, serial numbers and vars can make one grow */
+	uint32_t max = ALOG_V2_HEADER_SIZE + len + (len / LOG_MIN_EVENT_LEN + 1) * ALOG_V2_MAX_GROWTH;
+	uint8_t *out = malloc(max);
+	if (out == NULL) {
+		free(data);
+		return EXIT_FAILURE;
+	}
+	int64_t out_len = alog_v2_encode(data, len, out, max);
+	int rc = EXIT_FAILURE;
+	if (out_len != -1)
+		rc = alog_v2_write_file(out_path, out, out_len);
+	free(data);
+	free(out);
+	return rc;
+}
+
+struct alog_v2_expander {
+	uint8_t *out;
+	uint32_t pos;
+	uint32_t max;
+	int failed;
+};
+
+/**
+ * alog_v2_expand_callback()
+ * Append one decoded event, doubling the output buffer when it is full
+ */
+static void alog_v2_expand_callback(uint8_t *event, int len, void *arg) {
+	struct alog_v2_expander *expander = (struct alog_v2_expander *)arg;
+	if (expander->failed) return;
+	if ((uint64_t)expander->pos + len > expander->max) {
+		uint64_t max = (uint64_t)expander->max * 2;
+		if (max < (uint64_t)expander->pos + len) max = (uint64_t)expander->pos + len;
+		uint8_t *out = max > UINT32_MAX ? NULL : realloc(expander->out, max);
+		if (out == NULL) {
+			expander->failed = true;
+			return;
+		}
+		expander->out = out;
+		expander->max = max;
+	}
+	memcpy(expander->out + expander->pos, event, len);
+	expander->pos += len;
+}
+
+/**
+ * alog_v2_expand_file()
+ * Write the plain log that a v2 log was made from
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int alog_v2_expand_file(char *in_path, char *out_path) {
+	uint32_t len;
+	uint8_t *data = alog_v2_read_file(in_path, &len);
+	if (data == NULL) return EXIT_FAILURE;
+	/* Start with room for 4 times the v2 size and grow as events are decoded, so the buffer is
+	 * never more than twice the size of the plain log */
+	struct alog_v2_expander expander;
+	expander.max = len < UINT32_MAX / 4 ? len * 4 + 1 : UINT32_MAX;
+	expander.out = malloc(expander.max);
+	expander.pos = 0;
+	expander.failed = false;
+	int rc = EXIT_FAILURE;
+	if (expander.out != NULL && alog_v2_decode(data, len, alog_v2_expand_callback, &expander) != -1
+			&& !expander.failed)
+		rc = alog_v2_write_file(out_path, expander.out, expander.pos);
+	free(data);
+	free(expander.out);
+	return rc;
+}
+
+static int alog_v2_put_varint(uint8_t *out, uint32_t value) {
+	int n = 0;
+	while (value >= 0x80) {
+		out[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	out[n++] = value;
+	return n;
+}
+
+static int alog_v2_get_varint(uint8_t *in, uint32_t len, uint32_t *pos, uint32_t *value) {
+	uint32_t result = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		if (*pos >= len) return false;
+		uint8_t b = in[(*pos)++];
+		result |= (uint32_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*value = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int alog_v2_find_call(ALOG_V2_STATE *state, uint8_t *call) {
+	for (int i = 0; i < state->num_calls; i++)
+		if (memcmp(state->calls[i], call, ALOG_V2_CALL_LEN) == 0)
+			return i;
+	return -1;
+}
+
+static uint8_t *alog_v2_read_file(char *path, uint32_t *len) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size > UINT32_MAX) {
+		close(fd);
+		return NULL;
+	}
+	uint8_t *data = malloc(st.st_size + 1);
+	if (data == NULL) {
+		close(fd);
+		return NULL;
+	}
+	uint32_t done = 0;
+	while (done < st.st_size) {
+		ssize_t n = read(fd, data + done, st.st_size - done);
+		if (n <= 0) break;
+		done += n;
+	}
+	close(fd);
+	*len = done;
+	return data;
+}
+
+static int alog_v2_write_file(char *path, uint8_t *data, uint32_t len) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) return EXIT_FAILURE;
+	uint32_t done = 0;
+	while (done < len) {
+		ssize_t n = write(fd, data + done, len - done);
+		if (n <= 0) break;
+		done += n;
+	}
+	close(fd);
+	return done == len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
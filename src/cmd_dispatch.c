@@ -0,0 +1,130 @@
+/*
+ * cmd_dispatch.c
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Table driven dispatch of software commands.  The table is indexed by name space and command
+ * number, so dispatch is a bounds check and an indexed call.  Handlers are registered at
+ * startup, before commands are received, so the table is not locked.
+ *
+ * Duplicate commands, which are resent by the ground station when it misses the ACK, get
+ * an ACK but are only run again if the handler is marked idempotent.  See CommandTimeOK().
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common_config.h"
+#include "cmd_dispatch.h"
+
+_Static_assert(SWCmdOpsNumberOfCommands <= CMD_DISPATCH_MAX_COMMANDS, "CMD_DISPATCH_MAX_COMMANDS is too small for ops commands");
+_Static_assert(SwCmdPacsatNumberOfCommands <= CMD_DISPATCH_MAX_COMMANDS, "CMD_DISPATCH_MAX_COMMANDS is too small for pacsat commands");
+_Static_assert(SWCmdTlmNumberOfCommands <= CMD_DISPATCH_MAX_COMMANDS, "CMD_DISPATCH_MAX_COMMANDS is too small for telem commands");
+
+static CMD_DISPATCH_ENTRY dispatch_table[SWCmdNumberOfNamespaces][CMD_DISPATCH_MAX_COMMANDS];
+
+/**
+ * cmd_register()
+ * Register the handler for a command.  args points to num_args schemas, or is NULL if there
+ * are no arguments.  Registering a command again replaces the handler.
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE if the command or schema is not valid
+ */
+int cmd_register(SWCommandNameSpace name_space, int command, CMD_HANDLER handler,
+		int num_args, const CMD_ARG_SCHEMA *args, int idempotent) {
+	if (name_space < 0 || name_space >= SWCmdNumberOfNamespaces
+			|| command < 0 || command >= CMD_DISPATCH_MAX_COMMANDS
+			|| num_args < 0 || num_args > CMD_MAX_ARGS || (num_args > 0 && args == NULL)
+			|| handler == NULL) {
+		error_print("Can not register command %d:%d\n", name_space, command);
+		return EXIT_FAILURE;
+	}
+	CMD_DISPATCH_ENTRY *entry = &dispatch_table[name_space][command];
+	memset(entry, 0, sizeof(CMD_DISPATCH_ENTRY));
+	entry->num_args = num_args;
+	for (int i = 0; i < num_args; i++)
+		entry->args[i] = args[i];
+	entry->idempotent = idempotent;
+	entry->handler = handler;
+	return EXIT_SUCCESS;
+}
+
+void cmd_unregister(SWCommandNameSpace name_space, int command) {
+	CMD_DISPATCH_ENTRY *entry = cmd_get_entry(name_space, command);
+	if (entry != NULL)
+		memset(entry, 0, sizeof(CMD_DISPATCH_ENTRY));
+}
+
+/**
+ * cmd_get_entry()
+ * Return the registered entry for a command, or NULL if there is no handler
+ */
+CMD_DISPATCH_ENTRY *cmd_get_entry(SWCommandNameSpace name_space, int command) {
+	if (name_space < 0 || name_space >= SWCmdNumberOfNamespaces
+			|| command < 0 || command >= CMD_DISPATCH_MAX_COMMANDS)
+		return NULL;
+	CMD_DISPATCH_ENTRY *entry = &dispatch_table[name_space][command];
+	if (entry->handler == NULL) return NULL;
+	return entry;
+}
+
+/**
+ * cmd_check_args()
+ * Check the arguments of a command against its schema.
+ *
+ * Returns EXIT_SUCCESS, EXIT_UNKNOWN_COMMAND or EXIT_BAD_ARGUMENTS
+ */
+int cmd_check_args(SWCmdUplink *uplink) {
+	CMD_DISPATCH_ENTRY *entry = cmd_get_entry(uplink->namespaceNumber, uplink->comArg.command);
+	if (entry == NULL) return EXIT_UNKNOWN_COMMAND;
+	for (int i = 0; i < entry->num_args; i++) {
+		uint16_t arg = uplink->comArg.arguments[i];
+		if (arg < entry->args[i].min || arg > entry->args[i].max) {
+			debug_print("Command %d:%d arg %d is %d, must be %d - %d %s\n", uplink->namespaceNumber,
+					uplink->comArg.command, i, arg, entry->args[i].min, entry->args[i].max,
+					entry->args[i].units == NULL ? "" : entry->args[i].units);
+			return EXIT_BAD_ARGUMENTS;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * cmd_dispatch()
+ * Run the handler for a command that has been through AuthenticateSoftwareCommand().  auth_rc
+ * is the value that returned.
+ *
+ * Returns EXIT_SUCCESS if the handler ran and succeeded, EXIT_DUPLICATE if the command was a
+ * duplicate that should be ACKed but was not run, EXIT_UNKNOWN_COMMAND, EXIT_BAD_ARGUMENTS or
+ * EXIT_FAILURE if authentication or the handler failed
+ */
+int cmd_dispatch(SWCmdUplink *uplink, int auth_rc) {
+	if (auth_rc != EXIT_SUCCESS && auth_rc != EXIT_DUPLICATE) return EXIT_FAILURE;
+	CMD_DISPATCH_ENTRY *entry = cmd_get_entry(uplink->namespaceNumber, uplink->comArg.command);
+	if (entry == NULL) {
+		debug_print("No handler for command %d:%d\n", uplink->namespaceNumber, uplink->comArg.command);
+		return EXIT_UNKNOWN_COMMAND;
+	}
+	int rc = cmd_check_args(uplink);
+	if (rc != EXIT_SUCCESS) return rc;
+	if (auth_rc == EXIT_DUPLICATE && !entry->idempotent) return EXIT_DUPLICATE;
+
+	uint16_t args[CMD_MAX_ARGS];
+	memcpy(args, uplink->comArg.arguments, sizeof(args));
+	rc = entry->handler(uplink, args);
+	if (rc == EXIT_SUCCESS && auth_rc == EXIT_DUPLICATE) return EXIT_DUPLICATE;
+	return rc;
+}
+
+/**
+ * cmd_authenticate_and_dispatch()
+ * Authenticate a received command and run its handler.  See cmd_dispatch()
+ * The arguments are checked first so that a command we will not run does not move the
+ * replay window forward.
+ */
+int cmd_authenticate_and_dispatch(SWCmdUplink *uplink) {
+	int rc = cmd_check_args(uplink);
+	if (rc != EXIT_SUCCESS) return rc;
+	return cmd_dispatch(uplink, AuthenticateSoftwareCommand(uplink));
+}
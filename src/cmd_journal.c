@@ -0,0 +1,213 @@
+/*
+ * cmd_journal.c
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Journal of accepted commands, used to rebuild the replay window after a restart.  See
+ * cmd_journal.h
+ *
+ * Saving a command is a copy of one 64 byte record into each copy of the mapped file and an
+ * msync of the page that holds it in each.  This replaces the open, write, close and rename of
+ * a tmp file, which also has to update the directory.  Records are 64 bytes so one never crosses
+ * a page.  Each copy starts on a page boundary and is padded to a whole number of pages, so no
+ * page holds records from both copies.  With 16K or 64K pages a copy is a single page that holds
+ * every record, which is why the copies must be synced one after the other.  Records appended
+ * without a sync are only written to the second copy by cmd_journal_sync(), after the first copy
+ * is on disk.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common_config.h"
+#include "cmd_journal.h"
+#include "crc.h"
+
+_Static_assert(sizeof(CMD_JOURNAL_RECORD) == 64, "Journal records must be 64 bytes");
+
+#define CMD_JOURNAL_SIZE (CMD_JOURNAL_RECORDS * sizeof(CMD_JOURNAL_RECORD)) /* The records in one copy */
+#define CMD_JOURNAL_COPIES 2
+
+static CMD_JOURNAL_RECORD *journal = NULL; /* The first copy */
+static CMD_JOURNAL_RECORD *journal_mirror = NULL; /* The second copy, on the page after the first */
+static uint32_t journal_seq = 0; /* Sequence number of the newest valid record */
+static uint32_t mirror_seq = 0; /* Newest record that is in both copies */
+static long page_size = 4096;
+static size_t copy_size = CMD_JOURNAL_SIZE; /* CMD_JOURNAL_SIZE rounded up to whole pages */
+
+/* Forward declarations */
+static int cmd_journal_record_valid(CMD_JOURNAL_RECORD *record);
+static CMD_JOURNAL_RECORD *cmd_journal_newest(int slot);
+static int cmd_journal_sync_copy(CMD_JOURNAL_RECORD *copy, uint32_t pending);
+
+/**
+ * cmd_journal_open()
+ * Open the journal, creating it if needed, and find the newest valid record.
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE if the journal could not be mapped
+ */
+int cmd_journal_open(char *path) {
+	if (journal != NULL) cmd_journal_close();
+	page_size = sysconf(_SC_PAGESIZE);
+	copy_size = (CMD_JOURNAL_SIZE + page_size - 1) / page_size * page_size;
+
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		error_print("Could not open command journal %s\n", path);
+		return EXIT_FAILURE;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (st.st_size != CMD_JOURNAL_COPIES * copy_size
+			&& ftruncate(fd, CMD_JOURNAL_COPIES * copy_size) == -1)) {
+		error_print("Could not size command journal %s\n", path);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	void *map = mmap(NULL, CMD_JOURNAL_COPIES * copy_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // The mapping keeps the file open
+	if (map == MAP_FAILED) {
+		error_print("Could not map command journal %s\n", path);
+		return EXIT_FAILURE;
+	}
+	journal = (CMD_JOURNAL_RECORD *)map;
+	journal_mirror = (CMD_JOURNAL_RECORD *)((char *)map + copy_size);
+
+	/* Records only in the first copy, from a crash before they were mirrored, are mirrored by
+	 * the next sync.  A slot that is damaged in one copy is fixed when the slot is reused. */
+	journal_seq = 0;
+	mirror_seq = 0;
+	for (int i = 0; i < CMD_JOURNAL_RECORDS; i++) {
+		CMD_JOURNAL_RECORD *record = cmd_journal_newest(i);
+		if (record != NULL && record->seq > journal_seq)
+			journal_seq = record->seq;
+		if (cmd_journal_record_valid(&journal_mirror[i]) && journal_mirror[i].seq > mirror_seq)
+			mirror_seq = journal_mirror[i].seq;
+	}
+	debug_print("Command journal %s opened at record %d\n", path, journal_seq);
+	return EXIT_SUCCESS;
+}
+
+void cmd_journal_close() {
+	if (journal == NULL) return;
+	cmd_journal_sync();
+	munmap(journal, CMD_JOURNAL_COPIES * copy_size);
+	journal = NULL;
+	journal_mirror = NULL;
+}
+
+int cmd_journal_is_open() {
+	return journal != NULL;
+}
+
+/**
+ * cmd_journal_append()
+ * Add a command to the journal, overwriting the oldest record.  If sync is true then the record
+ * is written to disk in both copies before we return.  Otherwise call cmd_journal_sync() after
+ * a batch.
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int cmd_journal_append(uint32_t dateTime, uint8_t *digest, int sync) {
+	if (journal == NULL) return EXIT_FAILURE;
+	CMD_JOURNAL_RECORD record;
+	memset(&record, 0, sizeof(record));
+	record.magic = CMD_JOURNAL_MAGIC;
+	record.seq = journal_seq + 1;
+	if (record.seq == 0) record.seq = 1;
+	record.dateTime = dateTime;
+	memcpy(record.digest, digest, sizeof(record.digest));
+	record.crc = gen_crc((unsigned char *)&record, sizeof(record) - CRCLENGTH);
+
+	memcpy(&journal[record.seq % CMD_JOURNAL_RECORDS], &record, sizeof(record));
+	journal_seq = record.seq;
+
+	if (sync)
+		return cmd_journal_sync();
+	return EXIT_SUCCESS;
+}
+
+/**
+ * cmd_journal_sync()
+ * Write the records added since the last sync to disk in the first copy, then copy them to
+ * the second copy and write that.
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE
+ */
+int cmd_journal_sync() {
+	if (journal == NULL) return EXIT_FAILURE;
+	uint32_t pending = journal_seq - mirror_seq;
+	if (pending == 0) return EXIT_SUCCESS;
+	if (pending > CMD_JOURNAL_RECORDS) pending = CMD_JOURNAL_RECORDS;
+	if (cmd_journal_sync_copy(journal, pending) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	for (uint32_t seq = journal_seq - pending + 1; seq != journal_seq + 1; seq++)
+		journal_mirror[seq % CMD_JOURNAL_RECORDS] = journal[seq % CMD_JOURNAL_RECORDS];
+	if (cmd_journal_sync_copy(journal_mirror, pending) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	mirror_seq = journal_seq;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * cmd_journal_replay()
+ * Call the callback for each valid record from the oldest to the newest.  Each slot is taken
+ * from whichever copy holds the newest valid record.
+ *
+ * Returns the number of valid records
+ */
+int cmd_journal_replay(void (*callback)(CMD_JOURNAL_RECORD *record, void *arg), void *arg) {
+	if (journal == NULL || journal_seq == 0) return 0;
+	int count = 0;
+	/* The newest record is at journal_seq, so the oldest possible one is in the next slot */
+	for (int i = 1; i <= CMD_JOURNAL_RECORDS; i++) {
+		CMD_JOURNAL_RECORD *record = cmd_journal_newest((journal_seq + i) % CMD_JOURNAL_RECORDS);
+		if (record == NULL) continue;
+		if (journal_seq - record->seq >= CMD_JOURNAL_RECORDS) continue; // stale record from an old journal
+		callback(record, arg);
+		count++;
+	}
+	return count;
+}
+
+static int cmd_journal_record_valid(CMD_JOURNAL_RECORD *record) {
+	if (record->magic != CMD_JOURNAL_MAGIC || record->seq == 0) return false;
+	if ((uint16_t)gen_crc((unsigned char *)record, sizeof(CMD_JOURNAL_RECORD) - CRCLENGTH) != record->crc)
+		return false;
+	return true;
+}
+
+/* The newest valid record in this slot of either copy, or NULL if neither is valid */
+static CMD_JOURNAL_RECORD *cmd_journal_newest(int slot) {
+	CMD_JOURNAL_RECORD *a = &journal[slot];
+	CMD_JOURNAL_RECORD *b = &journal_mirror[slot];
+	int a_valid = cmd_journal_record_valid(a);
+	int b_valid = cmd_journal_record_valid(b);
+	if (a_valid && b_valid) return (int32_t)(a->seq - b->seq) >= 0 ? a : b;
+	if (a_valid) return a;
+	if (b_valid) return b;
+	return NULL;
+}
+
+/**
+ * cmd_journal_sync_copy()
+ * Write the pages of one copy that hold the newest pending records.  A single record, the
+ * usual case, is one page.
+ */
+static int cmd_journal_sync_copy(CMD_JOURNAL_RECORD *copy, uint32_t pending) {
+	void *start = copy;
+	size_t len = CMD_JOURNAL_SIZE;
+	if (pending == 1) {
+		start = (void *)((uintptr_t)&copy[journal_seq % CMD_JOURNAL_RECORDS] & ~(uintptr_t)(page_size - 1));
+		len = page_size;
+	}
+	if (msync(start, len, MS_SYNC) == -1) {
+		error_print("Could not sync command journal\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,225 @@
+/*
+ * frame_trace.c
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Ring of traced AGW frames, see frame_trace.h
+ *
+ * A writer claims the next entry with an atomic increment of the head, so the TX path and the
+ * listener thread can both record without a lock.  The entry's seq is cleared while it is
+ * written and set to the sequence number + 1 when it is complete.  A reader copies an entry
+ * and checks seq before and after, so an entry that was overwritten during the copy is skipped.
+ *
+ * The hex formatter copies two characters per byte from a 256 entry table instead of calling
+ * printf for each byte.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "common_config.h"
+#include "frame_trace.h"
+
+#define FRAME_TRACE_HEX_ROW(h) h"0" h"1" h"2" h"3" h"4" h"5" h"6" h"7" \
+		h"8" h"9" h"a" h"b" h"c" h"d" h"e" h"f"
+
+/* The two hex digits for each byte value */
+static const char frame_trace_hex[] =
+		FRAME_TRACE_HEX_ROW("0") FRAME_TRACE_HEX_ROW("1") FRAME_TRACE_HEX_ROW("2") FRAME_TRACE_HEX_ROW("3")
+		FRAME_TRACE_HEX_ROW("4") FRAME_TRACE_HEX_ROW("5") FRAME_TRACE_HEX_ROW("6") FRAME_TRACE_HEX_ROW("7")
+		FRAME_TRACE_HEX_ROW("8") FRAME_TRACE_HEX_ROW("9") FRAME_TRACE_HEX_ROW("a") FRAME_TRACE_HEX_ROW("b")
+		FRAME_TRACE_HEX_ROW("c") FRAME_TRACE_HEX_ROW("d") FRAME_TRACE_HEX_ROW("e") FRAME_TRACE_HEX_ROW("f");
+
+static FRAME_TRACE_ENTRY frame_trace_ring[FRAME_TRACE_LEN];
+static uint32_t frame_trace_head = 0; /* Sequence number of the next entry */
+static int frame_trace_on[FRAME_TRACE_NUM_DIRS] = {false, false};
+
+/* Forward declarations */
+static int frame_trace_read_entry(uint32_t seq, FRAME_TRACE_ENTRY *entry);
+
+void frame_trace_enable(enum FRAME_TRACE_DIR dir, int on) {
+	if (dir < 0 || dir >= FRAME_TRACE_NUM_DIRS) return;
+	__atomic_store_n(&frame_trace_on[dir], on, __ATOMIC_RELAXED);
+}
+
+int frame_trace_enabled(enum FRAME_TRACE_DIR dir) {
+	if (dir < 0 || dir >= FRAME_TRACE_NUM_DIRS) return false;
+	return __atomic_load_n(&frame_trace_on[dir], __ATOMIC_RELAXED);
+}
+
+/**
+ * frame_trace_record()
+ * Add a frame to the ring if tracing is on for this direction.  Only the first
+ * FRAME_TRACE_SNIPPET_LEN bytes of the data are kept.
+ */
+void frame_trace_record(enum FRAME_TRACE_DIR dir, char kind, int port, int pid,
+		const char *call_from, const char *call_to, const unsigned char *data, int len) {
+	if (!frame_trace_enabled(dir)) return;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	uint32_t seq = __atomic_fetch_add(&frame_trace_head, 1, __ATOMIC_RELAXED);
+	FRAME_TRACE_ENTRY *entry = &frame_trace_ring[seq & (FRAME_TRACE_LEN - 1)];
+	__atomic_store_n(&entry->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	entry->dir = dir;
+	entry->kind = kind;
+	entry->port = port;
+	entry->pid = pid;
+	entry->time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	memcpy(entry->call_from, call_from, FRAME_TRACE_CALL_LEN);
+	memcpy(entry->call_to, call_to, FRAME_TRACE_CALL_LEN);
+	entry->data_len = len;
+	int snippet_len = len < FRAME_TRACE_SNIPPET_LEN ? len : FRAME_TRACE_SNIPPET_LEN;
+	if (snippet_len < 0 || data == NULL) snippet_len = 0;
+	entry->snippet_len = snippet_len;
+	memcpy(entry->snippet, data, snippet_len);
+
+	__atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void frame_trace_clear() {
+	for (int i = 0; i < FRAME_TRACE_LEN; i++)
+		__atomic_store_n(&frame_trace_ring[i].seq, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * frame_trace_snapshot()
+ * Copy the complete entries in the ring, oldest first.  Entries that are being written
+ * while the ring is copied are left out.
+ *
+ * Returns the number of entries copied
+ */
+int frame_trace_snapshot(FRAME_TRACE_ENTRY *entries, int max_entries) {
+	uint32_t head = __atomic_load_n(&frame_trace_head, __ATOMIC_ACQUIRE);
+	uint32_t count = head < FRAME_TRACE_LEN ? head : FRAME_TRACE_LEN;
+	if (count > (uint32_t)max_entries) count = max_entries;
+	int n = 0;
+	for (uint32_t seq = head - count; seq != head; seq++)
+		if (frame_trace_read_entry(seq, &entries[n]))
+			n++;
+	return n;
+}
+
+/**
+ * frame_trace_dump()
+ * Format every entry in the ring, oldest first
+ *
+ * Returns the number of entries written
+ */
+int frame_trace_dump(FILE *out) {
+	FRAME_TRACE_ENTRY *entries = malloc(FRAME_TRACE_LEN * sizeof(FRAME_TRACE_ENTRY));
+	if (entries == NULL) return 0;
+	int n = frame_trace_snapshot(entries, FRAME_TRACE_LEN);
+	char line[128 + FRAME_TRACE_DATA_STR_LEN(FRAME_TRACE_SNIPPET_LEN)];
+	for (int i = 0; i < n; i++) {
+		frame_trace_format_entry(&entries[i], line, sizeof(line));
+		fputs(line, out);
+		fputc('\n', out);
+	}
+	free(entries);
+	return n;
+}
+
+/**
+ * frame_trace_format_hex()
+ * Write each byte as two hex digits and a space.  out must hold 3 * len + 1 characters.
+ *
+ * Returns the length of the string
+ */
+int frame_trace_format_hex(const unsigned char *data, int len, char *out) {
+	char *p = out;
+	for (int i = 0; i < len; i++) {
+		memcpy(p, &frame_trace_hex[2 * data[i]], 2);
+		p[2] = ' ';
+		p += 3;
+	}
+	*p = '\0';
+	return p - out;
+}
+
+/**
+ * frame_trace_format_data()
+ * Write the data as text, with a space for each unprintable byte, followed by " : " and the
+ * hex.  This is the layout print_data() has always used.  If size is less than
+ * FRAME_TRACE_DATA_STR_LEN(len) then fewer bytes are written.
+ *
+ * Returns the length of the string
+ */
+int frame_trace_format_data(const unsigned char *data, int len, char *out, int size) {
+	if (size <= 0) return 0;
+	if (FRAME_TRACE_DATA_STR_LEN(len) > size)
+		len = (size - 4) / 4;
+	if (len < 0) len = 0;
+	char *p = out;
+	for (int i = 0; i < len; i++)
+		*p++ = isprint(data[i]) ? data[i] : ' ';
+	memcpy(p, " : ", 3);
+	p += 3;
+	p += frame_trace_format_hex(data, len, p);
+	return p - out;
+}
+
+/**
+ * frame_trace_format_call()
+ * Copy the printable characters of an AGW callsign field.  out must hold
+ * FRAME_TRACE_CALL_LEN + 1 characters.
+ *
+ * Returns the length of the string
+ */
+int frame_trace_format_call(const char *call, char *out) {
+	int n = 0;
+	for (int i = 0; i < FRAME_TRACE_CALL_LEN && call[i] != '\0'; i++)
+		if (isprint((unsigned char)call[i]))
+			out[n++] = call[i];
+	out[n] = '\0';
+	return n;
+}
+
+/**
+ * frame_trace_format_entry()
+ * Format one entry on a line without a newline
+ *
+ * Returns the length of the string
+ */
+int frame_trace_format_entry(FRAME_TRACE_ENTRY *entry, char *out, int size) {
+	char from[FRAME_TRACE_CALL_LEN + 1];
+	char to[FRAME_TRACE_CALL_LEN + 1];
+	frame_trace_format_call(entry->call_from, from);
+	frame_trace_format_call(entry->call_to, to);
+
+	time_t secs = entry->time_ns / 1000000000ULL;
+	struct tm tm;
+	gmtime_r(&secs, &tm);
+	int n = snprintf(out, size, "%02d:%02d:%02d.%06d %s Port [%d] Kind %c Pid %02X From:%s To:%s Len:%d || ",
+			tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(entry->time_ns % 1000000000ULL / 1000),
+			entry->dir == FRAME_TRACE_TX ? "TX" : "RX", entry->port,
+			isprint(entry->kind) ? entry->kind : '?', entry->pid, from, to, entry->data_len);
+	if (n < 0 || n >= size) return size - 1;
+	n += frame_trace_format_data(entry->snippet, entry->snippet_len, out + n, size - n);
+	if (entry->data_len > entry->snippet_len && n + 4 < size) {
+		memcpy(out + n, "...", 4);
+		n += 3;
+	}
+	return n;
+}
+
+/**
+ * frame_trace_read_entry()
+ * Copy the entry with this sequence number if it is complete and has not been overwritten
+ *
+ * Returns true if the entry was copied
+ */
+static int frame_trace_read_entry(uint32_t seq, FRAME_TRACE_ENTRY *entry) {
+	FRAME_TRACE_ENTRY *slot = &frame_trace_ring[seq & (FRAME_TRACE_LEN - 1)];
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1) return false;
+	memcpy(entry, slot, sizeof(FRAME_TRACE_ENTRY));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1) return false;
+	entry->seq = seq + 1;
+	return true;
+}
@@ -8,18 +8,15 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define SHA256_BLOCK_SIZE 64
 
-/* LOCAL FUNCTIONS */
+/* Largest piece handed to Sha256Update, which takes a 32 bit length */
+#define SHA256_MAX_UPDATE 0x40000000UL
 
-// Concatenate X & Y, return hash.
-static void* H(const void* x,
-               const size_t xlen,
-               const void* y,
-               const size_t ylen,
-               void* out,
-               const size_t outlen);
+/* LOCAL FUNCTIONS */
 
 // Wrapper for sha256
 static void* sha256(const void* data,
@@ -27,6 +24,11 @@ static void* sha256(const void* data,
                     void* out,
                     const size_t outlen);
 
+// Sha256Update for lengths that do not fit in 32 bits
+static void sha256_update64(Sha256Context* ctx,
+                            const void* data,
+                            uint64_t datalen);
+
 // Declared in hmac_sha256.h
 size_t hmac_sha256(const void* key,
                    const size_t keylen,
@@ -34,12 +36,20 @@ size_t hmac_sha256(const void* key,
                    const size_t datalen,
                    void* out,
                    const size_t outlen) {
+  HmacSha256Context ctx;
+
+  hmac_sha256_init(&ctx, key, keylen);
+  hmac_sha256_update(&ctx, data, datalen);
+  return hmac_sha256_final(&ctx, out, outlen);
+}
+
+// Declared in hmac_sha256.h
+void hmac_sha256_init(HmacSha256Context* ctx,
+                      const void* key,
+                      const size_t keylen) {
   uint8_t k[SHA256_BLOCK_SIZE];
   uint8_t k_ipad[SHA256_BLOCK_SIZE];
   uint8_t k_opad[SHA256_BLOCK_SIZE];
-  uint8_t ihash[SHA256_HASH_SIZE];
-  uint8_t ohash[SHA256_HASH_SIZE];
-  size_t sz;
   int i;
 
   memset(k, 0, sizeof(k));
@@ -61,32 +71,84 @@ size_t hmac_sha256(const void* key,
 
   // Perform HMAC algorithm: ( https://tools.ietf.org/html/rfc2104 )
   //      `H(K XOR opad, H(K XOR ipad, data))`
-  H(k_ipad, sizeof(k_ipad), data, datalen, ihash, sizeof(ihash));
-  H(k_opad, sizeof(k_opad), ihash, sizeof(ihash), ohash, sizeof(ohash));
+  // Both pads are exactly one block, so they are absorbed here and the
+  // contexts hold the midstates for the rest of the calculation.
+  Sha256Initialise(&ctx->inner);
+  Sha256Update(&ctx->inner, k_ipad, sizeof(k_ipad));
+  Sha256Initialise(&ctx->outer);
+  Sha256Update(&ctx->outer, k_opad, sizeof(k_opad));
 
-  sz = (outlen > SHA256_HASH_SIZE) ? SHA256_HASH_SIZE : outlen;
-  memcpy(out, ohash, sz);
-  return sz;
+  memset(k, 0, sizeof(k));
+}
+
+// Declared in hmac_sha256.h
+void hmac_sha256_update(HmacSha256Context* ctx,
+                        const void* data,
+                        const uint64_t datalen) {
+  sha256_update64(&ctx->inner, data, datalen);
 }
 
-static void* H(const void* x,
-               const size_t xlen,
-               const void* y,
-               const size_t ylen,
-               void* out,
-               const size_t outlen) {
+// Declared in hmac_sha256.h
+size_t hmac_sha256_final(HmacSha256Context* ctx,
+                         void* out,
+                         const size_t outlen) {
+  SHA256_HASH ihash;
+  SHA256_HASH ohash;
   size_t sz;
-  Sha256Context ctx;
-  SHA256_HASH hash;
 
-  Sha256Initialise(&ctx);
-  Sha256Update(&ctx, x, xlen);
-  Sha256Update(&ctx, y, ylen);
-  Sha256Finalise(&ctx, &hash);
+  Sha256Finalise(&ctx->inner, &ihash);
+  Sha256Update(&ctx->outer, ihash.bytes, sizeof(ihash.bytes));
+  Sha256Finalise(&ctx->outer, &ohash);
 
   sz = (outlen > SHA256_HASH_SIZE) ? SHA256_HASH_SIZE : outlen;
+  memcpy(out, ohash.bytes, sz);
+  return sz;
+}
 
-  return memcpy(out, hash.bytes, sz);
+// Declared in hmac_sha256.h
+int64_t hmac_sha256_update_fd(HmacSha256Context* ctx,
+                              int fd,
+                              const uint64_t offset,
+                              const uint64_t len) {
+  uint8_t buf[HMAC_FILE_BUFFER_SIZE];
+  uint64_t done = 0;
+
+  while (done < len) {
+    uint64_t want = len - done;
+    if (want > sizeof(buf)) want = sizeof(buf);
+    ssize_t n = pread(fd, buf, (size_t)want, (off_t)(offset + done));
+    if (n < 0) return -1;
+    if (n == 0) break; // end of the file, it may still be arriving
+    Sha256Update(&ctx->inner, buf, (uint32_t)n);
+    done += n;
+  }
+  return (int64_t)done;
+}
+
+// Declared in hmac_sha256.h
+size_t hmac_sha256_file(const void* key,
+                        const size_t keylen,
+                        const char* path,
+                        void* out,
+                        const size_t outlen) {
+  HmacSha256Context ctx;
+  uint8_t buf[HMAC_FILE_BUFFER_SIZE];
+  ssize_t n;
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return 0;
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  hmac_sha256_init(&ctx, key, keylen);
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    Sha256Update(&ctx.inner, buf, (uint32_t)n);
+  }
+  close(fd);
+  if (n < 0) return 0;
+
+  return hmac_sha256_final(&ctx, out, outlen);
 }
 
 static void* sha256(const void* data,
@@ -98,9 +160,22 @@ static void* sha256(const void* data,
   SHA256_HASH hash;
 
   Sha256Initialise(&ctx);
-  Sha256Update(&ctx, data, datalen);
+  sha256_update64(&ctx, data, datalen);
   Sha256Finalise(&ctx, &hash);
 
   sz = (outlen > SHA256_HASH_SIZE) ? SHA256_HASH_SIZE : outlen;
   return memcpy(out, hash.bytes, sz);
 }
+
+static void sha256_update64(Sha256Context* ctx,
+                            const void* data,
+                            uint64_t datalen) {
+  const uint8_t* p = (const uint8_t*)data;
+
+  while (datalen > SHA256_MAX_UPDATE) {
+    Sha256Update(ctx, p, SHA256_MAX_UPDATE);
+    p += SHA256_MAX_UPDATE;
+    datalen -= SHA256_MAX_UPDATE;
+  }
+  Sha256Update(ctx, p, (uint32_t)datalen);
+}
@@ -7,22 +7,74 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include "common_config.h"
 #include "str_util.h"
 #include "iors_command.h"
 #include "hmac_sha256.h"
 #include "keyfile.h"
+#include "crc.h"
+#include "cmd_journal.h"
+#include "iors_metrics.h"
+#include "span_trace.h"
 
 /* Forwards */
+struct name_table;
 int load_last_command_time();
 int store_last_command_time();
-int CommandTimeOK(uint32_t dateTime);
+int CommandTimeOK(uint32_t dateTime, uint8_t *auth_vector);
+int CommandTimeCheck(uint32_t dateTime, uint8_t *auth_vector);
+static int auth_rate_limit_ok(char *callsign);
+static void auth_count_result(int rc);
+static void replay_window_add(uint32_t dateTime, uint64_t digest);
+static int replay_window_has(uint32_t dateTime, uint8_t *auth_vector);
+static void replay_journal_record(CMD_JOURNAL_RECORD *record, void *arg);
+static int save_accepted_command(uint32_t dateTime, uint8_t *auth_vector, int sync);
+static void build_name_tables();
+static int name_table_lookup(struct name_table *table, const char *name);
 
 char last_command_time_path[MAX_FILE_PATH_LEN] = "pacsat_last_command_time.dat";
-static uint32_t last_command_time = 0x0; /* Keep track of the time that the last command was received */
+
+#define REPLAY_WINDOW_MAGIC 0x52504c57 /* RPLW */
+
+/* The replay window.  It records the newest command time, which commands in the
+ * REPLAY_WINDOW_SIZE seconds before that were accepted and the first 8 bytes of the
+ * authentication vectors of the last REPLAY_DIGESTS commands.  This is saved to the last
+ * command time file as is, with a CRC. */
+struct replay_window {
+	uint32_t magic;
+	uint32_t last_command_time; /* Keep track of the time that the last command was received */
+	uint64_t bitmap; /* bit n is set if a command with time last_command_time - n was accepted */
+	uint32_t forgotten_time; /* newest command time whose digest has been pushed out of digests[] */
+	uint32_t next_digest;
+	uint32_t digest_times[REPLAY_DIGESTS];
+	uint64_t digests[REPLAY_DIGESTS];
+	uint16_t crc;
+} __attribute__ ((__packed__));
+
+_Static_assert(COMMAND_TIME_TOLLERANCE <= REPLAY_WINDOW_SIZE, "The replay window must cover the command time tolerance");
+_Static_assert(REPLAY_WINDOW_SIZE <= 64, "The replay window bitmap is 64 bits");
+
+static struct replay_window replay_window;
 static SWCmdUplink last_command;
 
+/* Token bucket for each station that is sending us commands.  Tokens are held in 1/1000ths */
+struct auth_rate_limit {
+	char callsign[MAX_CALLSIGN_LEN];
+	int64_t last_ms;
+	int64_t tokens;
+};
+static struct auth_rate_limit auth_rate_limits[AUTH_RATE_LIMIT_STATIONS];
+/* Shared by every station we have not seen before, so changing callsign does not refill a bucket */
+static struct auth_rate_limit auth_rate_new_stations = { "", 0, (int64_t)AUTH_RATE_LIMIT_BURST * 1000 };
+static pthread_mutex_t auth_rate_limit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int auth_rate_per_min = AUTH_RATE_LIMIT_PER_MIN;
+static int auth_rate_burst = AUTH_RATE_LIMIT_BURST;
+static uint32_t auth_reject_counts[AuthNumberOfRejectReasons];
+
 /* This defines the folder names that can be referenced in commands using the ids in FolderIds
  * IMPORTANT - Must also change the enum in iors_command.h that corresponds to this */
 char *FolderIdStrings[] = {
@@ -92,6 +144,10 @@ char *OpsCommandStrings[] = {
 		,"nop"
 		,"cmd-key"
 		,"hdmi"
+		,"log-level"
+};
+char *TlmCommandStrings[] = {
+		"reserved"
 };
 char *PacsatCommandStrings[] = {
 		"reserved"
@@ -110,6 +166,48 @@ char *PacsatCommandStrings[] = {
 		,"exec-file" //13
 };
 
+#define NAME_TABLE_SLOTS 64 /* Power of two, at least twice the largest string table */
+#define NAME_TABLE_MAX_SEEDS 65536 /* A table that needs more tries than this is a build error */
+#define ARRAY_LEN(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+_Static_assert(ARRAY_LEN(FolderIdStrings) == NumberOfFolderIds, "FolderIdStrings must match FolderIds");
+_Static_assert(ARRAY_LEN(NameSpaceStrings) == SWCmdNumberOfNamespaces, "NameSpaceStrings must match SWCommandNameSpace");
+_Static_assert(ARRAY_LEN(OpsCommandStrings) == SWCmdOpsNumberOfCommands, "OpsCommandStrings must match SWOpsCommands");
+_Static_assert(ARRAY_LEN(TlmCommandStrings) == SWCmdTlmNumberOfCommands, "TlmCommandStrings must match SWTlmCommands");
+_Static_assert(ARRAY_LEN(PacsatCommandStrings) == SwCmdPacsatNumberOfCommands, "PacsatCommandStrings must match SWPacsatCommands");
+_Static_assert(SWCmdOpsNumberOfCommands * 2 <= NAME_TABLE_SLOTS && SwCmdPacsatNumberOfCommands * 2 <= NAME_TABLE_SLOTS,
+		"NAME_TABLE_SLOTS is too small for the command strings");
+
+/* Perfect hash of a string table for case insensitive lookups.  slots holds the index + 1 of
+ * the string that hashes there, or 0 */
+struct name_table {
+	char **strings;
+	int count;
+	uint32_t seed;
+	uint8_t slots[NAME_TABLE_SLOTS];
+};
+
+static pthread_once_t name_tables_once = PTHREAD_ONCE_INIT;
+static struct name_table NameSpaceTable = { NameSpaceStrings, SWCmdNumberOfNamespaces };
+/* Indexed by name space.  It must match the enum in iors_command.h */
+static struct name_table CommandTables[] = {
+		{ NULL, 0 }
+		,{ OpsCommandStrings, SWCmdOpsNumberOfCommands }
+		,{ TlmCommandStrings, SWCmdTlmNumberOfCommands }
+		,{ PacsatCommandStrings, SwCmdPacsatNumberOfCommands }
+};
+_Static_assert(ARRAY_LEN(CommandTables) == SWCmdNumberOfNamespaces, "CommandTables must match SWCommandNameSpace");
+
+/* The number of commands in each name space.  No command is valid in the reserved name space.
+ * It must match the enum in iors_command.h */
+static const int NameSpaceNumberOfCommands[] = {
+		0
+		,SWCmdOpsNumberOfCommands
+		,ARRAY_LEN(TlmCommandStrings)
+		,SwCmdPacsatNumberOfCommands
+};
+_Static_assert(ARRAY_LEN(NameSpaceNumberOfCommands) == SWCmdNumberOfNamespaces, "NameSpaceNumberOfCommands must match SWCommandNameSpace");
+
 int SymbolRates[] = {
 		1200
 		,9600
@@ -119,8 +217,27 @@ SWCmdUplink *get_last_command() {
 	return &last_command;
 }
 
+/**
+ * init_commanding()
+ * Load the replay window.  The last command time file gives the starting point, which is all
+ * that older versions saved, and then every command in the journal is added to the window.
+ */
 void init_commanding() {
+	char journal_path[MAX_FILE_PATH_LEN];
 	load_last_command_time();
+
+	strlcpy(journal_path, last_command_time_path, sizeof(journal_path));
+	strlcat(journal_path, CMD_JOURNAL_EXT, sizeof(journal_path));
+	if (cmd_journal_open(journal_path) == EXIT_SUCCESS) {
+		uint32_t oldest = 0;
+		int count = cmd_journal_replay(replay_journal_record, &oldest);
+		/* If the journal has wrapped then older vectors have been forgotten */
+		if (count == CMD_JOURNAL_RECORDS && oldest > replay_window.forgotten_time)
+			replay_window.forgotten_time = oldest;
+		debug_print("Last Command Time was: %d from %d journal records\n", replay_window.last_command_time, count);
+	} else {
+		error_print("No command journal, saving the last command time to %s\n", last_command_time_path);
+	}
 }
 
 char * get_folder_str(FolderIds i) {
@@ -133,49 +250,159 @@ int get_symbol_rates(SymbolRateIds i) {
 	return SymbolRates[i];
 }
 
+/**
+ * get_namespace_from_str()
+ * Case insensitive lookup of a name space.  Returns SWCmdNSReserved if it is not known.
+ */
 int get_namespace_from_str(char *name_space) {
-	int i = 0;
-	for (i = 0; i < SWCmdNumberOfNamespaces; i++) {
-		if (strcasecmp(name_space, NameSpaceStrings[i]) == 0) {
-			return i;
-		}
-	}
-	return SWCmdNSReserved;
+	pthread_once(&name_tables_once, build_name_tables);
+	int i = name_table_lookup(&NameSpaceTable, name_space);
+	if (i < 0) return SWCmdNSReserved;
+	return i;
 }
 
+/**
+ * get_command_from_str()
+ * Case insensitive lookup of a command in a name space.  Returns 0, the reserved command,
+ * if it is not known.
+ */
 int get_command_from_str(SWCommandNameSpace name_space, char * cmd) {
-	if (name_space == SWCmdNSOps) {
-		int i = 0;
-		for (i = 0; i < SWCmdOpsNumberOfCommands; i++) {
-			if (strcasecmp(cmd, OpsCommandStrings[i]) == 0) {
-				return i;
+	if (name_space <= SWCmdNSReserved || name_space >= SWCmdNumberOfNamespaces) return SWCmdOpsReserved;
+	pthread_once(&name_tables_once, build_name_tables);
+	int i = name_table_lookup(&CommandTables[name_space], cmd);
+	if (i < 0) return SWCmdOpsReserved;
+	return i;
+}
+
+char * get_namespace_str(SWCommandNameSpace name_space) {
+	if (name_space < 0 || name_space >= SWCmdNumberOfNamespaces) return NULL;
+	return NameSpaceStrings[name_space];
+}
+
+char * get_command_str(SWCommandNameSpace name_space, int cmd) {
+	if (name_space <= SWCmdNSReserved || name_space >= SWCmdNumberOfNamespaces) return NULL;
+	struct name_table *table = &CommandTables[name_space];
+	if (cmd < 0 || cmd >= table->count) return NULL;
+	return table->strings[cmd];
+}
+
+/**
+ * name_hash()
+ * FNV-1a of the lower case string, mixed with the table seed
+ */
+static uint32_t name_hash(const char *name, uint32_t seed) {
+	uint32_t h = 2166136261u ^ seed;
+	while (*name) {
+		h ^= (uint8_t)tolower((unsigned char)*name++);
+		h *= 16777619u;
+	}
+	return h ^ (h >> 15);
+}
+
+/**
+ * build_name_table()
+ * Find a seed where every string in the table hashes to a different slot, so that a lookup
+ * is one hash and one string compare.  The tables are small and fixed so this takes a
+ * handful of tries and is done once.  The C preprocessor can not run the search, so it is
+ * done at run time.  If no seed is found then the string tables have been changed in a way
+ * that needs more slots, so we stop rather than run with lookups that do not work.
+ */
+static void build_name_table(struct name_table *table) {
+	for (uint32_t seed = 0; seed < NAME_TABLE_MAX_SEEDS; seed++) {
+		int collision = false;
+		memset(table->slots, 0, sizeof(table->slots));
+		for (int i = 0; i < table->count; i++) {
+			uint32_t slot = name_hash(table->strings[i], seed) & (NAME_TABLE_SLOTS - 1);
+			if (table->slots[slot] != 0) {
+				collision = true;
+				break;
 			}
+			table->slots[slot] = i + 1;
+		}
+		if (!collision) {
+			table->seed = seed;
+			return;
 		}
 	}
-	if (name_space == SWCmdNSPacsat) {
-		int i = 0;
-		for (i = 0; i < SwCmdPacsatNumberOfCommands; i++) {
-			if (strcasecmp(cmd, PacsatCommandStrings[i]) == 0) {
-				return i;
+	error_print("No perfect hash seed for the table starting \"%s\", increase NAME_TABLE_SLOTS\n", table->strings[0]);
+	abort();
+}
+
+static void build_name_tables() {
+	build_name_table(&NameSpaceTable);
+	for (int i = 0; i < SWCmdNumberOfNamespaces; i++)
+		if (CommandTables[i].count > 0)
+			build_name_table(&CommandTables[i]);
+}
+
+/**
+ * check_command_names()
+ * Check that every name space and command name looks up to its own id, in lower and upper
+ * case, and back again.  Run by the bench target and can be run at startup.
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE if any name does not resolve
+ */
+int check_command_names() {
+	char upper[MAX_CONFIG_LINE_LENGTH];
+	int rc = EXIT_SUCCESS;
+	for (int ns = SWCmdNSReserved + 1; ns < SWCmdNumberOfNamespaces; ns++) {
+		strlcpy(upper, NameSpaceStrings[ns], sizeof(upper));
+		for (char *c = upper; *c; c++) *c = toupper((unsigned char)*c);
+		if (get_namespace_from_str(NameSpaceStrings[ns]) != ns || get_namespace_from_str(upper) != ns
+				|| get_namespace_str(ns) != NameSpaceStrings[ns]) {
+			error_print("Name space %s does not resolve\n", NameSpaceStrings[ns]);
+			rc = EXIT_FAILURE;
+		}
+		struct name_table *table = &CommandTables[ns];
+		for (int cmd = 1; cmd < table->count; cmd++) {
+			strlcpy(upper, table->strings[cmd], sizeof(upper));
+			for (char *c = upper; *c; c++) *c = toupper((unsigned char)*c);
+			if (get_command_from_str(ns, table->strings[cmd]) != cmd || get_command_from_str(ns, upper) != cmd
+					|| get_command_str(ns, cmd) != table->strings[cmd]) {
+				error_print("Command %s %s does not resolve\n", NameSpaceStrings[ns], table->strings[cmd]);
+				rc = EXIT_FAILURE;
 			}
 		}
 	}
-	return SWCmdOpsReserved;
+	return rc;
 }
 
+static int name_table_lookup(struct name_table *table, const char *name) {
+	if (table->count == 0 || name == NULL) return -1;
+	uint8_t i = table->slots[name_hash(name, table->seed) & (NAME_TABLE_SLOTS - 1)];
+	if (i == 0) return -1;
+	if (strcasecmp(name, table->strings[i - 1]) != 0) return -1;
+	return i - 1;
+}
+
+/**
+ * load_last_command_time()
+ * Load the replay window.  Older versions stored the last command time as text, so if the
+ * file is not a replay window we read it that way and start a new window from that time.
+ */
 int load_last_command_time() {
+	memset(&replay_window, 0, sizeof(replay_window));
 	FILE * fd = fopen(last_command_time_path, "r");
 	if (fd == NULL) {
 		// no command time file, make a new one
 		store_last_command_time();
+		return EXIT_SUCCESS;
+	}
+	int num = fread(&replay_window, 1, sizeof(replay_window), fd);
+	if (num == sizeof(replay_window) && replay_window.magic == REPLAY_WINDOW_MAGIC
+			&& (uint16_t)gen_crc((unsigned char *)&replay_window, sizeof(replay_window) - CRCLENGTH) == replay_window.crc) {
+		debug_print("Last Command Time was: %d\n",replay_window.last_command_time);
 	} else {
+		memset(&replay_window, 0, sizeof(replay_window));
 		char line [ MAX_CONFIG_LINE_LENGTH ]; /* or other suitable maximum line size */
-		fgets ( line, sizeof line, fd ); /* read a line */
-		line[strcspn(line,"\n")] = 0; // Move the nul termination to get rid of the new line
-		last_command_time = atol(line);
-		debug_print("Last Command Time was: %d\n",last_command_time);
-		fclose(fd);
+		rewind(fd);
+		if (fgets ( line, sizeof line, fd ) != NULL) { /* read a line */
+			line[strcspn(line,"\n")] = 0; // Move the nul termination to get rid of the new line
+			replay_window.last_command_time = atol(line);
+		}
+		debug_print("Last Command Time was: %d (no replay window)\n",replay_window.last_command_time);
 	}
+	fclose(fd);
 
 	return EXIT_SUCCESS;
 }
@@ -184,14 +411,16 @@ int store_last_command_time() {
 	char tmp_filename[MAX_FILE_PATH_LEN];
 	strlcpy(tmp_filename, last_command_time_path, sizeof(tmp_filename));
 	strlcat(tmp_filename, ".tmp", sizeof(tmp_filename));
-	FILE * fd = fopen(tmp_filename, "w");
+	FILE * fd = fopen(tmp_filename, "wb");
 	if (fd == NULL) {
 		// Not fatal but we will forget the time when we restart
 		error_print("Could not open the time command file\n");
 		return EXIT_FAILURE;
 	}
-	int rc = fprintf(fd, "%d\n", last_command_time);
-	if (rc <= 0) {
+	replay_window.magic = REPLAY_WINDOW_MAGIC;
+	replay_window.crc = gen_crc((unsigned char *)&replay_window, sizeof(replay_window) - CRCLENGTH);
+	int rc = fwrite(&replay_window, 1, sizeof(replay_window), fd);
+	if (rc != sizeof(replay_window)) {
 		error_print("Could not write to the time command file: error %d\n",rc);
 		fclose(fd);
 		return EXIT_FAILURE;
@@ -211,30 +440,92 @@ int store_last_command_time() {
  *
  */
 int AuthenticatePacket(uint32_t date_time_in_packet, uint8_t * uplink, int pkt_len, uint8_t *auth_vector) {
-	uint8_t localSecureHash[32];
-	int shaOK;
-
-	hmac_sha256(hmac_sha_key, AUTH_KEY_SIZE,
-			uplink, pkt_len,
-			localSecureHash, sizeof(localSecureHash));
-	shaOK = (memcmp(localSecureHash, auth_vector, 32) == 0);
-	    if (0) {
-	        debug_print("Local:  ");
-	        int i;
-	        for (i=0; i<sizeof(localSecureHash);i++)
-	        	debug_print("%x ", localSecureHash[i]);
-	        debug_print("\nUplink: ");
-	        for (i=0; i<sizeof(localSecureHash);i++)
-	        	debug_print("%x ", auth_vector[i]);
-	        debug_print("\n");
-	    }
-	if(shaOK){
-		return CommandTimeOK(date_time_in_packet);
+	SPAN_TRACE_SCOPE("hmac verify");
+	if (keyring_verify(date_time_in_packet, uplink, pkt_len, auth_vector, NULL) == EXIT_SUCCESS) {
+		int rc = CommandTimeOK(date_time_in_packet, auth_vector);
+		auth_count_result(rc);
+		return rc;
 	} else {
+		IORS_METRICS_INC(auth_bad_hmac);
 		return EXIT_FAILURE;
 	}
 }
 
+/**
+ * auth_count_result()
+ * Count a command that passed the HMAC check by the result of the time check
+ */
+static void auth_count_result(int rc) {
+	if (rc == EXIT_SUCCESS)
+		IORS_METRICS_INC(auth_accepted);
+	else if (rc == EXIT_DUPLICATE)
+		IORS_METRICS_INC(auth_duplicate);
+	else
+		IORS_METRICS_INC(auth_bad_time);
+}
+
+/**
+ * AuthenticatePacketBatch()
+ * Authenticate a burst of packets, e.g. when a ground station resends several commands
+ * during a short pass.  The keys are already absorbed into the HMAC contexts in the keyring.  The
+ * replay and time checks are run on each packet in the order given, exactly as if
+ * AuthenticatePacket() was called for each one, but the journal is only synced to
+ * disk once at the end.
+ *
+ * The result for each packet is put in results: EXIT_SUCCESS, EXIT_FAILURE or EXIT_DUPLICATE
+ * RETURNs the number of packets accepted
+ */
+int AuthenticatePacketBatch(AuthPacket *packets, int count, int *results) {
+	SPAN_TRACE_SCOPE("hmac verify batch");
+	int accepted = 0;
+
+	for (int i = 0; i < count; i++) {
+		if (keyring_verify(packets[i].dateTime, packets[i].data, packets[i].len,
+				packets[i].AuthenticationVector, NULL) != EXIT_SUCCESS) {
+			IORS_METRICS_INC(auth_bad_hmac);
+			results[i] = EXIT_FAILURE;
+			continue;
+		}
+		results[i] = CommandTimeCheck(packets[i].dateTime, packets[i].AuthenticationVector);
+		auth_count_result(results[i]);
+		if (results[i] == EXIT_SUCCESS) {
+			save_accepted_command(packets[i].dateTime, packets[i].AuthenticationVector, false);
+			accepted++;
+		}
+	}
+	if (accepted) {
+		if (cmd_journal_is_open())
+			cmd_journal_sync();
+		else
+			store_last_command_time();
+	}
+	return accepted;
+}
+
+/**
+ * AuthenticateSoftwareCommandBatch()
+ * Authenticate count received software commands.  See AuthenticatePacketBatch()
+ * They are processed AUTH_BATCH_MAX at a time, with a journal sync after each group.
+ *
+ * RETURNs the number of commands accepted
+ */
+int AuthenticateSoftwareCommandBatch(SWCmdUplink *uplinks, int count, int *results) {
+	AuthPacket packets[AUTH_BATCH_MAX];
+	int accepted = 0;
+	if (count <= 0) return 0;
+	for (int start = 0; start < count; start += AUTH_BATCH_MAX) {
+		int n = count - start < AUTH_BATCH_MAX ? count - start : AUTH_BATCH_MAX;
+		for (int i = 0; i < n; i++) {
+			packets[i].dateTime = uplinks[start + i].dateTime;
+			packets[i].data = (uint8_t *)&uplinks[start + i];
+			packets[i].len = SW_COMMAND_SIZE;
+			packets[i].AuthenticationVector = uplinks[start + i].AuthenticationVector;
+		}
+		accepted += AuthenticatePacketBatch(packets, n, results + start);
+	}
+	return accepted;
+}
+
 /**
  * RETURNs EXIT_SUCCESS = 0, EXIT_FAILURE = 1, DUPLICATE = 2
  */
@@ -268,12 +559,166 @@ int AuthenticateSoftwareCommand(SWCmdUplink *uplink) {
 
 }
 
+/**
+ * PrefilterSoftwareCommand()
+ * Cheap checks that are run before the HMAC so that a station sending junk to our command
+ * callsign can not make us spend time hashing it.  The fields of the command are checked
+ * first and then the station is rate limited.  Only the rate limit uses the callsign, which
+ * can be NULL if it is not known.  Each rejection is counted by reason.
+ *
+ * A command we already accepted is not rejected as too old, because the ground resends it when
+ * the ACK is lost.  It goes on to CommandTimeCheck(), which ACKs it as a duplicate.
+ *
+ * Returns AuthPrefilterOK if the command should be authenticated, otherwise the reason
+ * it was rejected
+ */
+int PrefilterSoftwareCommand(SWCmdUplink *uplink, char *from_callsign) {
+	int reason = AuthPrefilterOK;
+
+	if (uplink->address != OUR_ADDRESS)
+		reason = AuthRejectAddress;
+	else if (uplink->namespaceNumber == SWCmdNSReserved || uplink->namespaceNumber >= SWCmdNumberOfNamespaces)
+		reason = AuthRejectNamespace;
+	else if (uplink->comArg.command >= NameSpaceNumberOfCommands[uplink->namespaceNumber])
+		reason = AuthRejectCommand;
+	else if (uplink->dateTime < MIN_COMMAND_TIME || uplink->dateTime > MAX_COMMAND_TIME)
+		reason = AuthRejectTimeRange;
+	else if (replay_window.last_command_time >= MIN_COMMAND_TIME && replay_window.last_command_time <= MAX_COMMAND_TIME
+			&& (uplink->dateTime + COMMAND_TIME_TOLLERANCE) <= replay_window.last_command_time
+			&& !replay_window_has(uplink->dateTime, uplink->AuthenticationVector))
+		reason = AuthRejectTooOld;
+	else if (from_callsign != NULL && !auth_rate_limit_ok(from_callsign))
+		reason = AuthRejectRateLimit;
+
+	if (reason != AuthPrefilterOK) {
+		__atomic_fetch_add(&auth_reject_counts[reason], 1, __ATOMIC_RELAXED);
+		IORS_METRICS_INC(auth_prefiltered);
+	}
+	return reason;
+}
+
+/**
+ * AuthenticateSoftwareCommandFiltered()
+ * Run the prefilter and then authenticate the command if it passes.
+ *
+ * RETURNs EXIT_SUCCESS = 0, EXIT_FAILURE = 1, DUPLICATE = 2
+ */
+int AuthenticateSoftwareCommandFiltered(SWCmdUplink *uplink, char *from_callsign) {
+	if (PrefilterSoftwareCommand(uplink, from_callsign) != AuthPrefilterOK)
+		return EXIT_FAILURE;
+	return AuthenticateSoftwareCommand(uplink);
+}
+
+/**
+ * SetAuthRateLimit()
+ * Set the number of HMAC attempts a station can make per minute and in a single burst.  The
+ * same limit applies to all the stations we have not seen before taken together.
+ */
+void SetAuthRateLimit(int per_min, int burst) {
+	pthread_mutex_lock(&auth_rate_limit_mutex);
+	auth_rate_per_min = per_min;
+	auth_rate_burst = burst;
+	pthread_mutex_unlock(&auth_rate_limit_mutex);
+}
+
+/**
+ * GetAuthRejectCount()
+ * Return the number of commands rejected by the prefilter for this reason, e.g. for telemetry
+ */
+uint32_t GetAuthRejectCount(AuthPrefilterReasons reason) {
+	if (reason <= AuthPrefilterOK || reason >= AuthNumberOfRejectReasons) return 0;
+	return __atomic_load_n(&auth_reject_counts[reason], __ATOMIC_RELAXED);
+}
+
+/**
+ * auth_rate_take_token()
+ * Refill a bucket for the time since it was last used and take one token from it
+ */
+static int auth_rate_take_token(struct auth_rate_limit *bucket, int64_t now_ms, int64_t full) {
+	/* Refill at per_min tokens a minute, which is per_min thousandths a ms / 60 */
+	bucket->tokens += (now_ms - bucket->last_ms) * auth_rate_per_min / 60;
+	if (bucket->tokens > full) bucket->tokens = full;
+	bucket->last_ms = now_ms;
+	if (bucket->tokens < 1000) return false;
+	bucket->tokens -= 1000;
+	return true;
+}
+
+/**
+ * auth_rate_limit_ok()
+ * Take a token from the bucket for this callsign.  Callsigns cost nothing to change on AX.25,
+ * so a station we have not seen before takes its first token from a bucket shared by all new
+ * stations.  It is then given a slot with a full bucket, less that first token, so the rest of
+ * a normal burst of commands goes through.  Only a slot that is empty, or has been idle long
+ * enough for its bucket to refill, is given away.  Stations that are sending commands keep
+ * their slots, and while every slot is busy a new callsign only gets the shared bucket.
+ *
+ * Returns true if the station can make another HMAC attempt
+ */
+static int auth_rate_limit_ok(char *callsign) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	int64_t now_ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	int ok = false;
+
+	pthread_mutex_lock(&auth_rate_limit_mutex);
+	int64_t full = (int64_t)auth_rate_burst * 1000;
+	/* A slot idle for this long has a full bucket, so forgetting it loses nothing */
+	int64_t idle_ms = auth_rate_per_min > 0 ? (int64_t)auth_rate_burst * 60000 / auth_rate_per_min : INT64_MAX;
+	struct auth_rate_limit *station = NULL;
+	struct auth_rate_limit *oldest = &auth_rate_limits[0];
+	for (int i = 0; i < AUTH_RATE_LIMIT_STATIONS; i++) {
+		if (auth_rate_limits[i].callsign[0] != 0
+				&& strncasecmp(auth_rate_limits[i].callsign, callsign, MAX_CALLSIGN_LEN) == 0) {
+			station = &auth_rate_limits[i];
+			break;
+		}
+		if (auth_rate_limits[i].last_ms < oldest->last_ms)
+			oldest = &auth_rate_limits[i];
+	}
+	if (station == NULL) {
+		if (auth_rate_take_token(&auth_rate_new_stations, now_ms, full)) {
+			if (oldest->callsign[0] == 0 || now_ms - oldest->last_ms >= idle_ms) {
+				station = oldest;
+				strlcpy(station->callsign, callsign, sizeof(station->callsign));
+				station->tokens = full - 1000;
+				station->last_ms = now_ms;
+			}
+			ok = true;
+		}
+	} else {
+		ok = auth_rate_take_token(station, now_ms, full);
+	}
+	pthread_mutex_unlock(&auth_rate_limit_mutex);
+	return ok;
+}
+
+/**
+ * AuthenticateFile()
+ * Authenticate an uplinked file, such as a script for SwCmdPacsatExecuteFile, against a 32 byte
+ * authentication vector.  The file is streamed through the HMAC in fixed size pieces so it
+ * does not need to be read into memory.  The file does not carry a command time, so date_time
+ * is the time of the command that refers to it and only keys valid then are tried.  That
+ * command is checked for replay.
+ *
+ * RETURNs EXIT_SUCCESS if the vector matches otherwise EXIT_FAILURE
+ */
+int AuthenticateFile(uint32_t date_time, char *path, uint8_t *auth_vector) {
+	SPAN_TRACE_SCOPE("hmac verify file");
+	return keyring_verify_file(date_time, path, auth_vector, NULL);
+}
+
 /**
  * CommandTimeOK()
  * Here we attempt to prevent a replay attack.  Firstly we keep track of the time that the last
  * command was received.  Our clock on the space station may be wrong but we assume the time
- * in the receieved packet is correct.  A command can not have a time that is the same or
- * before a previous command.
+ * in the receieved packet is correct.  A command can not have a time that is more than
+ * COMMAND_TIME_TOLLERANCE seconds before a previous command.
+ *
+ * Within that tolerance we keep a sliding window, like the IPsec replay window.  A bitmap records
+ * which seconds before the newest command had a command accepted, and the authentication vectors
+ * of the last few commands are kept.  This lets two commands generated in the same second, or
+ * commands that arrive out of order, all be accepted while a replay of any of them is caught.
  *
  * If a command was not received but was intercepted by another station then they could replay the
  * command.  This is a small risk because we probablly wanted to send the command anyway.  This risk
@@ -284,31 +729,114 @@ int AuthenticateSoftwareCommand(SWCmdUplink *uplink) {
  * we may not be able to send commands if the time on the station is wrong or corrupted.
  *
  * One other nuance.  It is common for the ground station to send a command, which is accepted, but
- * to miss the ACK.  It then sends the command again.  These commands have the same dateTime.  A
- * duplicate command received within a tolerance period based should receive an ACK but should
- * not make further changes.  This means that commands should check if they have just executed and
- * do nothing if called again.  e.g. don't change channels if already on that channel.
+ * to miss the ACK.  It then sends the command again.  These commands have the same authentication
+ * vector.  A duplicate command should receive an ACK but should not make further changes.  This
+ * means that commands should check if they have just executed and do nothing if called again.
+ * e.g. don't change channels if already on that channel.
  *
  * RETURNs EXIT_SUCCESS = 0, EXIT_FAILURE = 1, DUPLICATE = 2
  */
-int CommandTimeOK(uint32_t dateTime) {
+int CommandTimeOK(uint32_t dateTime, uint8_t *auth_vector) {
+	int rc = CommandTimeCheck(dateTime, auth_vector);
+	if (rc == EXIT_SUCCESS)
+		save_accepted_command(dateTime, auth_vector, true);
+	return rc;
+}
 
-	if (last_command_time > MAX_COMMAND_TIME || last_command_time < MIN_COMMAND_TIME) {
-		// Then it is likely corrupt, set to zero for this check and take the time from the command
-		last_command_time = 0;
+/**
+ * CommandTimeCheck()
+ * The checks for CommandTimeOK() without saving the command to disk.  The caller must
+ * call save_accepted_command() for each command accepted.
+ *
+ * RETURNs EXIT_SUCCESS = 0, EXIT_FAILURE = 1, DUPLICATE = 2
+ */
+int CommandTimeCheck(uint32_t dateTime, uint8_t *auth_vector) {
+	uint64_t digest;
+	memcpy(&digest, auth_vector, sizeof(digest));
+
+	if (replay_window.last_command_time > MAX_COMMAND_TIME || replay_window.last_command_time < MIN_COMMAND_TIME) {
+		// Then it is likely corrupt, start a new window and take the time from the command
+		memset(&replay_window, 0, sizeof(replay_window));
 	}
-	if (last_command_time == dateTime) {
+	if (replay_window_has(dateTime, auth_vector)) {
 		// Duplicate command, ignore
-		debug_print("Duplicate Command: %d Last Command %d\n",dateTime, last_command_time);
+		debug_print("Duplicate Command: %d Last Command %d\n",dateTime, replay_window.last_command_time);
 		return EXIT_DUPLICATE; // DUPLICATE
 	}
-    if ((dateTime + COMMAND_TIME_TOLLERANCE) <= last_command_time) {
-    	debug_print("Command: Bad time on command!\n");
-    	debug_print("Command: %d Last Command %d\n",dateTime, last_command_time);
-    	return EXIT_FAILURE;
-    } else {
-    	last_command_time = dateTime;
-    	store_last_command_time();
-    }
-    return EXIT_SUCCESS;
+	if ((dateTime + COMMAND_TIME_TOLLERANCE) <= replay_window.last_command_time) {
+		debug_print("Command: Bad time on command!\n");
+		debug_print("Command: %d Last Command %d\n",dateTime, replay_window.last_command_time);
+		return EXIT_FAILURE;
+	}
+
+	if (dateTime <= replay_window.last_command_time) {
+		uint64_t bit = (uint64_t)1 << (replay_window.last_command_time - dateTime);
+		if ((replay_window.bitmap & bit) && dateTime <= replay_window.forgotten_time) {
+			/* A command was accepted in this second but we no longer have its vector, so
+			 * we can not tell if this is a replay of it. */
+			debug_print("Command: Can not check for replay: %d Last Command %d\n",dateTime, replay_window.last_command_time);
+			return EXIT_FAILURE;
+		}
+	}
+	replay_window_add(dateTime, digest);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * replay_window_has()
+ * True if a command with this time and authentication vector was accepted recently
+ */
+static int replay_window_has(uint32_t dateTime, uint8_t *auth_vector) {
+	uint64_t digest;
+	memcpy(&digest, auth_vector, sizeof(digest));
+	for (int i = 0; i < REPLAY_DIGESTS; i++)
+		if (replay_window.digests[i] == digest && replay_window.digest_times[i] == dateTime)
+			return true;
+	return false;
+}
+
+/**
+ * replay_window_add()
+ * Mark the time of an accepted command in the window and remember its vector, pushing out the
+ * oldest.  If that is still inside the window then commands with its time can no longer be
+ * checked for a replay.
+ */
+static void replay_window_add(uint32_t dateTime, uint64_t digest) {
+	if (dateTime > replay_window.last_command_time) {
+		uint32_t shift = dateTime - replay_window.last_command_time;
+		replay_window.bitmap = (shift >= REPLAY_WINDOW_SIZE) ? 0 : replay_window.bitmap << shift;
+		replay_window.bitmap |= 1;
+		replay_window.last_command_time = dateTime;
+	} else if (replay_window.last_command_time - dateTime < REPLAY_WINDOW_SIZE) {
+		replay_window.bitmap |= (uint64_t)1 << (replay_window.last_command_time - dateTime);
+	}
+
+	uint32_t slot = replay_window.next_digest % REPLAY_DIGESTS;
+	uint32_t old_time = replay_window.digest_times[slot];
+	if (old_time + COMMAND_TIME_TOLLERANCE > replay_window.last_command_time && old_time > replay_window.forgotten_time)
+		replay_window.forgotten_time = old_time;
+	replay_window.digests[slot] = digest;
+	replay_window.digest_times[slot] = dateTime;
+	replay_window.next_digest = (slot + 1) % REPLAY_DIGESTS;
+}
+
+static void replay_journal_record(CMD_JOURNAL_RECORD *record, void *arg) {
+	uint32_t *oldest = (uint32_t *)arg;
+	uint64_t digest;
+	if (*oldest == 0) *oldest = record->dateTime;
+	memcpy(&digest, record->digest, sizeof(digest));
+	replay_window_add(record->dateTime, digest);
+}
+
+/**
+ * save_accepted_command()
+ * Append the command to the journal.  If there is no journal then fall back to writing the whole
+ * replay window to the last command time file, but only when sync is requested.
+ */
+static int save_accepted_command(uint32_t dateTime, uint8_t *auth_vector, int sync) {
+	if (cmd_journal_is_open())
+		return cmd_journal_append(dateTime, auth_vector, sync);
+	if (sync)
+		return store_last_command_time();
+	return EXIT_SUCCESS;
 }
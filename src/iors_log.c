@@ -5,9 +5,25 @@
  *      Author: g0kla
  *
  * This allows the creating of a log file to store events.  The events are in binary to make them
- * as compact as possible.  The file is closed after each write but is stored in a temportary
- * folder.  After a defined period the log is moved to the queue where it will be added to
- * the pacsat directory.
+ * as compact as possible.  The file is stored with a .tmp extension.  After a defined period the
+ * log is moved to the queue where it will be added to the pacsat directory.
+ *
+ * Each log has a writer that keeps the file open and stages events in a buffer.  The buffer is
+ * written with a single write() when it is full, when LOG_FLUSH_PERIOD has passed since the last
+ * write, when an error is logged, or before the log is added to the directory.
+ *
+ * If log_async_start() is called then events are not written by the thread that logs them.
+ * They are copied into a bounded lock free queue and a single logging thread passes them to
+ * the writers.  A full queue drops the event and counts it, so the caller never waits on the
+ * disk.  The queue is the bounded MPMC design by Dmitry Vyukov, used here with one consumer.
+ *
+ * log_set_format(LOG_FORMAT_FRAMED) wraps each event in a sync marker and CRC, see iors_log.h.
+ * This answers the old TODO below: an event that is cut short by a crash is skipped by the
+ * reader and the rest of the log is kept.
+ *
+ * Errors go through log_error_event(), which logs the first of a run of the same error and
+ * counts the rest.  The counters are in a fixed table that is updated with atomics, so any
+ * thread can report an error and the telemetry can read the counts without a lock.
  *
  * This allows only one activity log to be created because the filename is static.
  *
@@ -24,17 +40,106 @@
  *
  */
 
+#define _GNU_SOURCE /* fallocate() */
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include "common_config.h"
 #include "iors_log.h"
+#include "iors_time.h"
+#include "latency_hist.h"
+#include "iors_metrics.h"
+#include "span_trace.h"
+#include "crc.h"
 #include "str_util.h"
 
+/* A log that is being written.  The tmp filename is built once and the file stays open */
+struct log_writer {
+	char filename[MAX_FILE_PATH_LEN];
+	char tmp_filename[MAX_FILE_PATH_LEN];
+	int fd;
+	int format;
+	int level; /* LOG_LEVEL_GLOBAL to follow log_set_level() */
+	uint32_t roll_size; /* Add the log to the directory when it reaches this size.  0 for never */
+	uint32_t roll_age; /* or when its first event is this many seconds old */
+	uint32_t roll_records; /* or when it holds this many events */
+	uint64_t file_size;
+	uint32_t records; /* Events in this segment, including those in the buffer */
+	time_t segment_start; /* When the first event of this segment was logged, 0 if none yet */
+	time_t last_flush;
+	int used;
+	uint8_t buffer[LOG_WRITER_BUFFER_SIZE];
+	pthread_mutex_t mutex;
+};
+
+/* An event waiting in the queue for the logging thread.  seq says who owns the entry */
+struct log_queue_entry {
+	uint32_t seq;
+	uint8_t level;
+	uint8_t len;
+	struct log_writer *writer;
+	uint8_t data[LOG_MAX_EVENT_LEN];
+};
+
+/*
+ * Counts for one error.  A slot is claimed once with a CAS on state and is never freed.
+ * window_start is 0 when the error has not been seen in the current window.
+ */
+struct log_error_slot {
+	int state;
+	uint8_t event;
+	uint8_t error_code;
+	uint8_t call[6];
+	uint8_t ssid;
+	struct log_writer *writer;
+	uint32_t count;
+	uint32_t suppressed;
+	uint32_t first_tstamp;
+	uint32_t last_tstamp;
+	uint32_t window_start;
+};
+#define LOG_ERROR_FREE 0
+#define LOG_ERROR_CLAIMING 1
+#define LOG_ERROR_READY 2
+
+_Static_assert((LOG_ERROR_SLOTS & (LOG_ERROR_SLOTS - 1)) == 0, "LOG_ERROR_SLOTS must be a power of 2");
+_Static_assert(sizeof(struct ALOG_2F) <= LOG_MAX_EVENT_LEN, "The largest event must fit in the log queue");
+_Static_assert(sizeof(struct ALOG_1) == LOG_MIN_EVENT_LEN, "LOG_MIN_EVENT_LEN must be the smallest event");
+_Static_assert((LOG_QUEUE_LEN & (LOG_QUEUE_LEN - 1)) == 0, "LOG_QUEUE_LEN must be a power of 2");
+
 /* Local static variables */
 static int log_level = ERR_LOG;
+static int log_event_override[LOG_MAX_EVENTS]; /* Level set for one event, 0 if it follows the logs */
+static uint32_t log_sample_counts[LOG_MAX_EVENTS];
+static pthread_mutex_t log_levels_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint8_t log_event_levels[LOG_MAX_EVENTS] = { [0 ... LOG_MAX_EVENTS - 1] = ERR_LOG };
+uint16_t log_event_sample[LOG_MAX_EVENTS];
+static int log_format = LOG_FORMAT_PLAIN;
+static struct log_writer log_writers[LOG_MAX_WRITERS];
+static int num_log_writers = 0;
+static pthread_mutex_t log_writers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct log_queue_entry log_queue[LOG_QUEUE_LEN];
+static uint64_t log_queue_ns[LOG_QUEUE_LEN]; /* When each entry was queued, for the latency histogram */
+static uint32_t log_enqueue_pos = 0;
+static uint32_t log_dequeue_pos = 0; /* Only changed by the logging thread */
+static uint32_t log_dropped_events = 0;
+static int log_async_running = false;
+static int log_async_waiting = false; /* The logging thread is about to sleep, so wake it */
+static sem_t log_async_sem;
+static pthread_t log_async_thread;
+
+static struct log_error_slot log_errors[LOG_ERROR_SLOTS];
+static uint32_t log_error_window = LOG_ERROR_WINDOW;
+static uint32_t log_errors_overflow = 0; /* Errors that did not fit in the table, always logged */
+static time_t log_error_last_tick = 0;
 //static char log_folder[MAX_FILE_PATH_LEN];
 //static char tmp_filename[MAX_FILE_PATH_LEN];
 //static char filename[MAX_FILE_PATH_LEN];
@@ -74,13 +179,24 @@ static char *log_name_str[] = {
 //	};
 
 /* Forward declarations */
-//void log_process_prev_file(char * log_folder, char *filename, int roll_logs_at_startup);
 int log_append(char *filename, uint8_t * data, int len);
+static int log_append_writer(struct log_writer *writer, int level, uint8_t * data, int len);
+static struct log_error_slot *log_error_find(enum LOG_EVENT event_code, uint8_t error_code, uint8_t *call, uint8_t ssid);
+static void log_error_summary(struct log_error_slot *slot, uint32_t suppressed, uint32_t now);
+static struct log_writer *log_get_writer(char *filename);
+static int log_writer_append(struct log_writer *writer, int level, uint8_t * data, int len);
+static int log_writer_flush(struct log_writer *writer);
+static int log_enqueue(struct log_writer *writer, int level, uint8_t * data, int len);
+static void log_writer_close(struct log_writer *writer);
+static int log_writer_roll(struct log_writer *writer);
+static int log_writer_roll_due(struct log_writer *writer, time_t now);
+static void log_update_event_levels();
+static int log_event_len_valid(int len);
 
 /**
  * log_init()
  *
- * Process a previous log if it exists.  Then start a new log.
+ * Build the name of a log.  Call log_recover() first to roll any logs left from a previous run.
  *
  * The filepath should be the target filename in the queue folder.  Data will be saved in
  * a .tmp file until it is ready to be added to the directory.
@@ -91,9 +207,6 @@ int log_init(char *prefix, char *folder, char *filename) {
 	strlcat(filename,"/",MAX_FILE_PATH_LEN);
 	strlcat(filename,prefix,MAX_FILE_PATH_LEN); // put the folder as the first part of the name too
 
-//	/* Process any previous logs left over from a crash or other situation */
-//	log_process_prev_file(folder, filename, roll_logs_at_startup);
-
 	//debug_print("Opening log: %s\n",filename);
 
 	return EXIT_SUCCESS;
@@ -110,42 +223,112 @@ void log_make_tmp_filename(char *filename, char *tmp_filename) {
 	strlcat(tmp_filename,".tmp",MAX_FILE_PATH_LEN);
 }
 
-///**
-// * Looks for any previous logs in the folder and add them to the pacsat dir queue.
-// * We do that by removing the .tmp extension.
-// * Note that it is possible that the file was corrupted as we crashed, but that is an
-// * issue for the ground station to solve.
-// *
-// */
-//void log_process_prev_file(char * log_folder, char *filename, int roll_logs_at_startup) {
-//	char tmp_filename[MAX_FILE_PATH_LEN];
-//	log_make_tmp_filename(filename, tmp_filename);
-//	DIR * d = opendir(log_folder);
-//	if (d == NULL) { error_print("** Could not open dir: %s\n",log_folder); return; }
-//	struct dirent *de;
-//	char file_name[MAX_FILE_PATH_LEN];
-//	char to_filename[MAX_FILE_PATH_LEN];
-//	for (de = readdir(d); de != NULL; de = readdir(d)) {
-//		if ((strcmp(de->d_name, ".") != 0) && (strcmp(de->d_name, "..") != 0)) {
-//			if (str_ends_with(de->d_name, FILE_TMP)) {
-//				strlcpy(file_name, log_folder, sizeof(file_name));
-//				strlcat(file_name, "/", sizeof(file_name));
-//				strlcat(file_name, de->d_name, sizeof(file_name));
-//				if (roll_logs_at_startup && strncmp(file_name, tmp_filename, sizeof(file_name)) == 0) {
-//					debug_print("leaving current log %s\n",de->d_name);
-//				} else {
-//					strlcpy(to_filename, file_name, sizeof(to_filename));
-//					to_filename[strlen(to_filename) - 4] = '\0'; // We know this has exactly .tmp at the end, so remove it
-//					debug_print("Processing old log file: %s to %s\n",de->d_name, to_filename);
-//					rename(file_name,to_filename);
-//				}
-//			}
-//		}
-//	}
-//}
-
 void log_set_level(enum LOG_LEVEL level) {
 	log_level = level;
+	log_update_event_levels();
+}
+
+/**
+ * log_set_event_level()
+ * Only log this event at or below this level, whatever the level of the log.  NO_LOG turns
+ * the event off.  LOG_LEVEL_GLOBAL removes the setting.
+ */
+void log_set_event_level(enum LOG_EVENT event_code, int level) {
+	if (event_code < 0 || event_code >= LOG_MAX_EVENTS) return;
+	pthread_mutex_lock(&log_levels_mutex);
+	log_event_override[event_code] = level == LOG_LEVEL_GLOBAL ? 0 : level + 1;
+	pthread_mutex_unlock(&log_levels_mutex);
+	log_update_event_levels();
+}
+
+/**
+ * log_set_event_sample()
+ * Only log one in this many of an event that is logged with the LOG_ALOG macros.  0 or 1 logs
+ * every event.  Use this for frequent informational events.
+ */
+void log_set_event_sample(enum LOG_EVENT event_code, uint16_t one_in) {
+	if (event_code < 0 || event_code >= LOG_MAX_EVENTS) return;
+	__atomic_store_n(&log_event_sample[event_code], one_in, __ATOMIC_RELAXED);
+}
+
+int log_sample_hit(uint8_t event_code) {
+	uint16_t one_in = __atomic_load_n(&log_event_sample[event_code], __ATOMIC_RELAXED);
+	return one_in <= 1 || __atomic_fetch_add(&log_sample_counts[event_code], 1, __ATOMIC_RELAXED) % one_in == 0;
+}
+
+/**
+ * log_update_event_levels()
+ * Work out the highest level that any log accepts and store it for each event, unless the
+ * event has its own level
+ */
+static void log_update_event_levels() {
+	pthread_mutex_lock(&log_levels_mutex);
+	int max_level = log_level;
+	int n = __atomic_load_n(&num_log_writers, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < n; i++) {
+		int level = __atomic_load_n(&log_writers[i].level, __ATOMIC_RELAXED);
+		if (level > max_level) max_level = level;
+	}
+	for (int e = 0; e < LOG_MAX_EVENTS; e++) {
+		int level = log_event_override[e] != 0 ? log_event_override[e] - 1 : max_level;
+		__atomic_store_n(&log_event_levels[e], level, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&log_levels_mutex);
+}
+
+/**
+ * log_open()
+ * Get the handle for a log.  The tmp path is built and the writer is set up the first time,
+ * so events logged through the handle do no string handling.  The handle is valid until the
+ * program exits.
+ *
+ * Returns the handle or NULL if LOG_MAX_WRITERS logs are already open
+ */
+LOG_HANDLE *log_open(char *filename) {
+	return log_get_writer(filename);
+}
+
+/**
+ * log_handle_set_level()
+ * Set the level for one log.  Pass LOG_LEVEL_GLOBAL to follow log_set_level() again.
+ */
+void log_handle_set_level(LOG_HANDLE *handle, int level) {
+	__atomic_store_n(&handle->level, level, __ATOMIC_RELAXED);
+	log_update_event_levels();
+}
+
+/**
+ * log_handle_set_roll_size()
+ * Add the log to the directory once it reaches this many bytes.  0 means it is only added
+ * when log_handle_roll() or log_add_to_directory() is called.
+ */
+void log_handle_set_roll_size(LOG_HANDLE *handle, uint32_t bytes) {
+	__atomic_store_n(&handle->roll_size, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * log_handle_set_roll_age()
+ * Add the log to the directory once its first event is this many seconds old.  0 for never.
+ */
+void log_handle_set_roll_age(LOG_HANDLE *handle, uint32_t seconds) {
+	__atomic_store_n(&handle->roll_age, seconds, __ATOMIC_RELAXED);
+}
+
+/**
+ * log_handle_set_roll_records()
+ * Add the log to the directory once it holds this many events.  0 for never.
+ */
+void log_handle_set_roll_records(LOG_HANDLE *handle, uint32_t records) {
+	__atomic_store_n(&handle->roll_records, records, __ATOMIC_RELAXED);
+}
+
+static inline int log_handle_level(LOG_HANDLE *handle) {
+	int level = __atomic_load_n(&handle->level, __ATOMIC_RELAXED);
+	return level == LOG_LEVEL_GLOBAL ? log_level : level;
+}
+
+static inline int log_event_wanted(LOG_HANDLE *handle, int level, enum LOG_EVENT event_code) {
+	return level <= log_event_levels[(uint8_t)event_code] && level <= log_handle_level(handle);
 }
 
 /**
@@ -155,37 +338,45 @@ void log_set_level(enum LOG_LEVEL level) {
  *
  */
 void log_err(char *filename, uint8_t error_code) {
-	if (log_level < ERR_LOG) return;
-	struct ALOG_1 log_event;
-	log_event.event = ALOG_IORS_ERR;
-	log_event.len = sizeof(log_event);
-	log_event.tstamp = time(0);
-	log_event.rxchan = 0;
-	log_event.serial_no = error_code;
-	log_append(filename, (uint8_t *)&log_event, log_event.len);
+	log_error_event(filename, ALOG_IORS_ERR, error_code, NULL, 0);
+}
+
+void log_handle_err(LOG_HANDLE *handle, uint8_t error_code) {
+	log_handle_error(handle, ALOG_IORS_ERR, error_code, NULL, 0);
 }
 
 /*
  * Store Log event
  */
 void log_alog1(int level, char *filename, enum LOG_EVENT event_code, uint16_t var) {
-	if (level > log_level) return;
+	LOG_HANDLE *handle = log_get_writer(filename);
+	if (handle != NULL) log_handle_alog1(handle, level, event_code, var);
+}
+
+void log_handle_alog1(LOG_HANDLE *handle, int level, enum LOG_EVENT event_code, uint16_t var) {
+	if (!log_event_wanted(handle, level, event_code)) return;
 	struct ALOG_1 log_event;
 	log_event.event = event_code;
 	log_event.len = sizeof(log_event);
-	log_event.tstamp = time(0);
+	log_event.tstamp = iors_time_now();
 	log_event.rxchan = 0;
 	log_event.serial_no = var;
-	log_append(filename, (uint8_t *)&log_event, log_event.len);
+	log_append_writer(handle, level, (uint8_t *)&log_event, log_event.len);
 }
 
 void log_alog1f(int level, char *filename, enum LOG_EVENT event_code,
 		uint32_t var1,uint32_t var2,uint32_t var3,uint32_t var4,uint32_t var5,uint32_t var6) {
-	if (level > log_level) return;
+	LOG_HANDLE *handle = log_get_writer(filename);
+	if (handle != NULL) log_handle_alog1f(handle, level, event_code, var1, var2, var3, var4, var5, var6);
+}
+
+void log_handle_alog1f(LOG_HANDLE *handle, int level, enum LOG_EVENT event_code,
+		uint32_t var1,uint32_t var2,uint32_t var3,uint32_t var4,uint32_t var5,uint32_t var6) {
+	if (!log_event_wanted(handle, level, event_code)) return;
 	struct ALOG_1F log_event;
 	log_event.event = event_code;
 	log_event.len = sizeof(log_event);
-	log_event.tstamp = time(0);
+	log_event.tstamp = iors_time_now();
 	log_event.rxchan = 0;
 	log_event.var1 = var1;
 	log_event.var2 = var2;
@@ -193,29 +384,40 @@ void log_alog1f(int level, char *filename, enum LOG_EVENT event_code,
 	log_event.var4 = var4;
 	log_event.var5 = var5;
 	log_event.var6 = var6;
-	log_append(filename, (uint8_t *)&log_event, log_event.len);
+	log_append_writer(handle, level, (uint8_t *)&log_event, log_event.len);
 }
 
 void log_alog2(int level, char *filename, enum LOG_EVENT event_code, char * callsign, uint8_t ssid, uint16_t var) {
-	if (level > log_level) return;
+	LOG_HANDLE *handle = log_get_writer(filename);
+	if (handle != NULL) log_handle_alog2(handle, level, event_code, callsign, ssid, var);
+}
+
+void log_handle_alog2(LOG_HANDLE *handle, int level, enum LOG_EVENT event_code, char * callsign, uint8_t ssid, uint16_t var) {
+	if (!log_event_wanted(handle, level, event_code)) return;
 	struct ALOG_2 log_event;
 	log_event.event = event_code;
 	log_event.len = sizeof(log_event);
-	log_event.tstamp = time(0);
+	log_event.tstamp = iors_time_now();
 	log_event.serial_no = var;
 	log_event.rxchan = 0;
 	memcpy(log_event.call, callsign, sizeof(log_event.call));
 	log_event.ssid = ssid;
-	log_append(filename, (uint8_t *)&log_event, log_event.len);
+	log_append_writer(handle, level, (uint8_t *)&log_event, log_event.len);
 }
 
 void log_alog2f(int level, char *filename, enum LOG_EVENT event_code, char * callsign, uint8_t ssid,
 		uint32_t var1,uint32_t var2,uint32_t var3,uint32_t var4,uint32_t var5,uint32_t var6) {
-	if (level > log_level) return;
+	LOG_HANDLE *handle = log_get_writer(filename);
+	if (handle != NULL) log_handle_alog2f(handle, level, event_code, callsign, ssid, var1, var2, var3, var4, var5, var6);
+}
+
+void log_handle_alog2f(LOG_HANDLE *handle, int level, enum LOG_EVENT event_code, char * callsign, uint8_t ssid,
+		uint32_t var1,uint32_t var2,uint32_t var3,uint32_t var4,uint32_t var5,uint32_t var6) {
+	if (!log_event_wanted(handle, level, event_code)) return;
 	struct ALOG_2F log_event;
 	log_event.event = event_code;
 	log_event.len = sizeof(log_event);
-	log_event.tstamp = time(0);
+	log_event.tstamp = iors_time_now();
 	log_event.rxchan = 0;
 	log_event.var1 = var1;
 	log_event.var2 = var2;
@@ -225,11 +427,196 @@ void log_alog2f(int level, char *filename, enum LOG_EVENT event_code, char * cal
 	log_event.var6 = var6;
 	memcpy(log_event.call, callsign, sizeof(log_event.call));
 	log_event.ssid = ssid;
-	log_append(filename, (uint8_t *)&log_event, log_event.len);
+	log_append_writer(handle, level, (uint8_t *)&log_event, log_event.len);
 }
+/**
+ * log_error_event()
+ * Report an error.  The first time this event, error code and callsign is seen in a window it
+ * is logged as an ALOG_2 event, or ALOG_1 if there is no callsign.  Repeats in the window are
+ * counted and logged as one summary by log_error_tick().  callsign may be NULL.
+ *
+ * Returns true if the error was logged and false if it was only counted
+ */
+int log_error_event(char *filename, enum LOG_EVENT event_code, uint8_t error_code, char *callsign, uint8_t ssid) {
+	LOG_HANDLE *handle = log_get_writer(filename);
+	if (handle == NULL) return false;
+	return log_handle_error(handle, event_code, error_code, callsign, ssid);
+}
+
+int log_handle_error(LOG_HANDLE *handle, enum LOG_EVENT event_code, uint8_t error_code, char *callsign, uint8_t ssid) {
+	uint32_t now = iors_time_now();
+	if (now - __atomic_load_n(&log_error_last_tick, __ATOMIC_RELAXED) >= 1)
+		log_error_tick(now);
+	if (!log_event_wanted(handle, ERR_LOG, event_code)) return false;
+
+	uint8_t call[6] = {0};
+	if (callsign != NULL)
+		memcpy(call, callsign, strnlen(callsign, sizeof(call)));
+
+	struct log_error_slot *slot = log_error_find(event_code, error_code, call, ssid);
+	if (slot == NULL) {
+		__atomic_fetch_add(&log_errors_overflow, 1, __ATOMIC_RELAXED);
+	} else {
+		if (slot->writer == NULL)
+			__atomic_store_n(&slot->writer, handle, __ATOMIC_RELEASE);
+		__atomic_fetch_add(&slot->count, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->last_tstamp, now, __ATOMIC_RELAXED);
+		uint32_t idle = 0;
+		if (!__atomic_compare_exchange_n(&slot->window_start, &idle, now, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			if (__atomic_fetch_add(&slot->suppressed, 1, __ATOMIC_ACQ_REL) == 0)
+				__atomic_store_n(&slot->first_tstamp, now, __ATOMIC_RELAXED);
+			return false;
+		}
+	}
+
+	if (callsign == NULL) {
+		struct ALOG_1 log_event;
+		log_event.event = event_code;
+		log_event.len = sizeof(log_event);
+		log_event.tstamp = now;
+		log_event.rxchan = 0;
+		log_event.serial_no = error_code;
+		log_append_writer(handle, ERR_LOG, (uint8_t *)&log_event, log_event.len);
+	} else {
+		struct ALOG_2 log_event;
+		log_event.event = event_code;
+		log_event.len = sizeof(log_event);
+		log_event.tstamp = now;
+		log_event.serial_no = error_code;
+		log_event.rxchan = 0;
+		memcpy(log_event.call, call, sizeof(log_event.call));
+		log_event.ssid = ssid;
+		log_append_writer(handle, ERR_LOG, (uint8_t *)&log_event, log_event.len);
+	}
+	return true;
+}
+
+/**
+ * log_error_tick()
+ * Close the windows that are older than the error window.  If there were repeats then a
+ * summary is logged and a new window starts, otherwise the next error is logged straight away.
+ * This is called by log_error_event() and the logging thread, and can be called by a program
+ * that logs synchronously so that summaries are not held back until the next error.
+ */
+void log_error_tick(time_t now) {
+	__atomic_store_n(&log_error_last_tick, now, __ATOMIC_RELAXED);
+	for (int i = 0; i < LOG_ERROR_SLOTS; i++) {
+		struct log_error_slot *slot = &log_errors[i];
+		if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != LOG_ERROR_READY) continue;
+		uint32_t start = __atomic_load_n(&slot->window_start, __ATOMIC_ACQUIRE);
+		uint32_t next = now;
+		if (start == 0 || next - start < __atomic_load_n(&log_error_window, __ATOMIC_RELAXED)) continue;
+		/* Only one caller closes a window */
+		if (!__atomic_compare_exchange_n(&slot->window_start, &start, next, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			continue;
+		uint32_t suppressed = __atomic_exchange_n(&slot->suppressed, 0, __ATOMIC_ACQ_REL);
+		if (suppressed > 0)
+			log_error_summary(slot, suppressed, next);
+		else
+			__atomic_compare_exchange_n(&slot->window_start, &next, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	}
+}
+
+static void log_error_summary(struct log_error_slot *slot, uint32_t suppressed, uint32_t now) {
+	struct log_writer *writer = __atomic_load_n(&slot->writer, __ATOMIC_ACQUIRE);
+	if (writer == NULL || log_handle_level(writer) < ERR_LOG) return;
+	struct ALOG_2F log_event;
+	log_event.event = ALOG_IORS_ERR_SUMMARY;
+	log_event.len = sizeof(log_event);
+	log_event.tstamp = now;
+	log_event.serial_no = slot->error_code;
+	log_event.rxchan = 0;
+	memcpy(log_event.call, slot->call, sizeof(log_event.call));
+	log_event.ssid = slot->ssid;
+	log_event.var1 = slot->event;
+	log_event.var2 = suppressed;
+	log_event.var3 = __atomic_load_n(&slot->first_tstamp, __ATOMIC_RELAXED);
+	log_event.var4 = __atomic_load_n(&slot->last_tstamp, __ATOMIC_RELAXED);
+	log_event.var5 = __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+	log_event.var6 = 0;
+	log_append_writer(writer, ERR_LOG, (uint8_t *)&log_event, log_event.len);
+}
+
+/**
+ * log_error_find()
+ * Find the slot for an error, claiming a free one the first time it is seen.  Slots are probed
+ * in order from the hash of the key.
+ *
+ * Returns the slot or NULL if the table is full
+ */
+static struct log_error_slot *log_error_find(enum LOG_EVENT event_code, uint8_t error_code, uint8_t *call, uint8_t ssid) {
+	uint32_t hash = 2166136261u;
+	uint8_t key[9] = {event_code, error_code, call[0], call[1], call[2], call[3], call[4], call[5], ssid};
+	for (int i = 0; i < (int)sizeof(key); i++)
+		hash = (hash ^ key[i]) * 16777619u;
+
+	for (int i = 0; i < LOG_ERROR_SLOTS; i++) {
+		struct log_error_slot *slot = &log_errors[(hash + i) & (LOG_ERROR_SLOTS - 1)];
+		int state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if (state == LOG_ERROR_FREE) {
+			if (__atomic_compare_exchange_n(&slot->state, &state, LOG_ERROR_CLAIMING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				slot->event = event_code;
+				slot->error_code = error_code;
+				memcpy(slot->call, call, sizeof(slot->call));
+				slot->ssid = ssid;
+				__atomic_store_n(&slot->state, LOG_ERROR_READY, __ATOMIC_RELEASE);
+				return slot;
+			}
+		}
+		/* Another thread is filling in this slot.  It is only a few stores so wait for it */
+		while (state == LOG_ERROR_CLAIMING)
+			state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if (slot->event == event_code && slot->error_code == error_code && slot->ssid == ssid
+				&& memcmp(slot->call, call, sizeof(slot->call)) == 0)
+			return slot;
+	}
+	return NULL;
+}
+
+void log_set_error_window(int seconds) {
+	__atomic_store_n(&log_error_window, seconds, __ATOMIC_RELAXED);
+}
+
+/**
+ * log_get_error_count()
+ * Total number of times an error code has been reported, for any event or callsign
+ */
+uint32_t log_get_error_count(uint8_t error_code) {
+	uint32_t count = 0;
+	for (int i = 0; i < LOG_ERROR_SLOTS; i++)
+		if (__atomic_load_n(&log_errors[i].state, __ATOMIC_ACQUIRE) == LOG_ERROR_READY
+				&& log_errors[i].error_code == error_code)
+			count += __atomic_load_n(&log_errors[i].count, __ATOMIC_RELAXED);
+	return count;
+}
+
+/**
+ * log_get_error_counters()
+ * Copy the counts for each error that has been seen, up to max of them
+ *
+ * Returns the number copied
+ */
+int log_get_error_counters(LOG_ERROR_COUNTER *counters, int max) {
+	int n = 0;
+	for (int i = 0; i < LOG_ERROR_SLOTS && n < max; i++) {
+		struct log_error_slot *slot = &log_errors[i];
+		if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != LOG_ERROR_READY) continue;
+		counters[n].event = slot->event;
+		counters[n].error_code = slot->error_code;
+		memcpy(counters[n].call, slot->call, sizeof(counters[n].call));
+		counters[n].ssid = slot->ssid;
+		counters[n].count = __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+		counters[n].suppressed = __atomic_load_n(&slot->suppressed, __ATOMIC_RELAXED);
+		counters[n].last_tstamp = __atomic_load_n(&slot->last_tstamp, __ATOMIC_RELAXED);
+		n++;
+	}
+	return n;
+}
+
 /**
  * log_append()
- * Append a log event to the binary log file
+ * Append a log event to the binary log file.  The event is staged in the buffer for the log
+ * and written when the buffer is full or LOG_FLUSH_PERIOD has passed.
  * TODO:
  * Note that if we crash while writing to the log then the data could be corrupt. We
  * could fix this by writing to a tmp file but we would have to copy the file first
@@ -240,50 +627,584 @@ void log_alog2f(int level, char *filename, enum LOG_EVENT event_code, char * cal
  * ground station to deal with.
  *
  * One other solutiuon would be to frame each event, e.g. like a kiss frame.  Then if
- * an event is partially written we will not corrupt the rest of the log.
+ * an event is partially written we will not corrupt the rest of the log.  This is available
+ * with log_set_format(LOG_FORMAT_FRAMED).
  *
  */
 int log_append(char *filename, uint8_t * data, int len) {
-	char tmp_filename[MAX_FILE_PATH_LEN];
-	log_make_tmp_filename(filename, tmp_filename);
-	FILE * outfile = fopen(tmp_filename, "ab");
-	if (outfile == NULL) return EXIT_FAILURE;
-
-	/* Save the header bytes */
-	for (int i=0; i<len; i++) {
-		int c = fputc(data[i],outfile);
-		if (c == EOF) {
-			fclose(outfile);
-			return EXIT_FAILURE; // we could not write to the file
+	LOG_HANDLE *handle = log_get_writer(filename);
+	if (handle == NULL) return EXIT_FAILURE;
+	return log_append_writer(handle, INFO_LOG, data, len);
+}
+
+int log_handle_append(LOG_HANDLE *handle, uint8_t * data, int len) {
+	return log_append_writer(handle, INFO_LOG, data, len);
+}
+
+/**
+ * log_append_writer()
+ * Append an event.  The buffer is written straight away if it is an error.
+ */
+static int log_append_writer(struct log_writer *writer, int level, uint8_t * data, int len) {
+	if (len + LOG_FRAME_OVERHEAD > LOG_WRITER_BUFFER_SIZE) return EXIT_FAILURE;
+	if (__atomic_load_n(&log_async_running, __ATOMIC_ACQUIRE) && len <= LOG_MAX_EVENT_LEN)
+		return log_enqueue(writer, level, data, len);
+	return log_writer_append(writer, level, data, len);
+}
+
+/**
+ * log_writer_append()
+ * Copy an event into the buffer for the log and write the buffer if needed
+ */
+static int log_writer_append(struct log_writer *writer, int level, uint8_t * data, int len) {
+	int rc = EXIT_SUCCESS;
+	pthread_mutex_lock(&writer->mutex);
+	int size = writer->format == LOG_FORMAT_FRAMED ? len + LOG_FRAME_OVERHEAD : len;
+	if (writer->used + size > LOG_WRITER_BUFFER_SIZE) {
+		rc = log_writer_flush(writer);
+		if (writer->used + size > LOG_WRITER_BUFFER_SIZE) {
+			/* The file could not be written and the buffer is still full, so drop the event */
+			__atomic_fetch_add(&log_dropped_events, 1, __ATOMIC_RELAXED);
+			IORS_METRICS_INC(log_dropped_events);
+			pthread_mutex_unlock(&writer->mutex);
+			return EXIT_FAILURE;
 		}
 	}
-	fclose(outfile);
+	if (writer->format == LOG_FORMAT_FRAMED)
+		log_frame_event(data, len, writer->buffer + writer->used);
+	else
+		memcpy(writer->buffer + writer->used, data, len);
+	writer->used += size;
+	writer->records++;
+	IORS_METRICS_INC(log_events);
+	time_t now = iors_time_now();
+	if (writer->segment_start == 0) writer->segment_start = now;
+	if (level <= ERR_LOG || now - writer->last_flush >= LOG_FLUSH_PERIOD || log_writer_roll_due(writer, now))
+		rc = log_writer_flush(writer);
+	pthread_mutex_unlock(&writer->mutex);
+	return rc;
+}
+
+/**
+ * log_enqueue()
+ * Claim the next free entry in the queue and copy the event into it.  This does not block.  If
+ * the logging thread has fallen a whole queue behind then the event is dropped and counted.
+ */
+static int log_enqueue(struct log_writer *writer, int level, uint8_t * data, int len) {
+	struct log_queue_entry *entry;
+	uint32_t pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+	while (true) {
+		entry = &log_queue[pos & (LOG_QUEUE_LEN - 1)];
+		uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+		int32_t dif = (int32_t)(seq - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&log_enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			__atomic_fetch_add(&log_dropped_events, 1, __ATOMIC_RELAXED);
+			IORS_METRICS_INC(log_dropped_events);
+			return EXIT_FAILURE;
+		} else {
+			pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+	entry->writer = writer;
+	entry->level = level;
+	entry->len = len;
+	memcpy(entry->data, data, len);
+	log_queue_ns[pos & (LOG_QUEUE_LEN - 1)] = latency_stamp();
+	__atomic_store_n(&entry->seq, pos + 1, __ATOMIC_RELEASE);
+
+	if (__atomic_load_n(&log_async_waiting, __ATOMIC_SEQ_CST))
+		sem_post(&log_async_sem);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * log_dequeue_all()
+ * Pass every event that is ready to its writer.  Only called by the logging thread.
+ *
+ * Returns the number of events processed
+ */
+static int log_dequeue_all() {
+	uint64_t start_ns = span_trace_begin();
+	int count = 0;
+	while (true) {
+		struct log_queue_entry *entry = &log_queue[log_dequeue_pos & (LOG_QUEUE_LEN - 1)];
+		uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+		if (seq != log_dequeue_pos + 1) break;
+		latency_record_since(LATENCY_LOG_QUEUE, log_queue_ns[log_dequeue_pos & (LOG_QUEUE_LEN - 1)]);
+		log_writer_append(entry->writer, entry->level, entry->data, entry->len);
+		__atomic_store_n(&entry->seq, log_dequeue_pos + LOG_QUEUE_LEN, __ATOMIC_RELEASE);
+		__atomic_store_n(&log_dequeue_pos, log_dequeue_pos + 1, __ATOMIC_RELEASE);
+		count++;
+	}
+	if (count > 0)
+		span_trace_end("log dequeue", start_ns);
+	return count;
+}
+
+/**
+ * log_async_loop()
+ * The logging thread.  It sleeps when the queue is empty and wakes when an event is queued or
+ * after LOG_ASYNC_WAIT_MS to write any buffers that are older than LOG_FLUSH_PERIOD.  When
+ * stopped it empties the queue before it exits.
+ */
+static void *log_async_loop(void *arg) {
+	span_trace_name_thread("log");
+	while (true) {
+		int count = log_dequeue_all();
+		if (!__atomic_load_n(&log_async_running, __ATOMIC_ACQUIRE)) {
+			if (log_dequeue_all() == 0) break;
+			continue;
+		}
+		if (count > 0) continue;
+
+		iors_time_expire();
+		time_t now = iors_time_now();
+		log_error_tick(now);
+		latency_tick(now);
+		iors_metrics_tick(now);
+		int n = __atomic_load_n(&num_log_writers, __ATOMIC_ACQUIRE);
+		for (int i = 0; i < n; i++) {
+			pthread_mutex_lock(&log_writers[i].mutex);
+			if ((log_writers[i].used > 0 && now - log_writers[i].last_flush >= LOG_FLUSH_PERIOD)
+					|| log_writer_roll_due(&log_writers[i], now))
+				log_writer_flush(&log_writers[i]);
+			pthread_mutex_unlock(&log_writers[i].mutex);
+		}
+
+		__atomic_store_n(&log_async_waiting, true, __ATOMIC_SEQ_CST);
+		struct log_queue_entry *entry = &log_queue[log_dequeue_pos & (LOG_QUEUE_LEN - 1)];
+		if (__atomic_load_n(&entry->seq, __ATOMIC_SEQ_CST) != log_dequeue_pos + 1
+				&& __atomic_load_n(&log_async_running, __ATOMIC_SEQ_CST)) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += LOG_ASYNC_WAIT_MS * 1000000L;
+			ts.tv_sec += ts.tv_nsec / 1000000000L;
+			ts.tv_nsec %= 1000000000L;
+			sem_timedwait(&log_async_sem, &ts);
+		}
+		__atomic_store_n(&log_async_waiting, false, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+/**
+ * log_async_start()
+ * Start the logging thread.  From now on events are queued and written by that thread.
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE if the thread could not be started
+ */
+int log_async_start() {
+	if (__atomic_load_n(&log_async_running, __ATOMIC_ACQUIRE)) return EXIT_SUCCESS;
+	for (uint32_t i = 0; i < LOG_QUEUE_LEN; i++)
+		log_queue[i].seq = log_enqueue_pos + i;
+	log_dequeue_pos = log_enqueue_pos;
+	sem_init(&log_async_sem, 0, 0);
+	__atomic_store_n(&log_async_running, true, __ATOMIC_RELEASE);
+	if (pthread_create(&log_async_thread, NULL, log_async_loop, NULL) != 0) {
+		__atomic_store_n(&log_async_running, false, __ATOMIC_RELEASE);
+		sem_destroy(&log_async_sem);
+		error_print("Could not start the logging thread\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * log_async_stop()
+ * Stop the logging thread once every queued event has been written, then write all of the
+ * buffers.  Events logged after this are written by the caller again.
+ */
+void log_async_stop() {
+	if (!__atomic_load_n(&log_async_running, __ATOMIC_ACQUIRE)) return;
+	__atomic_store_n(&log_async_running, false, __ATOMIC_SEQ_CST);
+	sem_post(&log_async_sem);
+	pthread_join(log_async_thread, NULL);
+	sem_destroy(&log_async_sem);
+	log_flush_all();
+}
+
+/**
+ * log_async_drain()
+ * Wait until the logging thread has taken every event that was queued before this call
+ */
+void log_async_drain() {
+	if (!__atomic_load_n(&log_async_running, __ATOMIC_ACQUIRE)) return;
+	uint32_t target = __atomic_load_n(&log_enqueue_pos, __ATOMIC_ACQUIRE);
+	while ((int32_t)(__atomic_load_n(&log_dequeue_pos, __ATOMIC_ACQUIRE) - target) < 0
+			&& __atomic_load_n(&log_async_running, __ATOMIC_ACQUIRE)) {
+		sem_post(&log_async_sem);
+		usleep(1000);
+	}
+}
+
+/**
+ * log_get_dropped_events()
+ * The number of events lost because the queue was full, or because the buffer for a log was
+ * full and could not be written to the file
+ */
+uint32_t log_get_dropped_events() {
+	return __atomic_load_n(&log_dropped_events, __ATOMIC_RELAXED);
+}
+
+/**
+ * log_flush()
+ * Write any buffered events for this log to the file
+ */
+int log_flush(char *filename) {
+	struct log_writer *writer = log_get_writer(filename);
+	if (writer == NULL) return EXIT_FAILURE;
+	return log_handle_flush(writer);
+}
+
+int log_handle_flush(LOG_HANDLE *writer) {
+	log_async_drain();
+	pthread_mutex_lock(&writer->mutex);
+	int rc = log_writer_flush(writer);
+	pthread_mutex_unlock(&writer->mutex);
+	return rc;
+}
+
+/**
+ * log_flush_all()
+ * Write the buffered events for every log, e.g. before shutdown
+ */
+void log_flush_all() {
+	log_async_drain();
+	pthread_mutex_lock(&log_writers_mutex);
+	int n = num_log_writers;
+	pthread_mutex_unlock(&log_writers_mutex);
+	for (int i = 0; i < n; i++) {
+		pthread_mutex_lock(&log_writers[i].mutex);
+		log_writer_flush(&log_writers[i]);
+		pthread_mutex_unlock(&log_writers[i].mutex);
+	}
+}
+
+/**
+ * log_close_all()
+ * Write the buffered events and close all of the log files
+ */
+void log_close_all() {
+	log_async_drain();
+	pthread_mutex_lock(&log_writers_mutex);
+	int n = num_log_writers;
+	pthread_mutex_unlock(&log_writers_mutex);
+	for (int i = 0; i < n; i++) {
+		pthread_mutex_lock(&log_writers[i].mutex);
+		log_writer_flush(&log_writers[i]);
+		log_writer_close(&log_writers[i]);
+		pthread_mutex_unlock(&log_writers[i].mutex);
+	}
+}
+
+/**
+ * log_get_writer()
+ * Find the writer for this log, or create it the first time the log is used.  The table only
+ * grows, so a writer that has been found can be used without holding the table mutex.
+ */
+static struct log_writer *log_get_writer(char *filename) {
+	int n = __atomic_load_n(&num_log_writers, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < n; i++)
+		if (strcmp(log_writers[i].filename, filename) == 0)
+			return &log_writers[i];
+
+	struct log_writer *writer = NULL;
+	pthread_mutex_lock(&log_writers_mutex);
+	for (int i = 0; i < num_log_writers; i++)
+		if (strcmp(log_writers[i].filename, filename) == 0)
+			writer = &log_writers[i];
+	if (writer == NULL && num_log_writers < LOG_MAX_WRITERS) {
+		writer = &log_writers[num_log_writers];
+		memset(writer, 0, sizeof(struct log_writer));
+		strlcpy(writer->filename, filename, sizeof(writer->filename));
+		log_make_tmp_filename(filename, writer->tmp_filename);
+		writer->fd = -1;
+		writer->format = log_format;
+		writer->level = LOG_LEVEL_GLOBAL;
+		writer->last_flush = iors_time_now();
+		pthread_mutex_init(&writer->mutex, NULL);
+		__atomic_store_n(&num_log_writers, num_log_writers + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&log_writers_mutex);
+	if (writer == NULL)
+		error_print("Too many logs open, can not log to %s\n", filename);
+	return writer;
+}
 
+/**
+ * log_writer_flush()
+ * Write the buffer to the file with one write.  The file is opened if needed.  The caller
+ * holds the writer mutex.
+ */
+static int log_writer_flush(struct log_writer *writer) {
+	writer->last_flush = iors_time_now();
+	if (writer->used == 0) {
+		/* A log that has gone quiet still rolls when its segment is old enough */
+		if (log_writer_roll_due(writer, writer->last_flush))
+			return log_writer_roll(writer);
+		return EXIT_SUCCESS;
+	}
+	SPAN_TRACE_SCOPE("log flush");
+	if (writer->fd == -1) {
+		writer->fd = open(writer->tmp_filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (writer->fd == -1) {
+			IORS_METRICS_INC(log_write_errors);
+			return EXIT_FAILURE;
+		}
+		off_t size = lseek(writer->fd, 0, SEEK_END);
+		writer->file_size = size == -1 ? 0 : size;
+		if (writer->file_size == 0) {
+			/* A new segment.  Reserve its space now so appends do not fragment the flash.  The
+			 * file size does not change, so readers and O_APPEND see only what was written */
+			uint32_t roll_size = __atomic_load_n(&writer->roll_size, __ATOMIC_RELAXED);
+			fallocate(writer->fd, FALLOC_FL_KEEP_SIZE, 0, roll_size != 0 ? roll_size : LOG_PREALLOCATE_SIZE);
+		}
+	}
+	uint64_t start_ns = latency_stamp();
+	int done = 0;
+	while (done < writer->used) {
+		ssize_t n = write(writer->fd, writer->buffer + done, writer->used - done);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			IORS_METRICS_INC(log_write_errors);
+			IORS_METRICS_ADD(log_bytes, done);
+			/* Keep what was not written.  It is tried again on the next flush */
+			memmove(writer->buffer, writer->buffer + done, writer->used - done);
+			writer->used -= done;
+			writer->file_size += done;
+			return EXIT_FAILURE;
+		}
+		done += n;
+	}
+	latency_record_since(LATENCY_LOG_WRITE, start_ns);
+	IORS_METRICS_ADD(log_bytes, done);
+	writer->used = 0;
+	writer->file_size += done;
+	if (log_writer_roll_due(writer, writer->last_flush))
+		return log_writer_roll(writer);
 	return EXIT_SUCCESS;
 }
 
+/**
+ * log_writer_roll_due()
+ * True if the segment has reached its size, age or record limit.  The caller holds the writer
+ * mutex.
+ */
+static int log_writer_roll_due(struct log_writer *writer, time_t now) {
+	if (writer->segment_start == 0) return false;
+	uint32_t roll_size = __atomic_load_n(&writer->roll_size, __ATOMIC_RELAXED);
+	uint32_t roll_age = __atomic_load_n(&writer->roll_age, __ATOMIC_RELAXED);
+	uint32_t roll_records = __atomic_load_n(&writer->roll_records, __ATOMIC_RELAXED);
+	if (roll_size != 0 && writer->file_size + writer->used >= roll_size) return true;
+	if (roll_age != 0 && now - writer->segment_start >= roll_age) return true;
+	if (roll_records != 0 && writer->records >= roll_records) return true;
+	return false;
+}
+
+static void log_writer_close(struct log_writer *writer) {
+	if (writer->fd != -1)
+		close(writer->fd);
+	writer->fd = -1;
+}
+
+/**
+ * log_set_format()
+ * Set the format for logs that are opened after this call.  Logs that are already open keep
+ * their format so that one file never mixes the two.
+ */
+void log_set_format(enum LOG_FORMAT format) {
+	log_format = format;
+}
+
+/**
+ * log_frame_event()
+ * Wrap an event in a frame.  frame must have room for len + LOG_FRAME_OVERHEAD bytes.
+ *
+ * Returns the length of the frame
+ */
+int log_frame_event(uint8_t *data, int len, uint8_t *frame) {
+	frame[0] = LOG_FRAME_SYNC0;
+	frame[1] = LOG_FRAME_SYNC1;
+	memcpy(frame + 2, data, len);
+	uint16_t crc = gen_crc(data, len);
+	frame[2 + len] = crc >> 8;
+	frame[3 + len] = crc & 0xff;
+	return len + LOG_FRAME_OVERHEAD;
+}
+
+/**
+ * log_is_framed()
+ * True if a log that has been read into memory is in the framed format
+ */
+int log_is_framed(uint8_t *data, uint32_t len) {
+	return len >= 2 && data[0] == LOG_FRAME_SYNC0 && data[1] == LOG_FRAME_SYNC1;
+}
+
+/**
+ * log_next_event()
+ * Find the next valid event at or after *pos.  In a framed log the event length and CRC are
+ * checked at each sync marker and if either is bad we move on one byte and search again, so a
+ * damaged region is skipped in one pass.  A plain log can only be followed by the len bytes,
+ * so it ends at the first event that is not valid.  An event is only valid if its length is
+ * that of one of the ALOG structures.
+ *
+ * Returns a pointer to the event, with its length in event[1], and moves *pos past it.  At the
+ * end *pos is set to len and NULL is returned.
+ */
+uint8_t *log_next_event(uint8_t *data, uint32_t len, uint32_t *pos, int framed) {
+	uint32_t p = *pos;
+	if (framed) {
+		while (p + LOG_FRAME_OVERHEAD + LOG_MIN_EVENT_LEN <= len) {
+			uint8_t *sync = memchr(data + p, LOG_FRAME_SYNC0, len - p - 1);
+			if (sync == NULL) break;
+			p = sync - data;
+			uint8_t *event = data + p + 2;
+			int event_len = event[1];
+			if (data[p + 1] != LOG_FRAME_SYNC1 || !log_event_len_valid(event_len)
+					|| p + event_len + LOG_FRAME_OVERHEAD > len) {
+				p++;
+				continue;
+			}
+			uint16_t crc = (event[event_len] << 8) | event[event_len + 1];
+			if (gen_crc(event, event_len) != crc) {
+				p++;
+				continue;
+			}
+			*pos = p + event_len + LOG_FRAME_OVERHEAD;
+			return event;
+		}
+	} else if (p + LOG_MIN_EVENT_LEN <= len) {
+		int event_len = data[p + 1];
+		if (data[p] != 0 && log_event_len_valid(event_len) && p + event_len <= len) {
+			*pos = p + event_len;
+			return data + p;
+		}
+	}
+	*pos = len;
+	return NULL;
+}
+
+static int log_event_len_valid(int len) {
+	return len == sizeof(struct ALOG_1) || len == sizeof(struct ALOG_1F)
+			|| len == sizeof(struct ALOG_2) || len == sizeof(struct ALOG_2F);
+}
+
+/**
+ * log_scan_events()
+ * Call the callback for each valid event in a plain or framed log that has been read into
+ * memory.  See log_next_event().
+ *
+ * If skipped is not NULL it is set to the number of bytes that were not part of a valid event.
+ *
+ * Returns the number of events found
+ */
+int log_scan_events(uint8_t *data, uint32_t len, void (*callback)(uint8_t *event, int len, void *arg),
+		void *arg, uint32_t *skipped) {
+	int framed = log_is_framed(data, len);
+	int count = 0;
+	uint32_t good = 0;
+	uint32_t pos = 0;
+	uint8_t *event;
+	while ((event = log_next_event(data, len, &pos, framed)) != NULL) {
+		if (callback != NULL) callback(event, event[1], arg);
+		count++;
+		good += event[1] + (framed ? LOG_FRAME_OVERHEAD : 0);
+	}
+	if (skipped != NULL) *skipped = len - good;
+	return count;
+}
+
 /**
  * log_add_to_directory()
  * Add the log file to the pacsat directory by removing the tmp extension and giving it a timestamp.
+ * Logs can also be rolled automatically, see log_handle_set_roll_size() and the functions after it.
+ * Any buffered events are written and the file is closed first.  The next event starts a new file.
  */
 int log_add_to_directory(char * filename) {
-	char log_name[25];
-	time_t now = time(0);
-	strftime(log_name, sizeof(log_name), "%y%m%d%H%M", gmtime(&now)); // If enabled, roll of log if reboot on different min.  Use mins as that is the resolution of the scheduler
+	struct log_writer *writer = log_get_writer(filename);
+	if (writer == NULL) return EXIT_FAILURE;
+	return log_handle_roll(writer);
+}
 
-	char tmp_filename[MAX_FILE_PATH_LEN];
+int log_handle_roll(LOG_HANDLE *writer) {
+	log_async_drain();
+	pthread_mutex_lock(&writer->mutex);
+	int rc = log_writer_flush(writer);
+	/* The flush may already have rolled the log if it reached its roll size */
+	if (rc == EXIT_SUCCESS && access(writer->tmp_filename, F_OK) == 0)
+		rc = log_writer_roll(writer);
+	pthread_mutex_unlock(&writer->mutex);
+	return rc;
+}
+
+/**
+ * log_writer_roll()
+ * Close the log and move it into the directory queue under a name that has not been used.
+ * The space that was preallocated past the end is released first.  This is a few system calls
+ * and no copying, so it can run on the logging thread.  The caller holds the writer mutex and
+ * has written the buffer.
+ */
+static int log_writer_roll(struct log_writer *writer) {
+	SPAN_TRACE_SCOPE("log roll");
+	if (writer->fd != -1) {
+		ftruncate(writer->fd, writer->file_size);
+		log_writer_close(writer);
+	}
+	time_t now = iors_time_now();
 	char dir_filename[MAX_FILE_PATH_LEN];
-	log_make_tmp_filename(filename, tmp_filename);
-	strlcpy(dir_filename, filename,MAX_FILE_PATH_LEN);
-	strlcat(dir_filename,log_name,MAX_FILE_PATH_LEN);
-	debug_print("Adding %s log to dir as: %s\n",filename, dir_filename);
-	int rc = rename(tmp_filename,dir_filename);
-	if (rc == -1) {
+	if (log_move_to_dir(AT_FDCWD, writer->tmp_filename, writer->filename, now, dir_filename) != EXIT_SUCCESS)
 		return EXIT_FAILURE;
-	}
+	debug_print("Added %s log to dir as: %s\n",writer->filename, dir_filename);
+	writer->file_size = 0;
+	writer->records = 0;
+	writer->segment_start = 0;
 	return EXIT_SUCCESS;
 }
 
+/**
+ * log_move_to_dir()
+ * Move a finished log into the directory queue.  The new name is the log name and the time to
+ * the second.  If a log has already rolled in this second then a sequence number is added, e.g.
+ * log241018093055_2.  The move is done with RENAME_NOREPLACE, or with link() and unlink() where
+ * the file system does not support that, so an existing log is never replaced and the final name
+ * only appears once the whole file is there.  tmp_name is relative to dir_fd, which can be
+ * AT_FDCWD.  dir_filename must hold MAX_FILE_PATH_LEN bytes.
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE if the log could not be moved
+ */
+int log_move_to_dir(int dir_fd, char *tmp_name, char *filename, time_t now, char *dir_filename) {
+	const char *log_name = iors_time_stamp_str(now);
+	int use_link = false;
+	for (int seq = 1; seq <= LOG_MAX_ROLL_SEQ; seq++) {
+		strlcpy(dir_filename, filename, MAX_FILE_PATH_LEN);
+		strlcat(dir_filename, log_name, MAX_FILE_PATH_LEN);
+		if (seq > 1) {
+			char seq_str[8];
+			snprintf(seq_str, sizeof(seq_str), "_%d", seq);
+			strlcat(dir_filename, seq_str, MAX_FILE_PATH_LEN);
+		}
+		if (!use_link) {
+			if (renameat2(dir_fd, tmp_name, AT_FDCWD, dir_filename, RENAME_NOREPLACE) == 0)
+				return EXIT_SUCCESS;
+			if (errno == EINVAL || errno == ENOSYS)
+				use_link = true;
+		}
+		if (use_link) {
+			if (linkat(dir_fd, tmp_name, AT_FDCWD, dir_filename, 0) == 0) {
+				unlinkat(dir_fd, tmp_name, 0);
+				return EXIT_SUCCESS;
+			}
+		}
+		if (errno != EEXIST) break;
+	}
+	if (errno != ENOENT)
+		error_print("Could not add %s to the dir\n", filename);
+	return EXIT_FAILURE;
+}
+
 /**
  * Note, this can not read compressed logs
  */
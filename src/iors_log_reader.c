@@ -0,0 +1,188 @@
+/*
+ * iors_log_reader.c
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Memory mapped reader for activity logs, see iors_log_reader.h
+ *
+ * The events are found with log_next_event(), which always lands on the same events for the
+ * same file.  So the offset of the first event in each block, recorded when the file is opened,
+ * is exactly where a walk of the whole file would arrive, and a query can start from any block.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common_config.h"
+#include "iors_log.h"
+#include "iors_log_reader.h"
+
+/* Forward declarations */
+static uint32_t log_reader_tstamp(uint8_t *event);
+static int log_reader_block_wanted(LOG_READER_ITERATOR *iterator, uint32_t block);
+
+/**
+ * log_reader_open()
+ * Map the log, find every valid event and build the index and the event counts
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE if the file could not be mapped
+ */
+int log_reader_open(LOG_READER *reader, char *path) {
+	memset(reader, 0, sizeof(LOG_READER));
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return EXIT_FAILURE;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size > UINT32_MAX) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	reader->len = st.st_size;
+	if (reader->len == 0) {
+		close(fd);
+		return EXIT_SUCCESS;
+	}
+	void *map = mmap(NULL, reader->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping keeps the file open
+	if (map == MAP_FAILED) {
+		error_print("Could not map log %s\n", path);
+		return EXIT_FAILURE;
+	}
+	reader->data = (uint8_t *)map;
+	madvise(reader->data, reader->len, MADV_SEQUENTIAL);
+
+	reader->num_blocks = (reader->len + LOG_READER_BLOCK_SIZE - 1) / LOG_READER_BLOCK_SIZE;
+	reader->blocks = malloc(reader->num_blocks * sizeof(LOG_READER_BLOCK));
+	if (reader->blocks == NULL) {
+		log_reader_close(reader);
+		return EXIT_FAILURE;
+	}
+	for (uint32_t i = 0; i < reader->num_blocks; i++) {
+		reader->blocks[i].first = LOG_READER_NO_EVENT;
+		reader->blocks[i].min_tstamp = UINT32_MAX;
+		reader->blocks[i].max_tstamp = 0;
+	}
+
+	reader->framed = log_is_framed(reader->data, reader->len);
+	reader->min_tstamp = UINT32_MAX;
+	uint32_t good = 0;
+	uint32_t pos = 0;
+	uint8_t *event;
+	while ((event = log_next_event(reader->data, reader->len, &pos, reader->framed)) != NULL) {
+		uint32_t offset = event - reader->data;
+		if (reader->framed) offset -= 2; // the block holds the start of the frame
+		LOG_READER_BLOCK *block = &reader->blocks[offset / LOG_READER_BLOCK_SIZE];
+		uint32_t tstamp = log_reader_tstamp(event);
+		if (block->first == LOG_READER_NO_EVENT) block->first = offset;
+		if (tstamp < block->min_tstamp) block->min_tstamp = tstamp;
+		if (tstamp > block->max_tstamp) block->max_tstamp = tstamp;
+		if (tstamp < reader->min_tstamp) reader->min_tstamp = tstamp;
+		if (tstamp > reader->max_tstamp) reader->max_tstamp = tstamp;
+		reader->event_counts[event[0]]++;
+		reader->num_events++;
+		good += event[1] + (reader->framed ? LOG_FRAME_OVERHEAD : 0);
+	}
+	reader->skipped = reader->len - good;
+	if (reader->num_events == 0) reader->min_tstamp = 0;
+	return EXIT_SUCCESS;
+}
+
+void log_reader_close(LOG_READER *reader) {
+	if (reader->data != NULL)
+		munmap(reader->data, reader->len);
+	free(reader->blocks);
+	memset(reader, 0, sizeof(LOG_READER));
+}
+
+uint32_t log_reader_event_count(LOG_READER *reader, uint8_t event) {
+	return reader->event_counts[event];
+}
+
+/**
+ * log_reader_iterator_init()
+ * Start a query for the events with timestamps from start to end inclusive.  Call
+ * log_reader_iterator_add_event() to only return some events.
+ */
+void log_reader_iterator_init(LOG_READER_ITERATOR *iterator, LOG_READER *reader, uint32_t start, uint32_t end) {
+	memset(iterator, 0, sizeof(LOG_READER_ITERATOR));
+	iterator->reader = reader;
+	iterator->start = start;
+	iterator->end = end;
+}
+
+void log_reader_iterator_add_event(LOG_READER_ITERATOR *iterator, uint8_t event) {
+	iterator->events[event / 32] |= 1u << (event % 32);
+	iterator->filtered = true;
+}
+
+/**
+ * log_reader_next()
+ * Return the next event that matches the query, or NULL when there are no more.  The event
+ * is in the mapped file, with its length in event[1].
+ */
+uint8_t *log_reader_next(LOG_READER_ITERATOR *iterator) {
+	LOG_READER *reader = iterator->reader;
+	while (iterator->pos < reader->len) {
+		uint32_t next = iterator->pos;
+		uint8_t *event = log_next_event(reader->data, reader->len, &next, reader->framed);
+		if (event == NULL) {
+			iterator->pos = reader->len;
+			break;
+		}
+		uint32_t block = (event - reader->data - (reader->framed ? 2 : 0)) / LOG_READER_BLOCK_SIZE;
+		if (!log_reader_block_wanted(iterator, block)) {
+			/* Nothing in this block can match, so jump to the first event of the next block that can */
+			while (++block < reader->num_blocks && !log_reader_block_wanted(iterator, block))
+				;
+			iterator->pos = block < reader->num_blocks ? reader->blocks[block].first : reader->len;
+			continue;
+		}
+		iterator->pos = next;
+
+		uint32_t tstamp = log_reader_tstamp(event);
+		if (tstamp < iterator->start || tstamp > iterator->end) continue;
+		if (iterator->filtered && !(iterator->events[event[0] / 32] & (1u << (event[0] % 32)))) continue;
+		return event;
+	}
+	return NULL;
+}
+
+/**
+ * log_reader_histogram()
+ * Count an event, or all events if event is -1, in num_bins bins of bin_seconds each from the
+ * start time.  Events outside the bins are not counted.
+ *
+ * Returns the number of events counted
+ */
+int log_reader_histogram(LOG_READER *reader, int event, uint32_t start, uint32_t bin_seconds,
+		uint32_t *bins, int num_bins) {
+	memset(bins, 0, num_bins * sizeof(uint32_t));
+	if (bin_seconds == 0 || num_bins <= 0) return 0;
+	uint64_t end = (uint64_t)start + (uint64_t)bin_seconds * num_bins - 1;
+	LOG_READER_ITERATOR iterator;
+	log_reader_iterator_init(&iterator, reader, start, end > UINT32_MAX ? UINT32_MAX : end);
+	if (event != -1)
+		log_reader_iterator_add_event(&iterator, event);
+	int count = 0;
+	uint8_t *e;
+	while ((e = log_reader_next(&iterator)) != NULL) {
+		bins[(log_reader_tstamp(e) - start) / bin_seconds]++;
+		count++;
+	}
+	return count;
+}
+
+static uint32_t log_reader_tstamp(uint8_t *event) {
+	uint32_t tstamp;
+	memcpy(&tstamp, event + 2, sizeof(tstamp));
+	return tstamp;
+}
+
+static int log_reader_block_wanted(LOG_READER_ITERATOR *iterator, uint32_t block) {
+	LOG_READER_BLOCK *b = &iterator->reader->blocks[block];
+	return b->first != LOG_READER_NO_EVENT && b->max_tstamp >= iterator->start && b->min_tstamp <= iterator->end;
+}
@@ -0,0 +1,192 @@
+/*
+ * iors_log_recover.c
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Recovery of .tmp logs that were left behind when the program stopped without rolling them,
+ * e.g. after a crash or power loss.  This replaces log_process_prev_file(), which was never
+ * enabled.
+ *
+ * Each folder is read with getdents64 through one directory fd and each file is opened with
+ * openat on that fd, so paths are not looked up again for every file.  Each orphaned log is
+ * checked with log_next_event() and cut back to the end of its last whole event, which
+ * removes an event that was only partly written and the space preallocated past the end.
+ * The log is then rolled into the directory queue.  An empty log is deleted.  A file with no
+ * valid events may not be a log at all, so it is left alone.
+ *
+ * Folders are handled in parallel, one thread each.  A thread stops starting new files once
+ * the time budget is spent.  Anything left is picked up at the next startup.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "common_config.h"
+#include "iors_log.h"
+#include "iors_time.h"
+#include "str_util.h"
+
+#define LOG_RECOVER_DENTS_SIZE 4096
+
+/* As returned by the getdents64 system call */
+struct log_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct log_recover_job {
+	char *folder;
+	struct timespec deadline;
+	pthread_t thread;
+	int started;
+	int recovered;
+};
+
+/* Forward declarations */
+static void *log_recover_folder(void *arg);
+static int log_recover_file(int dir_fd, char *folder, char *name);
+static int log_recover_expired(struct timespec *deadline);
+
+/**
+ * log_recover()
+ * Roll any .tmp logs in these folders into the directory queue.  Call this at startup before
+ * the logs in these folders are opened, so that no log being written is treated as orphaned.
+ * budget_ms limits how long is spent.  0 means no limit.
+ *
+ * Returns the number of logs that were rolled
+ */
+int log_recover(char **folders, int num_folders, int budget_ms) {
+	struct log_recover_job jobs[LOG_RECOVER_MAX_FOLDERS];
+	if (num_folders > LOG_RECOVER_MAX_FOLDERS) num_folders = LOG_RECOVER_MAX_FOLDERS;
+
+	struct timespec deadline = {0, 0};
+	if (budget_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += budget_ms / 1000;
+		deadline.tv_nsec += (budget_ms % 1000) * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+	}
+
+	for (int i = 0; i < num_folders; i++) {
+		jobs[i].folder = folders[i];
+		jobs[i].deadline = deadline;
+		jobs[i].recovered = 0;
+		jobs[i].started = pthread_create(&jobs[i].thread, NULL, log_recover_folder, &jobs[i]) == 0;
+		if (!jobs[i].started)
+			log_recover_folder(&jobs[i]);
+	}
+	int recovered = 0;
+	for (int i = 0; i < num_folders; i++) {
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+		recovered += jobs[i].recovered;
+	}
+	return recovered;
+}
+
+static void *log_recover_folder(void *arg) {
+	struct log_recover_job *job = (struct log_recover_job *)arg;
+	int dir_fd = open(job->folder, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1) {
+		error_print("** Could not open dir: %s\n", job->folder);
+		return NULL;
+	}
+	char buffer[LOG_RECOVER_DENTS_SIZE] __attribute__ ((aligned(8)));
+	while (!log_recover_expired(&job->deadline)) {
+		long n = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer));
+		if (n <= 0) break;
+		for (long p = 0; p < n; ) {
+			struct log_dirent64 *de = (struct log_dirent64 *)(buffer + p);
+			p += de->d_reclen;
+			if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN) continue;
+			if (!str_ends_with(de->d_name, FILE_TMP)) continue;
+			if (log_recover_expired(&job->deadline)) {
+				debug_print("Log recovery time budget used, leaving the rest of %s\n", job->folder);
+				break;
+			}
+			if (log_recover_file(dir_fd, job->folder, de->d_name) == EXIT_SUCCESS)
+				job->recovered++;
+		}
+	}
+	close(dir_fd);
+	return NULL;
+}
+
+/**
+ * log_recover_file()
+ * Cut an orphaned log back to its last whole event and roll it
+ *
+ * Returns EXIT_SUCCESS if the log was rolled
+ */
+static int log_recover_file(int dir_fd, char *folder, char *name) {
+	int fd = openat(dir_fd, name, O_RDWR | O_CLOEXEC);
+	if (fd == -1) return EXIT_FAILURE;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size > UINT32_MAX) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	uint32_t len = st.st_size;
+	uint32_t end = 0;
+	if (len > 0) {
+		uint8_t *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			return EXIT_FAILURE;
+		}
+		int framed = log_is_framed(data, len);
+		uint32_t pos = 0;
+		uint32_t next = 0;
+		while (log_next_event(data, len, &next, framed) != NULL)
+			pos = next;
+		end = pos;
+		munmap(data, len);
+	}
+	if (len == 0) {
+		debug_print("Removing empty log %s/%s\n", folder, name);
+		close(fd);
+		unlinkat(dir_fd, name, 0);
+		return EXIT_FAILURE;
+	}
+	if (end == 0) {
+		error_print("** %s/%s has no valid events, leaving it\n", folder, name);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	/* Always truncate, as this also frees any space that was preallocated past the end */
+	ftruncate(fd, end);
+	fsync(fd);
+	close(fd);
+
+	char filename[MAX_FILE_PATH_LEN];
+	char dir_filename[MAX_FILE_PATH_LEN];
+	strlcpy(filename, folder, sizeof(filename));
+	strlcat(filename, "/", sizeof(filename));
+	strlcat(filename, name, sizeof(filename));
+	filename[strlen(filename) - strlen(FILE_TMP)] = '\0';
+	if (log_move_to_dir(dir_fd, name, filename, iors_time_now(), dir_filename) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	debug_print("Recovered log %s/%s, %d of %d bytes, as %s\n", folder, name, end, len, dir_filename);
+	return EXIT_SUCCESS;
+}
+
+static int log_recover_expired(struct timespec *deadline) {
+	if (deadline->tv_sec == 0) return false;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
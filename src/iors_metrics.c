@@ -0,0 +1,180 @@
+/*
+ * iors_metrics.c
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Shared memory metrics block, see iors_metrics.h
+ *
+ * iors_metrics always points at a valid block, so the counters can be updated without
+ * checking if the shared memory is open.  When it is opened the private counts are copied in
+ * and the pointer is switched.  An add made by another thread during the copy may be lost.
+ * The shared memory stays mapped until the program exits, because a thread may still hold the
+ * old pointer.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common_config.h"
+#include "iors_metrics.h"
+
+static IORS_METRICS iors_metrics_local = {
+	.magic = IORS_METRICS_MAGIC
+	,.version = IORS_METRICS_VERSION
+	,.size = sizeof(IORS_METRICS)
+};
+IORS_METRICS *iors_metrics = &iors_metrics_local;
+static IORS_METRICS *iors_metrics_shm = NULL;
+static time_t iors_metrics_last_tick = 0;
+
+/**
+ * iors_metrics_open()
+ * Create the shared memory block, or take over the block left by a previous run, and move the
+ * counters into it.  name is a POSIX shared memory name such as IORS_METRICS_SHM_NAME.
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE if the block could not be created
+ */
+int iors_metrics_open(char *name) {
+	if (iors_metrics_shm != NULL) return EXIT_SUCCESS;
+	int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd == -1) {
+		error_print("Could not open shared memory %s\n", name);
+		return EXIT_FAILURE;
+	}
+	if (ftruncate(fd, sizeof(IORS_METRICS)) == -1) {
+		error_print("Could not size shared memory %s\n", name);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	void *map = mmap(NULL, sizeof(IORS_METRICS), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		error_print("Could not map shared memory %s\n", name);
+		return EXIT_FAILURE;
+	}
+	IORS_METRICS *shm = (IORS_METRICS *)map;
+	/* Clear the magic first so a reader does not trust the block while it is copied */
+	__atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);
+	memcpy(shm, &iors_metrics_local, sizeof(IORS_METRICS));
+	shm->pid = getpid();
+	shm->start_time = time(NULL);
+	shm->latency_seq = 0;
+	shm->magic = 0;
+	__atomic_store_n(&shm->magic, IORS_METRICS_MAGIC, __ATOMIC_RELEASE);
+
+	iors_metrics_shm = shm;
+	__atomic_store_n(&iors_metrics, shm, __ATOMIC_RELEASE);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * iors_metrics_close()
+ * Move the counters back to private memory and remove the shared memory name.  A reader that
+ * has the block mapped keeps the last values.
+ */
+void iors_metrics_close(char *name) {
+	if (iors_metrics_shm == NULL) return;
+	memcpy(&iors_metrics_local, iors_metrics_shm, sizeof(IORS_METRICS));
+	__atomic_store_n(&iors_metrics, &iors_metrics_local, __ATOMIC_RELEASE);
+	__atomic_store_n(&iors_metrics_shm->pid, 0, __ATOMIC_RELAXED);
+	shm_unlink(name);
+	iors_metrics_shm = NULL;
+}
+
+void iors_metrics_rx_frame(char kind, int len) {
+	uint8_t k = kind & (IORS_METRICS_KINDS - 1);
+	IORS_METRICS_INC(rx_frames[k]);
+	if (len > 0) IORS_METRICS_ADD(rx_bytes[k], len);
+}
+
+void iors_metrics_tx_frame(char kind, int len) {
+	uint8_t k = kind & (IORS_METRICS_KINDS - 1);
+	IORS_METRICS_INC(tx_frames[k]);
+	if (len > 0) IORS_METRICS_ADD(tx_bytes[k], len);
+}
+
+void iors_metrics_set_tnc_queue_depth(uint32_t depth) {
+	__atomic_store_n(&iors_metrics->tnc_queue_depth, depth, __ATOMIC_RELAXED);
+	uint32_t max = __atomic_load_n(&iors_metrics->tnc_queue_depth_max, __ATOMIC_RELAXED);
+	while (depth > max && !__atomic_compare_exchange_n(&iors_metrics->tnc_queue_depth_max, &max, depth,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/**
+ * iors_metrics_tick()
+ * Copy the latency percentiles into the block every IORS_METRICS_PERIOD seconds.  Call this
+ * regularly, e.g. once per pass of the event loop.  The logging thread also calls it when it is
+ * running.
+ */
+void iors_metrics_tick(time_t now) {
+	time_t last = __atomic_load_n(&iors_metrics_last_tick, __ATOMIC_RELAXED);
+	if (now - last < IORS_METRICS_PERIOD) return;
+	if (!__atomic_compare_exchange_n(&iors_metrics_last_tick, &last, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+	LATENCY_SUMMARY latency[LATENCY_NUM_STAGES];
+	for (int s = 0; s < LATENCY_NUM_STAGES; s++)
+		latency_get_summary(s, &latency[s]);
+
+	IORS_METRICS *metrics = __atomic_load_n(&iors_metrics, __ATOMIC_ACQUIRE);
+	uint32_t seq = __atomic_load_n(&metrics->latency_seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&metrics->latency_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(metrics->latency, latency, sizeof(latency));
+	metrics->update_time = now;
+	__atomic_store_n(&metrics->latency_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * iors_metrics_attach()
+ * Map the block written by another process, read only
+ *
+ * Returns the block, or NULL if there is none or it is a different version
+ */
+const IORS_METRICS *iors_metrics_attach(char *name) {
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(IORS_METRICS)) {
+		close(fd);
+		return NULL;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+	const IORS_METRICS *metrics = (const IORS_METRICS *)map;
+	if (__atomic_load_n(&metrics->magic, __ATOMIC_ACQUIRE) != IORS_METRICS_MAGIC
+			|| metrics->version != IORS_METRICS_VERSION || metrics->size != st.st_size) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	return metrics;
+}
+
+void iors_metrics_detach(const IORS_METRICS *metrics) {
+	if (metrics == NULL) return;
+	munmap((void *)metrics, metrics->size);
+}
+
+/**
+ * iors_metrics_read_latency()
+ * Copy the latency percentiles, retrying if they are being updated
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE if a consistent copy could not be made
+ */
+int iors_metrics_read_latency(const IORS_METRICS *metrics, LATENCY_SUMMARY *latency) {
+	for (int i = 0; i < 100; i++) {
+		uint32_t seq = __atomic_load_n(&metrics->latency_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) continue;
+		memcpy(latency, (const void *)metrics->latency, sizeof(metrics->latency));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&metrics->latency_seq, __ATOMIC_RELAXED) == seq)
+			return EXIT_SUCCESS;
+	}
+	return EXIT_FAILURE;
+}
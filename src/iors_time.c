@@ -0,0 +1,146 @@
+/*
+ * iors_time.c
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Cached coarse clock, see iors_time.h
+ *
+ * iors_time_now() is a single load.  The age of the cached time is only checked by
+ * iors_time_expire(), which the logging thread calls each time it wakes, so the clock is not
+ * read per event to find out if the cache is stale.
+ *
+ * The date string used to name rolled logs only changes its date part once a minute, so each
+ * thread keeps the formatted minute and only writes the seconds for each call.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "common_config.h"
+#include "iors_time.h"
+
+static time_t cached_time = 0; /* Zero until the first tick.  Until then every call reads the clock */
+static time_t cached_mono = 0; /* CLOCK_MONOTONIC_COARSE seconds when cached_time was read */
+static int ticking = false; /* Set by the first tick */
+static int time_mode = IORS_TIME_REALTIME;
+static int64_t monotonic_offset = 0; /* Added to the monotonic clock in IORS_TIME_MONOTONIC mode */
+static int64_t next_monotonic_offset = 0; /* Set by iors_time_set() and used from the next tick */
+
+/* Forward declarations */
+static time_t iors_time_read();
+
+/**
+ * iors_time_set_mode()
+ * Choose the clock.  Monotonic mode starts with the offset that gives the current real time.
+ */
+void iors_time_set_mode(enum IORS_TIME_MODE mode) {
+	if (mode == IORS_TIME_MONOTONIC) {
+		struct timespec real, mono;
+		clock_gettime(CLOCK_REALTIME_COARSE, &real);
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &mono);
+		__atomic_store_n(&next_monotonic_offset, (int64_t)real.tv_sec - mono.tv_sec, __ATOMIC_RELAXED);
+		__atomic_store_n(&monotonic_offset, (int64_t)real.tv_sec - mono.tv_sec, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&time_mode, mode, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&ticking, __ATOMIC_RELAXED))
+		iors_time_tick();
+}
+
+/**
+ * iors_time_tick()
+ * Read the clock once for this pass of the event loop
+ */
+void iors_time_tick() {
+	struct timespec mono;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &mono);
+	__atomic_store_n(&monotonic_offset, __atomic_load_n(&next_monotonic_offset, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_store_n(&cached_time, iors_time_read(), __ATOMIC_RELEASE);
+	__atomic_store_n(&cached_mono, mono.tv_sec, __ATOMIC_RELEASE);
+	__atomic_store_n(&ticking, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * iors_time_expire()
+ * Read the clock again if there has been no tick for IORS_TIME_MAX_AGE seconds, so a stalled
+ * event loop does not freeze the time.  This does nothing before the first tick.
+ */
+void iors_time_expire() {
+	if (!__atomic_load_n(&ticking, __ATOMIC_ACQUIRE)) return;
+	struct timespec mono;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &mono);
+	if (mono.tv_sec - __atomic_load_n(&cached_mono, __ATOMIC_ACQUIRE) < IORS_TIME_MAX_AGE) return;
+	__atomic_store_n(&cached_time, iors_time_read(), __ATOMIC_RELEASE);
+	__atomic_store_n(&cached_mono, mono.tv_sec, __ATOMIC_RELEASE);
+}
+
+/**
+ * iors_time_now()
+ * The time cached by the last tick or expiry, or the clock if there has been no tick yet
+ */
+time_t iors_time_now() {
+	time_t now = __atomic_load_n(&cached_time, __ATOMIC_RELAXED);
+	if (now == 0)
+		return iors_time_read();
+	return now;
+}
+
+/**
+ * iors_time_epoch32()
+ * The time in seconds since CLOCK_2024_01_01.  This fits 32 bits until the year 2160.
+ */
+uint32_t iors_time_epoch32() {
+	return (uint32_t)(iors_time_now() - CLOCK_2024_01_01);
+}
+
+time_t iors_time_from_epoch32(uint32_t epoch32) {
+	return (time_t)epoch32 + CLOCK_2024_01_01;
+}
+
+/**
+ * iors_time_set()
+ * Correct the time, e.g. when the ground sends SWCmdOpsTime.  In monotonic mode only the offset
+ * changes and the system clock is left alone.  The new time is used from the next tick.  In
+ * realtime mode the caller sets the system clock as before and this has no effect.
+ */
+void iors_time_set(time_t now) {
+	struct timespec mono;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &mono);
+	__atomic_store_n(&next_monotonic_offset, (int64_t)now - mono.tv_sec, __ATOMIC_RELAXED);
+	if (!__atomic_load_n(&ticking, __ATOMIC_RELAXED))
+		__atomic_store_n(&monotonic_offset, (int64_t)now - mono.tv_sec, __ATOMIC_RELAXED);
+}
+
+/**
+ * iors_time_stamp_str()
+ * Format a time as yymmddHHMMSS in UTC.  gmtime and strftime only run when the minute changes.
+ *
+ * Returns a string that belongs to the calling thread and is valid until its next call
+ */
+const char *iors_time_stamp_str(time_t now) {
+	static __thread char stamp[IORS_TIME_STAMP_LEN];
+	static __thread time_t stamp_minute = -1;
+	time_t minute = now - now % 60;
+	if (minute != stamp_minute) {
+		struct tm tm;
+		gmtime_r(&now, &tm);
+		strftime(stamp, sizeof(stamp), "%y%m%d%H%M", &tm);
+		stamp_minute = minute;
+	}
+	int seconds = now % 60;
+	stamp[10] = '0' + seconds / 10;
+	stamp[11] = '0' + seconds % 10;
+	stamp[12] = '\0';
+	return stamp;
+}
+
+static time_t iors_time_read() {
+	struct timespec ts;
+	if (__atomic_load_n(&time_mode, __ATOMIC_ACQUIRE) == IORS_TIME_MONOTONIC) {
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+		return ts.tv_sec + __atomic_load_n(&monotonic_offset, __ATOMIC_RELAXED);
+	}
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return ts.tv_sec;
+}
@@ -7,9 +7,42 @@
 
 #include "stdlib.h"
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "common_config.h"
 #include "keyfile.h"
 
+/*
+ * The keyring is published like RCU.  Readers load the current pointer and use that snapshot
+ * without a lock.  A change copies the current keyring into the next snapshot, edits it and
+ * then publishes it with one atomic store.  A snapshot is not reused until KEYRING_SNAPSHOTS - 1
+ * later changes have been made.  Keys change by ground command, seconds apart at the least,
+ * while a reader holds a snapshot for one HMAC, so it has almost always finished by then.
+ *
+ * In case it has not, each snapshot has a generation like a seqlock.  It is cleared while the
+ * snapshot is rewritten and set to a new number when it is published.  keyring_verify() reads
+ * the generation before and after it uses a snapshot and starts again if it changed.
+ */
+#define KEYRING_SNAPSHOTS 4
+
+static KEYRING keyrings[KEYRING_SNAPSHOTS];
+static KEYRING *current_keyring = NULL;
+static int next_snapshot = 1;
+static uint32_t keyring_generation = 1; /* Generation of the newest snapshot.  Changed under keyring_mutex */
+static pthread_mutex_t keyring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t keyring_once = PTHREAD_ONCE_INIT;
+
+/* Forward declarations */
+static void keyring_init();
+static KEYRING *keyring_begin_update();
+static void keyring_publish(KEYRING *keyring);
+static void keyring_abort_update();
+static int keyring_find(KEYRING *keyring, uint32_t key_id);
+static void keyring_delete(KEYRING *keyring, int i);
+static int keyring_key_valid(const KEYRING_KEY *k, uint32_t date_time);
+static int keyring_install(KEYRING *keyring, uint32_t key_id, uint8_t *key, uint32_t valid_from, uint32_t valid_until);
+
 
 /* The default key, overwritten from keyfile if it exists, at startup. */
 uint8_t hmac_sha_key[AUTH_KEY_SIZE] = {
@@ -62,7 +95,17 @@ int key_load(char * key_path) {
     	return EXIT_FAILURE; // nothing was read
     }
 
+    fclose(f);
+
     memcpy(hmac_sha_key, key, AUTH_KEY_SIZE);
+    KEYRING *keyring = keyring_begin_update();
+    int i = keyring_install(keyring, KEY_ID_DEFAULT, key, 0, 0);
+    if (i < 0) {
+    	keyring_abort_update();
+    	return EXIT_FAILURE;
+    }
+    keyring->active = i;
+    keyring_publish(keyring);
     return EXIT_SUCCESS;
 }
 
@@ -80,3 +123,265 @@ int test_key_save(char * key_path) {
 	fclose(outfile);
 	return EXIT_SUCCESS;
 }
+
+/**
+ * keyring_get()
+ * Return the current keyring.  It starts with the default key, or the key from key_load().
+ * The keyring returned must not be changed and should only be held while it is used.  A
+ * caller that reads keys from it should check that its generation has not changed, as
+ * keyring_verify() does.
+ */
+const KEYRING *keyring_get() {
+	pthread_once(&keyring_once, keyring_init);
+	return __atomic_load_n(&current_keyring, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * keyring_add()
+ * Add a key to the keyring, or replace the key with the same id.  It is not made active.
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE if the keyring is full
+ */
+int keyring_add(uint32_t key_id, uint8_t *key, uint32_t valid_from, uint32_t valid_until) {
+	KEYRING *keyring = keyring_begin_update();
+	if (keyring_install(keyring, key_id, key, valid_from, valid_until) < 0) {
+		keyring_abort_update();
+		return EXIT_FAILURE;
+	}
+	keyring_publish(keyring);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * keyring_remove()
+ * Remove a key.  The active key can not be removed.
+ */
+int keyring_remove(uint32_t key_id) {
+	KEYRING *keyring = keyring_begin_update();
+	int i = keyring_find(keyring, key_id);
+	if (i < 0 || i == keyring->active) {
+		keyring_abort_update();
+		return EXIT_FAILURE;
+	}
+	keyring_delete(keyring, i);
+	keyring_publish(keyring);
+	return EXIT_SUCCESS;
+}
+
+int keyring_set_active(uint32_t key_id) {
+	KEYRING *keyring = keyring_begin_update();
+	int i = keyring_find(keyring, key_id);
+	if (i < 0) {
+		keyring_abort_update();
+		return EXIT_FAILURE;
+	}
+	keyring->active = i;
+	keyring_publish(keyring);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * keyring_rotate()
+ * Make a new key active in one step.  The key that was active stays in the keyring and is
+ * accepted for commands timed up to overlap seconds after now, so that commands already sent
+ * with it are not dropped.  now is the command time, e.g. of the command that changed the key.
+ *
+ * Keys that expired before now are removed.  If the keyring is still full then the oldest key
+ * other than the one that was active is removed, so rotation never stops working.
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE if the key could not be installed
+ */
+int keyring_rotate(uint32_t key_id, uint8_t *key, uint32_t now, uint32_t overlap) {
+	KEYRING *keyring = keyring_begin_update();
+	KEYRING_KEY *old_key = &keyring->keys[keyring->active];
+	if (old_key->key_id != key_id)
+		old_key->valid_until = now + overlap;
+	for (int j = keyring->num_keys - 1; j >= 0; j--)
+		if (j != keyring->active && keyring->keys[j].valid_until != 0 && keyring->keys[j].valid_until < now)
+			keyring_delete(keyring, j);
+	if (keyring_find(keyring, key_id) < 0 && keyring->num_keys >= KEYRING_MAX_KEYS) {
+		/* Keys are kept in the order they were added */
+		int oldest = keyring->active == 0 ? 1 : 0;
+		debug_print("Keyring is full, removing key %d\n", keyring->keys[oldest].key_id);
+		keyring_delete(keyring, oldest);
+	}
+	int i = keyring_install(keyring, key_id, key, 0, 0);
+	if (i < 0) {
+		keyring_abort_update();
+		return EXIT_FAILURE;
+	}
+	keyring->active = i;
+	keyring_publish(keyring);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * keyring_verify()
+ * Check an authentication vector against the keys that are valid at date_time.  The active key
+ * is tried first.  A date_time of zero matches no key, so a caller without a command time must
+ * pass the current time.  If key_id is not NULL it is set to the id of the key that matched.
+ *
+ * Returns EXIT_SUCCESS if a key matched otherwise EXIT_FAILURE
+ */
+int keyring_verify(uint32_t date_time, uint8_t *data, int len, uint8_t *auth_vector, uint32_t *key_id) {
+	uint8_t localSecureHash[32];
+	HmacSha256Context ctx;
+	const KEYRING *keyring;
+	uint32_t generation;
+	int rc;
+	uint32_t matched_id = 0;
+
+	do {
+		keyring = keyring_get();
+		generation = __atomic_load_n(&keyring->generation, __ATOMIC_ACQUIRE);
+		rc = EXIT_FAILURE;
+		for (int n = 0; generation != 0 && n < keyring->num_keys && n < KEYRING_MAX_KEYS; n++) {
+			int i = (n == 0) ? keyring->active : (n <= keyring->active ? n - 1 : n);
+			if (i < 0 || i >= KEYRING_MAX_KEYS) break;
+			const KEYRING_KEY *k = &keyring->keys[i];
+			if (!keyring_key_valid(k, date_time))
+				continue;
+			ctx = k->ctx;
+			hmac_sha256_update(&ctx, data, len);
+			hmac_sha256_final(&ctx, localSecureHash, sizeof(localSecureHash));
+			if (memcmp(localSecureHash, auth_vector, sizeof(localSecureHash)) == 0) {
+				matched_id = k->key_id;
+				rc = EXIT_SUCCESS;
+				break;
+			}
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (generation == 0 || __atomic_load_n(&keyring->generation, __ATOMIC_RELAXED) != generation);
+	if (rc == EXIT_SUCCESS && key_id != NULL) *key_id = matched_id;
+	return rc;
+}
+
+/**
+ * keyring_verify_file()
+ * Check the authentication vector of a file against the keys that are valid at date_time, the
+ * time of the command that refers to the file.  The active key is tried first.  The file is
+ * read once, in HMAC_FILE_BUFFER_SIZE pieces, and each piece is added to the HMAC for every key.
+ * The keys are copied before the file is read, because the read can take longer than a
+ * keyring snapshot may be held.  As for keyring_verify(), a date_time of zero matches no key.
+ *
+ * Returns EXIT_SUCCESS if a key matched otherwise EXIT_FAILURE
+ */
+int keyring_verify_file(uint32_t date_time, char *path, uint8_t *auth_vector, uint32_t *key_id) {
+	HmacSha256Context ctx[KEYRING_MAX_KEYS];
+	uint32_t ids[KEYRING_MAX_KEYS];
+	uint8_t localSecureHash[32];
+	uint8_t buf[HMAC_FILE_BUFFER_SIZE];
+	ssize_t n;
+
+	const KEYRING *keyring;
+	uint32_t generation;
+	int num_keys;
+	do {
+		keyring = keyring_get();
+		generation = __atomic_load_n(&keyring->generation, __ATOMIC_ACQUIRE);
+		num_keys = 0;
+		for (int k = 0; generation != 0 && k < keyring->num_keys && k < KEYRING_MAX_KEYS; k++) {
+			int i = (k == 0) ? keyring->active : (k <= keyring->active ? k - 1 : k);
+			if (i < 0 || i >= KEYRING_MAX_KEYS) break;
+			if (!keyring_key_valid(&keyring->keys[i], date_time))
+				continue;
+			ids[num_keys] = keyring->keys[i].key_id;
+			ctx[num_keys++] = keyring->keys[i].ctx;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (generation == 0 || __atomic_load_n(&keyring->generation, __ATOMIC_RELAXED) != generation);
+	if (num_keys == 0) return EXIT_FAILURE;
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return EXIT_FAILURE;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (int i = 0; i < num_keys; i++)
+			hmac_sha256_update(&ctx[i], buf, n);
+	}
+	close(fd);
+	if (n < 0) return EXIT_FAILURE;
+
+	for (int i = 0; i < num_keys; i++) {
+		hmac_sha256_final(&ctx[i], localSecureHash, sizeof(localSecureHash));
+		if (memcmp(localSecureHash, auth_vector, sizeof(localSecureHash)) == 0) {
+			if (key_id != NULL) *key_id = ids[i];
+			return EXIT_SUCCESS;
+		}
+	}
+	return EXIT_FAILURE;
+}
+
+static void keyring_init() {
+	KEYRING *keyring = &keyrings[0];
+	memset(keyring, 0, sizeof(KEYRING));
+	keyring_install(keyring, KEY_ID_DEFAULT, hmac_sha_key, 0, 0);
+	keyring->generation = keyring_generation;
+	__atomic_store_n(&current_keyring, keyring, __ATOMIC_RELEASE);
+}
+
+static KEYRING *keyring_begin_update() {
+	pthread_once(&keyring_once, keyring_init);
+	pthread_mutex_lock(&keyring_mutex);
+	KEYRING *keyring = &keyrings[next_snapshot];
+	/* A reader that still holds this snapshot sees the generation change and starts again */
+	__atomic_store_n(&keyring->generation, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(keyring, current_keyring, sizeof(KEYRING));
+	__atomic_store_n(&keyring->generation, 0, __ATOMIC_RELAXED);
+	return keyring;
+}
+
+static void keyring_publish(KEYRING *keyring) {
+	keyring_generation++;
+	if (keyring_generation == 0) keyring_generation = 1;
+	__atomic_store_n(&keyring->generation, keyring_generation, __ATOMIC_RELEASE);
+	__atomic_store_n(&current_keyring, keyring, __ATOMIC_RELEASE);
+	next_snapshot = (next_snapshot + 1) % KEYRING_SNAPSHOTS;
+	pthread_mutex_unlock(&keyring_mutex);
+}
+
+static void keyring_abort_update() {
+	pthread_mutex_unlock(&keyring_mutex);
+}
+
+static int keyring_find(KEYRING *keyring, uint32_t key_id) {
+	for (int i = 0; i < keyring->num_keys; i++)
+		if (keyring->keys[i].key_id == key_id)
+			return i;
+	return -1;
+}
+
+static void keyring_delete(KEYRING *keyring, int i) {
+	for (int j = i; j < keyring->num_keys - 1; j++)
+		keyring->keys[j] = keyring->keys[j + 1];
+	keyring->num_keys--;
+	if (keyring->active > i)
+		keyring->active--;
+}
+
+/* True if the key can be used at date_time.  Zero is not a time, so no key is valid then */
+static int keyring_key_valid(const KEYRING_KEY *k, uint32_t date_time) {
+	if (date_time == 0) return false;
+	if (k->valid_from != 0 && date_time < k->valid_from) return false;
+	if (k->valid_until != 0 && date_time > k->valid_until) return false;
+	return true;
+}
+
+/* Add or replace a key and precompute its HMAC context.  Returns its index or -1 if full */
+static int keyring_install(KEYRING *keyring, uint32_t key_id, uint8_t *key, uint32_t valid_from, uint32_t valid_until) {
+	int i = keyring_find(keyring, key_id);
+	if (i < 0) {
+		if (keyring->num_keys >= KEYRING_MAX_KEYS) {
+			error_print("Keyring is full, can not add key %d\n", key_id);
+			return -1;
+		}
+		i = keyring->num_keys++;
+	}
+	KEYRING_KEY *k = &keyring->keys[i];
+	k->key_id = key_id;
+	k->valid_from = valid_from;
+	k->valid_until = valid_until;
+	memcpy(k->key, key, AUTH_KEY_SIZE);
+	hmac_sha256_init(&k->ctx, k->key, AUTH_KEY_SIZE);
+	return i;
+}
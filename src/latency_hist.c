@@ -0,0 +1,213 @@
+/*
+ * latency_hist.c
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Latency histograms, see latency_hist.h
+ *
+ * A time below LATENCY_SUB_BUCKETS us has a bucket of its own.  A longer time with its top bit
+ * at bit e goes in the block for e, at the position given by the LATENCY_SUB_BITS bits below
+ * the top bit.  This is the layout of an HDR histogram with about one significant digit.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common_config.h"
+#include "latency_hist.h"
+
+struct latency_hist {
+	uint32_t buckets[LATENCY_BUCKETS];
+	uint32_t count;
+	uint32_t max;
+	uint64_t total;
+};
+
+static struct latency_hist latency_hists[LATENCY_NUM_STAGES];
+static int latency_on = false;
+static int latency_dump_period = 0;
+static FILE *latency_dump_out = NULL;
+static time_t latency_last_dump = 0;
+
+static char *latency_stage_names[] = {
+	"RX read"
+	,"RX queue"
+	,"TX send"
+	,"TX confirm"
+	,"Log queue"
+	,"Log write"
+};
+
+_Static_assert(sizeof(latency_stage_names) / sizeof(latency_stage_names[0]) == LATENCY_NUM_STAGES,
+		"A name is needed for each latency stage");
+
+/* Forward declarations */
+static int latency_bucket(uint32_t us);
+static uint32_t latency_bucket_value(int bucket);
+
+void latency_enable(int on) {
+	__atomic_store_n(&latency_on, on, __ATOMIC_RELAXED);
+}
+
+int latency_enabled() {
+	return __atomic_load_n(&latency_on, __ATOMIC_RELAXED);
+}
+
+/**
+ * latency_stamp()
+ * The time at the start of a stage in ns, or 0 if timing is off
+ */
+uint64_t latency_stamp() {
+	if (!latency_enabled()) return 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void latency_record(enum LATENCY_STAGE stage, uint32_t us) {
+	if (stage < 0 || stage >= LATENCY_NUM_STAGES) return;
+	struct latency_hist *hist = &latency_hists[stage];
+	__atomic_fetch_add(&hist->buckets[latency_bucket(us)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->total, us, __ATOMIC_RELAXED);
+	uint32_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&hist->max, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * latency_record_since()
+ * Record the time since a stamp from latency_stamp().  Nothing is recorded if the stamp is 0
+ * because timing was off when the stage started.
+ */
+void latency_record_since(enum LATENCY_STAGE stage, uint64_t start_ns) {
+	if (start_ns == 0) return;
+	uint64_t now = latency_stamp();
+	if (now < start_ns) return;
+	uint64_t us = (now - start_ns) / 1000;
+	latency_record(stage, us > UINT32_MAX ? UINT32_MAX : us);
+}
+
+/**
+ * latency_reset()
+ * Clear every histogram.  A time recorded at the same moment may be partly cleared.
+ */
+void latency_reset() {
+	for (int s = 0; s < LATENCY_NUM_STAGES; s++) {
+		struct latency_hist *hist = &latency_hists[s];
+		__atomic_store_n(&hist->count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&hist->max, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&hist->total, 0, __ATOMIC_RELAXED);
+		for (int i = 0; i < LATENCY_BUCKETS; i++)
+			__atomic_store_n(&hist->buckets[i], 0, __ATOMIC_RELAXED);
+	}
+}
+
+uint32_t latency_count(enum LATENCY_STAGE stage) {
+	if (stage < 0 || stage >= LATENCY_NUM_STAGES) return 0;
+	return __atomic_load_n(&latency_hists[stage].count, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * latency_percentile()
+ * The time in us that percent of the recorded times are at or below.  The value returned is
+ * the top of the bucket, but never more than the longest time recorded.
+ */
+uint32_t latency_percentile(enum LATENCY_STAGE stage, double percent) {
+	if (stage < 0 || stage >= LATENCY_NUM_STAGES) return 0;
+	struct latency_hist *hist = &latency_hists[stage];
+	uint64_t count = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++)
+		count += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+	if (count == 0) return 0;
+	uint64_t target = (uint64_t)(count * percent / 100.0 + 0.5);
+	if (target == 0) target = 1;
+	if (target > count) target = count;
+	uint32_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	uint64_t seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target) {
+			uint32_t value = latency_bucket_value(i);
+			return value < max ? value : max;
+		}
+	}
+	return max;
+}
+
+void latency_get_summary(enum LATENCY_STAGE stage, LATENCY_SUMMARY *summary) {
+	memset(summary, 0, sizeof(LATENCY_SUMMARY));
+	if (stage < 0 || stage >= LATENCY_NUM_STAGES) return;
+	struct latency_hist *hist = &latency_hists[stage];
+	summary->count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+	if (summary->count == 0) return;
+	summary->mean = __atomic_load_n(&hist->total, __ATOMIC_RELAXED) / summary->count;
+	summary->p50 = latency_percentile(stage, 50);
+	summary->p90 = latency_percentile(stage, 90);
+	summary->p99 = latency_percentile(stage, 99);
+	summary->p999 = latency_percentile(stage, 99.9);
+	summary->max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+}
+
+char *latency_stage_str(enum LATENCY_STAGE stage) {
+	if (stage < 0 || stage >= LATENCY_NUM_STAGES) return "";
+	return latency_stage_names[stage];
+}
+
+/**
+ * latency_dump()
+ * Write one line for each stage that has recorded times
+ */
+void latency_dump(FILE *out) {
+	for (int s = 0; s < LATENCY_NUM_STAGES; s++) {
+		LATENCY_SUMMARY summary;
+		latency_get_summary(s, &summary);
+		if (summary.count == 0) continue;
+		fprintf(out, "Latency %-10s n:%u mean:%uus p50:%uus p90:%uus p99:%uus p99.9:%uus max:%uus\n",
+				latency_stage_names[s], summary.count, summary.mean, summary.p50, summary.p90,
+				summary.p99, summary.p999, summary.max);
+	}
+}
+
+/**
+ * latency_set_dump_period()
+ * Dump the histograms to out every this many seconds from latency_tick().  0 stops the dump.
+ */
+void latency_set_dump_period(int seconds, FILE *out) {
+	latency_dump_out = out;
+	__atomic_store_n(&latency_dump_period, seconds, __ATOMIC_RELAXED);
+}
+
+/**
+ * latency_tick()
+ * Call this regularly, e.g. once per pass of the event loop.  The logging thread also calls it
+ * when it is running.
+ */
+void latency_tick(time_t now) {
+	int period = __atomic_load_n(&latency_dump_period, __ATOMIC_RELAXED);
+	if (period <= 0 || latency_dump_out == NULL) return;
+	time_t last = __atomic_load_n(&latency_last_dump, __ATOMIC_RELAXED);
+	if (now - last < period) return;
+	/* Only one caller dumps for each period */
+	if (!__atomic_compare_exchange_n(&latency_last_dump, &last, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+	latency_dump(latency_dump_out);
+}
+
+static int latency_bucket(uint32_t us) {
+	if (us < LATENCY_SUB_BUCKETS) return us;
+	int top = 31 - __builtin_clz(us);
+	int sub = (us >> (top - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+	return LATENCY_SUB_BUCKETS * (top - LATENCY_SUB_BITS + 1) + sub;
+}
+
+/* The largest time that falls in a bucket */
+static uint32_t latency_bucket_value(int bucket) {
+	if (bucket < LATENCY_SUB_BUCKETS) return bucket;
+	int top = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+	int sub = bucket % LATENCY_SUB_BUCKETS;
+	uint64_t low = (uint64_t)(LATENCY_SUB_BUCKETS + sub) << (top - LATENCY_SUB_BITS);
+	uint64_t high = low + (1ULL << (top - LATENCY_SUB_BITS)) - 1;
+	return high > UINT32_MAX ? UINT32_MAX : high;
+}
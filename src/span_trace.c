@@ -0,0 +1,280 @@
+/*
+ * span_trace.c
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Per thread span buffers and the Chrome Trace Event export, see span_trace.h
+ *
+ * A thread claims a buffer from a fixed table the first time it records a span and keeps it
+ * in a thread local pointer.  Only that thread writes to the buffer, so a span is stored with
+ * plain writes and published by a release store of the count.  Like the frame trace, each event
+ * has a seq that is cleared while it is written and set to its index + 1 when it is complete.
+ * The export checks seq before and after it copies an event, so an event that is overwritten
+ * while a live thread keeps tracing is skipped rather than written torn.  When the thread exits a
+ * pthread key destructor marks its buffer as exited.  The spans stay for the export until
+ * every unused buffer is taken, then the buffer is given to a new thread.  When the table is
+ * full of live threads the spans of any further threads are dropped and counted.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+
+#include "common_config.h"
+#include "span_trace.h"
+#include "str_util.h"
+
+#define SPAN_TRACE_INSTANT_DUR UINT32_MAX /* The duration stored for an instant */
+
+/* The state of a buffer in the table */
+#define SPAN_TRACE_FREE 0 /* Never claimed */
+#define SPAN_TRACE_OWNED 1 /* Written by a running thread */
+#define SPAN_TRACE_EXITED 2 /* Its thread has exited.  Kept for the export until it is reused */
+
+struct span_trace_event {
+	uint32_t seq; /* Index of the span + 1, or 0 while it is being written */
+	const char *name;
+	uint64_t start_ns;
+	uint32_t dur_ns;
+};
+
+struct span_trace_buffer {
+	int state;
+	int tid;
+	char name[SPAN_TRACE_NAME_LEN];
+	uint32_t count; /* Spans ever written.  The last SPAN_TRACE_EVENTS are kept */
+	struct span_trace_event events[SPAN_TRACE_EVENTS];
+};
+
+_Static_assert((SPAN_TRACE_EVENTS & (SPAN_TRACE_EVENTS - 1)) == 0, "SPAN_TRACE_EVENTS must be a power of 2");
+
+int span_trace_on = false;
+static struct span_trace_buffer span_trace_buffers[SPAN_TRACE_MAX_THREADS];
+static uint32_t span_trace_dropped = 0;
+static pthread_once_t span_trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t span_trace_key;
+static __thread struct span_trace_buffer *span_trace_buffer = NULL;
+static __thread char span_trace_thread_name[SPAN_TRACE_NAME_LEN];
+
+/* Forward declarations */
+static struct span_trace_buffer *span_trace_get_buffer();
+static struct span_trace_buffer *span_trace_claim(int from_state);
+static void span_trace_make_key();
+static void span_trace_thread_exit(void *buffer);
+static int span_trace_read_event(struct span_trace_buffer *buffer, uint32_t index, struct span_trace_event *event);
+static void span_trace_json_str(FILE *out, const char *str);
+static void span_trace_add(const char *name, uint64_t start_ns, uint32_t dur_ns);
+static uint64_t span_trace_now();
+
+void span_trace_enable(int on) {
+	__atomic_store_n(&span_trace_on, on, __ATOMIC_RELAXED);
+}
+
+/**
+ * span_trace_name_thread()
+ * Name the calling thread in the exported trace, e.g. "tnc listen".  This does not claim a
+ * buffer, the name is kept until the thread records its first span.
+ */
+void span_trace_name_thread(const char *name) {
+	strlcpy(span_trace_thread_name, name, sizeof(span_trace_thread_name));
+	if (span_trace_buffer != NULL)
+		strlcpy(span_trace_buffer->name, name, sizeof(span_trace_buffer->name));
+}
+
+/**
+ * span_trace_begin()
+ * The start time of a span, or 0 if tracing is off
+ */
+uint64_t span_trace_begin() {
+	if (!__atomic_load_n(&span_trace_on, __ATOMIC_RELAXED)) return 0;
+	return span_trace_now();
+}
+
+/**
+ * span_trace_end()
+ * Record a span that started at start_ns.  Nothing is recorded if tracing was off when it
+ * started.
+ */
+void span_trace_end(const char *name, uint64_t start_ns) {
+	if (start_ns == 0) return;
+	uint64_t dur = span_trace_now() - start_ns;
+	span_trace_add(name, start_ns, dur >= SPAN_TRACE_INSTANT_DUR ? SPAN_TRACE_INSTANT_DUR - 1 : dur);
+}
+
+void span_trace_instant(const char *name) {
+	if (!__atomic_load_n(&span_trace_on, __ATOMIC_RELAXED)) return;
+	span_trace_add(name, span_trace_now(), SPAN_TRACE_INSTANT_DUR);
+}
+
+void span_trace_scope_end(SPAN_TRACE_SCOPE *scope) {
+	span_trace_end(scope->name, scope->start_ns);
+}
+
+/**
+ * span_trace_clear()
+ * Forget the recorded spans.  Call this while tracing is off.
+ */
+void span_trace_clear() {
+	for (int i = 0; i < SPAN_TRACE_MAX_THREADS; i++)
+		__atomic_store_n(&span_trace_buffers[i].count, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&span_trace_dropped, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * span_trace_export()
+ * Write the spans of every thread to a file as Chrome Trace Event JSON.  Times are in
+ * microseconds from CLOCK_MONOTONIC.
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE if the file could not be written
+ */
+int span_trace_export(char *path) {
+	FILE *out = fopen(path, "w");
+	if (out == NULL) {
+		error_print("Could not open trace file %s\n", path);
+		return EXIT_FAILURE;
+	}
+	int pid = getpid();
+	int first = true;
+	fprintf(out, "{\"traceEvents\":[\n");
+	for (int i = 0; i < SPAN_TRACE_MAX_THREADS; i++) {
+		struct span_trace_buffer *buffer = &span_trace_buffers[i];
+		if (__atomic_load_n(&buffer->state, __ATOMIC_ACQUIRE) == SPAN_TRACE_FREE) continue;
+		if (buffer->name[0] != '\0') {
+			char name[SPAN_TRACE_NAME_LEN];
+			memcpy(name, buffer->name, sizeof(name));
+			name[sizeof(name) - 1] = '\0';
+			fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+					first ? "" : ",\n", pid, buffer->tid);
+			span_trace_json_str(out, name);
+			fprintf(out, "}}");
+			first = false;
+		}
+		uint32_t count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+		uint32_t start = count > SPAN_TRACE_EVENTS ? count - SPAN_TRACE_EVENTS : 0;
+		for (uint32_t j = start; j != count; j++) {
+			struct span_trace_event event;
+			if (!span_trace_read_event(buffer, j, &event)) continue;
+			uint64_t ts = event.start_ns;
+			fprintf(out, "%s{\"name\":", first ? "" : ",\n");
+			span_trace_json_str(out, event.name);
+			if (event.dur_ns == SPAN_TRACE_INSTANT_DUR)
+				fprintf(out, ",\"cat\":\"iors\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d}",
+						(unsigned long long)(ts / 1000), (unsigned)(ts % 1000), pid, buffer->tid);
+			else
+				fprintf(out, ",\"cat\":\"iors\",\"ph\":\"X\",\"ts\":%llu.%03u,\"dur\":%u.%03u,\"pid\":%d,\"tid\":%d}",
+						(unsigned long long)(ts / 1000), (unsigned)(ts % 1000),
+						event.dur_ns / 1000, event.dur_ns % 1000, pid, buffer->tid);
+			first = false;
+		}
+	}
+	fprintf(out, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_spans\":%u}}\n",
+			__atomic_load_n(&span_trace_dropped, __ATOMIC_RELAXED));
+	int rc = ferror(out) ? EXIT_FAILURE : EXIT_SUCCESS;
+	if (fclose(out) != 0) rc = EXIT_FAILURE;
+	return rc;
+}
+
+/**
+ * span_trace_get_buffer()
+ * The buffer for the calling thread, claimed the first time it records a span.  An unused
+ * buffer is taken first, otherwise the buffer of a thread that has exited.
+ *
+ * Returns the buffer or NULL if every buffer belongs to a running thread
+ */
+static struct span_trace_buffer *span_trace_get_buffer() {
+	if (span_trace_buffer != NULL) return span_trace_buffer;
+	struct span_trace_buffer *buffer = span_trace_claim(SPAN_TRACE_FREE);
+	if (buffer == NULL)
+		buffer = span_trace_claim(SPAN_TRACE_EXITED);
+	if (buffer == NULL) return NULL;
+	buffer->tid = syscall(SYS_gettid);
+	strlcpy(buffer->name, span_trace_thread_name, sizeof(buffer->name));
+	__atomic_store_n(&buffer->count, 0, __ATOMIC_RELEASE);
+	pthread_once(&span_trace_key_once, span_trace_make_key);
+	pthread_setspecific(span_trace_key, buffer);
+	span_trace_buffer = buffer;
+	return buffer;
+}
+
+/**
+ * span_trace_claim()
+ * Take the first buffer in from_state for the calling thread
+ *
+ * Returns the buffer or NULL if no buffer is in from_state
+ */
+static struct span_trace_buffer *span_trace_claim(int from_state) {
+	for (int i = 0; i < SPAN_TRACE_MAX_THREADS; i++) {
+		int state = from_state;
+		if (__atomic_compare_exchange_n(&span_trace_buffers[i].state, &state, SPAN_TRACE_OWNED, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return &span_trace_buffers[i];
+	}
+	return NULL;
+}
+
+static void span_trace_make_key() {
+	pthread_key_create(&span_trace_key, span_trace_thread_exit);
+}
+
+/**
+ * span_trace_thread_exit()
+ * Called when a thread that owns a buffer exits, so the buffer can be given to another thread
+ */
+static void span_trace_thread_exit(void *buffer) {
+	__atomic_store_n(&((struct span_trace_buffer *)buffer)->state, SPAN_TRACE_EXITED, __ATOMIC_RELEASE);
+}
+
+static void span_trace_add(const char *name, uint64_t start_ns, uint32_t dur_ns) {
+	struct span_trace_buffer *buffer = span_trace_get_buffer();
+	if (buffer == NULL) {
+		__atomic_fetch_add(&span_trace_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	uint32_t count = __atomic_load_n(&buffer->count, __ATOMIC_RELAXED);
+	struct span_trace_event *event = &buffer->events[count & (SPAN_TRACE_EVENTS - 1)];
+	__atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	event->name = name;
+	event->start_ns = start_ns;
+	event->dur_ns = dur_ns;
+	__atomic_store_n(&event->seq, count + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&buffer->count, count + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * span_trace_read_event()
+ * Copy the event with this index if it is complete and has not been overwritten
+ *
+ * Returns true if the event was copied
+ */
+static int span_trace_read_event(struct span_trace_buffer *buffer, uint32_t index, struct span_trace_event *event) {
+	struct span_trace_event *slot = &buffer->events[index & (SPAN_TRACE_EVENTS - 1)];
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != index + 1) return false;
+	memcpy(event, slot, sizeof(struct span_trace_event));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != index + 1) return false;
+	return true;
+}
+
+/* Write a string as a JSON string, escaping quotes and backslashes and dropping control characters */
+static void span_trace_json_str(FILE *out, const char *str) {
+	fputc('"', out);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', out);
+		if ((unsigned char)*str >= ' ')
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+static uint64_t span_trace_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
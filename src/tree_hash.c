@@ -0,0 +1,385 @@
+/*
+ * tree_hash.c
+ *
+ *  Created on: Oct 18, 2026
+ *
+ * Merkle tree hash of large files.  See tree_hash.h for the definition of the tree
+ * and the manifest format.
+ *
+ * A single SHA256 chain can only use one core.  Here the leaves are independent, so a
+ * small pool of threads takes the next unhashed leaf until they are all done.  Each
+ * thread reads its leaf with pread() into its own buffer, so memory use is one leaf
+ * per thread whatever the size of the file.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "common_config.h"
+#include "tree_hash.h"
+
+#define LEAF_PREFIX 0x00
+#define NODE_PREFIX 0x01
+
+struct tree_hash_job {
+	int fd;
+	uint32_t leaf_size;
+	uint64_t file_len;
+	uint32_t num_leaves;
+	uint8_t (*leaves)[SHA256_HASH_SIZE];
+	uint32_t next_leaf; /* Taken with an atomic add by each worker */
+	int err;
+};
+
+/* Forward declarations */
+static void *tree_hash_worker(void *arg);
+static int tree_hash_run(int fd, uint32_t leaf_size, uint64_t file_len, uint32_t num_leaves,
+		uint8_t (*leaves)[SHA256_HASH_SIZE], int threads);
+static void store32(uint8_t *p, uint32_t v);
+static void store64(uint8_t *p, uint64_t v);
+static uint32_t load32(uint8_t *p);
+static uint64_t load64(uint8_t *p);
+
+uint32_t tree_hash_num_leaves(uint64_t file_len, uint32_t leaf_size) {
+	if (file_len == 0) return 1;
+	return (uint32_t)((file_len + leaf_size - 1) / leaf_size);
+}
+
+void tree_hash_leaf(uint8_t *data, uint32_t len, uint8_t *out) {
+	Sha256Context ctx;
+	uint8_t prefix = LEAF_PREFIX;
+	Sha256Initialise(&ctx);
+	Sha256Update(&ctx, &prefix, 1);
+	Sha256Update(&ctx, data, len);
+	Sha256Finalise(&ctx, (SHA256_HASH *)out);
+}
+
+/**
+ * tree_hash_root()
+ * Combine the leaf hashes into the root.  The left subtree is the largest power of two
+ * that is smaller than the number of leaves.  A single leaf is its own root.
+ */
+void tree_hash_root(uint8_t (*leaves)[SHA256_HASH_SIZE], uint32_t num_leaves, uint8_t *root) {
+	if (num_leaves == 1) {
+		memcpy(root, leaves[0], SHA256_HASH_SIZE);
+		return;
+	}
+	uint32_t k = 1;
+	while (k * 2 < num_leaves)
+		k = k * 2;
+
+	uint8_t left[SHA256_HASH_SIZE];
+	uint8_t right[SHA256_HASH_SIZE];
+	tree_hash_root(leaves, k, left);
+	tree_hash_root(leaves + k, num_leaves - k, right);
+
+	Sha256Context ctx;
+	uint8_t prefix = NODE_PREFIX;
+	Sha256Initialise(&ctx);
+	Sha256Update(&ctx, &prefix, 1);
+	Sha256Update(&ctx, left, sizeof(left));
+	Sha256Update(&ctx, right, sizeof(right));
+	Sha256Finalise(&ctx, (SHA256_HASH *)root);
+}
+
+/**
+ * tree_hash_file()
+ * Hash a file with the given leaf size using up to threads worker threads.  If threads
+ * is zero or less then one thread per online cpu is used.  The leaf hashes are allocated
+ * and must be released with tree_hash_free().
+ *
+ * Returns EXIT_SUCCESS or EXIT_FAILURE if the file could not be read
+ */
+int tree_hash_file(char *path, uint32_t leaf_size, int threads, TREE_HASH *tree) {
+	memset(tree, 0, sizeof(TREE_HASH));
+	if (leaf_size < TREE_HASH_MIN_LEAF_SIZE) {
+		error_print("Leaf size %d is too small\n", leaf_size);
+		return EXIT_FAILURE;
+	}
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return EXIT_FAILURE;
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	tree->leaf_size = leaf_size;
+	tree->file_len = st.st_size;
+	tree->num_leaves = tree_hash_num_leaves(tree->file_len, leaf_size);
+	tree->leaves = malloc((size_t)tree->num_leaves * SHA256_HASH_SIZE);
+	if (tree->leaves == NULL) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	int rc = tree_hash_run(fd, leaf_size, tree->file_len, tree->num_leaves, tree->leaves, threads);
+	close(fd);
+	if (rc != EXIT_SUCCESS) {
+		tree_hash_free(tree);
+		return EXIT_FAILURE;
+	}
+	tree_hash_root(tree->leaves, tree->num_leaves, tree->root);
+	return EXIT_SUCCESS;
+}
+
+void tree_hash_free(TREE_HASH *tree) {
+	free(tree->leaves);
+	tree->leaves = NULL;
+	tree->num_leaves = 0;
+}
+
+/**
+ * tree_hash_verify_chunk()
+ * Check one chunk against its leaf hash.  This can be called as each chunk of an upload
+ * arrives, rather than hashing the whole file at the end.
+ *
+ * Returns EXIT_SUCCESS if the chunk is correct otherwise EXIT_FAILURE
+ */
+int tree_hash_verify_chunk(TREE_HASH *tree, uint32_t index, uint8_t *data, uint32_t len) {
+	if (index >= tree->num_leaves) return EXIT_FAILURE;
+	uint64_t start = (uint64_t)index * tree->leaf_size;
+	uint64_t expected = tree->file_len - start;
+	if (expected > tree->leaf_size) expected = tree->leaf_size;
+	if (tree->file_len == 0) expected = 0;
+	if (len != expected) return EXIT_FAILURE;
+
+	uint8_t hash[SHA256_HASH_SIZE];
+	tree_hash_leaf(data, len, hash);
+	if (memcmp(hash, tree->leaves[index], SHA256_HASH_SIZE) != 0)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * tree_hash_verify_file()
+ * Hash the file in parallel and compare every leaf with the tree.  The index of each bad
+ * leaf is stored in bad_leaves, up to max_bad of them, so that just those chunks can be
+ * requested again and fixed with tree_hash_repair_chunk().
+ *
+ * Returns the number of bad leaves, 0 if the file is correct, or -1 on a read error
+ */
+int tree_hash_verify_file(char *path, TREE_HASH *tree, int threads, uint32_t *bad_leaves, uint32_t max_bad) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return -1;
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+	uint8_t (*leaves)[SHA256_HASH_SIZE] = malloc((size_t)tree->num_leaves * SHA256_HASH_SIZE);
+	if (leaves == NULL) {
+		close(fd);
+		return -1;
+	}
+	/* Hash the leaves the tree expects.  Leaves missing from a short file come out as short
+	 * or empty leaves, which will not match. */
+	int rc = tree_hash_run(fd, tree->leaf_size, tree->file_len, tree->num_leaves, leaves, threads);
+	close(fd);
+	if (rc != EXIT_SUCCESS) {
+		free(leaves);
+		return -1;
+	}
+
+	int bad = 0;
+	for (uint32_t i = 0; i < tree->num_leaves; i++) {
+		int leaf_bad = memcmp(leaves[i], tree->leaves[i], SHA256_HASH_SIZE) != 0;
+		uint64_t end = (uint64_t)(i + 1) * tree->leaf_size;
+		if (end > tree->file_len) end = tree->file_len;
+		if (end > (uint64_t)st.st_size) leaf_bad = true;
+		if (leaf_bad) {
+			if (bad_leaves != NULL && bad < max_bad)
+				bad_leaves[bad] = i;
+			bad++;
+		}
+	}
+	free(leaves);
+	return bad;
+}
+
+/**
+ * tree_hash_repair_chunk()
+ * Write a replacement chunk into the file, but only if it matches its leaf hash.
+ *
+ * Returns EXIT_SUCCESS if the chunk was written otherwise EXIT_FAILURE
+ */
+int tree_hash_repair_chunk(char *path, TREE_HASH *tree, uint32_t index, uint8_t *data, uint32_t len) {
+	if (tree_hash_verify_chunk(tree, index, data, len) != EXIT_SUCCESS) {
+		debug_print("Chunk %d does not match the tree, not written\n", index);
+		return EXIT_FAILURE;
+	}
+	int fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd == -1) return EXIT_FAILURE;
+	ssize_t n = pwrite(fd, data, len, (off_t)index * tree->leaf_size);
+	int rc = close(fd);
+	if (n != len || rc == -1) return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * tree_hash_save()
+ * Write the tree to a manifest file.  It is written to a tmp file and renamed so that we get
+ * the whole manifest or keep the old one.
+ */
+int tree_hash_save(char *path, TREE_HASH *tree) {
+	uint8_t header[TREE_HASH_HEADER_SIZE];
+	store32(header, TREE_HASH_MAGIC);
+	header[4] = 0;
+	header[5] = TREE_HASH_VERSION;
+	header[6] = 0;
+	header[7] = 0;
+	store32(header + 8, tree->leaf_size);
+	store64(header + 12, tree->file_len);
+	store32(header + 20, tree->num_leaves);
+	memcpy(header + 24, tree->root, SHA256_HASH_SIZE);
+
+	char tmp_filename[MAX_FILE_PATH_LEN];
+	snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", path);
+	FILE * outfile = fopen(tmp_filename, "wb");
+	if (outfile == NULL) return EXIT_FAILURE;
+	size_t n = fwrite(header, 1, sizeof(header), outfile);
+	n += fwrite(tree->leaves, SHA256_HASH_SIZE, tree->num_leaves, outfile) * SHA256_HASH_SIZE;
+	if (fclose(outfile) != 0 || n != sizeof(header) + (size_t)tree->num_leaves * SHA256_HASH_SIZE) {
+		remove(tmp_filename);
+		return EXIT_FAILURE;
+	}
+	if (rename(tmp_filename, path) == -1) return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * tree_hash_load()
+ * Read a manifest file.  The root is recalculated from the leaves and must match the stored
+ * root.  The caller should authenticate the root before trusting the tree.
+ */
+int tree_hash_load(char *path, TREE_HASH *tree) {
+	uint8_t header[TREE_HASH_HEADER_SIZE];
+	memset(tree, 0, sizeof(TREE_HASH));
+	FILE * infile = fopen(path, "rb");
+	if (infile == NULL) return EXIT_FAILURE;
+	if (fread(header, 1, sizeof(header), infile) != sizeof(header)
+			|| load32(header) != TREE_HASH_MAGIC || header[5] != TREE_HASH_VERSION) {
+		fclose(infile);
+		return EXIT_FAILURE;
+	}
+	tree->leaf_size = load32(header + 8);
+	tree->file_len = load64(header + 12);
+	tree->num_leaves = load32(header + 20);
+	memcpy(tree->root, header + 24, SHA256_HASH_SIZE);
+	if (tree->leaf_size < TREE_HASH_MIN_LEAF_SIZE
+			|| tree->num_leaves != tree_hash_num_leaves(tree->file_len, tree->leaf_size)) {
+		fclose(infile);
+		return EXIT_FAILURE;
+	}
+
+	tree->leaves = malloc((size_t)tree->num_leaves * SHA256_HASH_SIZE);
+	if (tree->leaves == NULL) {
+		fclose(infile);
+		return EXIT_FAILURE;
+	}
+	size_t n = fread(tree->leaves, SHA256_HASH_SIZE, tree->num_leaves, infile);
+	fclose(infile);
+	if (n != tree->num_leaves) {
+		tree_hash_free(tree);
+		return EXIT_FAILURE;
+	}
+
+	uint8_t root[SHA256_HASH_SIZE];
+	tree_hash_root(tree->leaves, tree->num_leaves, root);
+	if (memcmp(root, tree->root, SHA256_HASH_SIZE) != 0) {
+		debug_print("Tree hash manifest is corrupt: %s\n", path);
+		tree_hash_free(tree);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+static int tree_hash_run(int fd, uint32_t leaf_size, uint64_t file_len, uint32_t num_leaves,
+		uint8_t (*leaves)[SHA256_HASH_SIZE], int threads) {
+	struct tree_hash_job job;
+	job.fd = fd;
+	job.leaf_size = leaf_size;
+	job.file_len = file_len;
+	job.num_leaves = num_leaves;
+	job.leaves = leaves;
+	job.next_leaf = 0;
+	job.err = 0;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > TREE_HASH_MAX_THREADS) threads = TREE_HASH_MAX_THREADS;
+	if (threads > num_leaves) threads = num_leaves;
+	if (threads < 1) threads = 1;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	/* The calling thread does its share of the work too */
+	pthread_t pool[TREE_HASH_MAX_THREADS];
+	int started = 0;
+	for (int i = 1; i < threads; i++) {
+		if (pthread_create(&pool[started], NULL, tree_hash_worker, &job) != 0)
+			break; // carry on with the threads we have
+		started++;
+	}
+	tree_hash_worker(&job);
+	for (int i = 0; i < started; i++)
+		pthread_join(pool[i], NULL);
+
+	if (job.err) return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+static void *tree_hash_worker(void *arg) {
+	struct tree_hash_job *job = (struct tree_hash_job *)arg;
+	uint8_t *buf = malloc(job->leaf_size);
+	if (buf == NULL) {
+		__atomic_store_n(&job->err, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	while (1) {
+		uint32_t i = __atomic_fetch_add(&job->next_leaf, 1, __ATOMIC_RELAXED);
+		if (i >= job->num_leaves) break;
+		uint64_t start = (uint64_t)i * job->leaf_size;
+		uint64_t len = job->file_len > start ? job->file_len - start : 0;
+		if (len > job->leaf_size) len = job->leaf_size;
+
+		uint32_t got = 0;
+		while (got < len) {
+			ssize_t n = pread(job->fd, buf + got, len - got, (off_t)(start + got));
+			if (n < 0) {
+				__atomic_store_n(&job->err, 1, __ATOMIC_RELAXED);
+				break;
+			}
+			if (n == 0) break; // short file, hash what is there
+			got += n;
+		}
+		tree_hash_leaf(buf, got, job->leaves[i]);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void store32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void store64(uint8_t *p, uint64_t v) {
+	store32(p, (uint32_t)(v >> 32));
+	store32(p + 4, (uint32_t)v);
+}
+
+static uint32_t load32(uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t load64(uint8_t *p) {
+	return ((uint64_t)load32(p) << 32) | load32(p + 4);
+}